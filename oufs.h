@@ -18,6 +18,8 @@
 
 // Implementation of min operator
 #define MIN(a, b) (((a) > (b)) ? (b) : (a))
+// Implementation of max operator
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
 
 /**********************************************************************/
 /*
@@ -27,6 +29,7 @@ Block 0: Master block
 Blocks 1 ... N_INODE_BLOCKS: inodes
 Blocks N_INODE_BLOCKS+1 ... N_BLOCKS_ON_DISK-1: data for files and directories
    (Block N_BLOCKS+1 is allocated for the root directory)
+   (Block N_BLOCKS+2 is reserved for the snapshot table)
 */
 
 /**********************************************************************/
@@ -47,6 +50,9 @@ typedef unsigned short INODE_REFERENCE;
 // The block on the virtual disk containing the root directory
 #define ROOT_DIRECTORY_BLOCK (N_INODE_BLOCKS + 1)
 
+// The block that zformat reserves for the snapshot table
+#define SNAPSHOT_TABLE_BLOCK (ROOT_DIRECTORY_BLOCK + 1)
+
 // Size of file/directory name
 #define FILE_NAME_SIZE (16 - sizeof(INODE_REFERENCE))
 
@@ -67,6 +73,12 @@ typedef struct data_block_s
 #define IT_NONE 'N'
 #define IT_DIRECTORY 'D'
 #define IT_FILE 'F'
+// File small enough for its contents to be kept in the inode itself: the
+// bytes of data[] hold the file instead of block references
+#define IT_INLINE_FILE 'I'
+// Compressed file: data[] holds the blocks of one compressed stream for the
+// whole file (see COMPRESSED_HEADER_SIZE); size is the uncompressed size
+#define IT_COMPRESSED_FILE 'Z'
 
 // Single inode
 typedef struct inode_s
@@ -84,6 +96,15 @@ typedef struct inode_s
   unsigned int size;
 } INODE;
 
+// Largest file whose contents fit in an inode (IT_INLINE_FILE)
+#define INLINE_DATA_SIZE (sizeof(BLOCK_REFERENCE) * BLOCKS_PER_INODE)
+
+// A compressed stream starts with its length (2 bytes, little endian),
+// followed by an LZ4 block.  COMPRESSED_RAW as the length means that the
+// file did not compress and its bytes follow as they are
+#define COMPRESSED_HEADER_SIZE 2
+#define COMPRESSED_RAW 0xFFFF
+
 // Number of inodes stored in each block
 #define INODES_PER_BLOCK (BLOCK_SIZE/sizeof(INODE))
 
@@ -112,6 +133,84 @@ typedef struct master_block_s
   unsigned char block_allocated_flag[N_BLOCKS_IN_DISK >> 3];
 } MASTER_BLOCK;
 
+/**********************************************************************/
+// Block 0, extended view
+//
+// MASTER_BLOCK only occupies the first few bytes of block 0.  Tables added
+// after project 4 live in the remainder of the block, behind MASTER_BLOCK,
+// which is left exactly as it was.  They are only valid when zformat has
+// stamped the magic bytes.
+#define MASTER_EXT_MAGIC_0 'O'
+#define MASTER_EXT_MAGIC_1 'X'
+
+typedef struct master_ext_s
+{
+  MASTER_BLOCK master;
+
+  // MASTER_EXT_MAGIC_0, MASTER_EXT_MAGIC_1 on disks formatted with these tables
+  unsigned char magic[2];
+
+  // 8 data blocks per byte: 1 = allocated by oufs_fallocate() and never
+  // written since.  The on-disk contents are undefined: reads return zeros
+  unsigned char block_unwritten_flag[N_BLOCKS_IN_DISK >> 3];
+
+  // One counter per block: number of references to the block beyond the
+  // first (0 = owned by a single inode).  Blocks shared by clones are copied
+  // before they are written
+  unsigned char block_extra_refs[N_BLOCKS_IN_DISK];
+
+  // Block holding the snapshot table (0: the disk was formatted without one)
+  BLOCK_REFERENCE snapshot_table;
+
+  // Optional behaviour chosen by zformat (MASTER_FEATURE_*)
+  unsigned char features;
+
+  // Dedup index: 8 data blocks per byte, 1 = file data block that later
+  // writes may share.  The fingerprint of each block is the checksum that
+  // the virtual disk keeps for it
+  unsigned char block_dedup_flag[N_BLOCKS_IN_DISK >> 3];
+
+  // Number of blocks on the disk (0: N_BLOCKS_IN_DISK).  The blocks from
+  // here to N_BLOCKS_IN_DISK do not exist: they stay marked allocated in
+  // block_allocated_flag so that nothing ever hands them out
+  BLOCK_REFERENCE n_blocks;
+} MASTER_EXT;
+
+// MASTER_EXT features
+// Blocks written with the same contents as an indexed block share it
+#define MASTER_FEATURE_DEDUP 0x01
+
+/**********************************************************************/
+// Snapshot table
+//
+// A snapshot keeps copies of the master block and of every inode block.  The
+// file and directory blocks that its inodes refer to are not copied: they
+// are shared with the live file system through block_extra_refs, and copied
+// by whichever side writes to them first.
+typedef struct snapshot_entry_s
+{
+  // Name of the snapshot ("" if this entry is not used)
+  char name[FILE_NAME_SIZE];
+
+  // Copy of the master block
+  BLOCK_REFERENCE master;
+
+  // Copies of the inode blocks
+  BLOCK_REFERENCE inode_blocks[N_INODE_BLOCKS];
+
+  // Creation time (seconds since the epoch)
+  unsigned int created;
+} SNAPSHOT_ENTRY;
+
+// Number of snapshots that fit in the table
+#define SNAPSHOTS_PER_BLOCK (BLOCK_SIZE / sizeof(SNAPSHOT_ENTRY))
+
+// Snapshot table block
+typedef struct snapshot_block_s
+{
+  SNAPSHOT_ENTRY entry[SNAPSHOTS_PER_BLOCK];
+} SNAPSHOT_BLOCK;
+
 /**********************************************************************/
 // Single directory element
 typedef struct directory_entry_s
@@ -137,14 +236,19 @@ typedef struct directory_block_s
 // All-encompassing structure for a disk block
 // The union says that all 4 of these elements occupy overlapping bytes in 
 //  memory (hence, a block will only be one of these 4 at any given time)
+//  (master_ext is just a wider view of the master block)
 typedef union block_u
 {
   DATA_BLOCK data;
   MASTER_BLOCK master;
+  MASTER_EXT master_ext;
   INODE_BLOCK inodes;
   DIRECTORY_BLOCK directory;
+  SNAPSHOT_BLOCK snapshots;
 } BLOCK;
 
+_Static_assert(sizeof(MASTER_EXT) <= BLOCK_SIZE, "MASTER_EXT must fit in block 0");
+
 
 /**********************************************************************/
 // Representing files (project 4!)
@@ -154,6 +258,27 @@ typedef struct oufile_s
   INODE_REFERENCE inode_reference;
   char mode;
   int offset;
+
+  // Sequential read detection (in-memory only, never stored on disk)
+  // Index of the data block that a sequential reader will ask for next
+  int ra_next_block;
+  // Current readahead window, in blocks (0: no sequential access seen yet)
+  int ra_window;
+  // One past the last data block index that has been prefetched
+  int ra_prefetched;
+
+  // Delayed allocation: bytes written but not yet stored on the disk.  They
+  // belong at file offset wbuf_offset.  Blocks for them are only allocated
+  // when the buffer is flushed (oufs_fflush() / oufs_fclose())
+  unsigned char *wbuf;
+  int wbuf_offset;
+  int wbuf_len;
+
+  // Mode 'w': set once the file contents have been discarded
+  int truncated;
+
+  // Store the file compressed once it has been truncated (zcreate -c)
+  int compress;
 } OUFILE;
 
 
@@ -4,11 +4,103 @@
 
 #define MAX_PATH_LENGTH 200
 
+// Smallest disk that zformat and zresize accept: the master block, the inode
+// blocks, the root directory, the snapshot table and one more block
+#define OUFS_MIN_BLOCKS (SNAPSHOT_TABLE_BLOCK + 2)
+
+// Readahead window bounds for sequential file reads, in blocks
+#define OUFS_READAHEAD_MIN 2
+#define OUFS_READAHEAD_MAX 8
+
+// Most directory blocks one batch rewrites (a move changes three: the new
+// parent's, the old parent's and the ".." entry of a directory)
+#define OUFS_BATCH_DIR_BLOCKS 4
+
+// A set of metadata updates applied together (tree operations): the master
+// block and each inode block are read at most once and written back once
+typedef struct oufs_batch_s
+{
+  BLOCK master;
+  int master_dirty;
+  BLOCK inode_blocks[N_INODE_BLOCKS];
+  // Per inode block: 0 = not loaded, 1 = loaded, 2 = modified
+  unsigned char inode_block_state[N_INODE_BLOCKS];
+  // Directory blocks rewritten by the batch, written out by the commit
+  BLOCK dir_blocks[OUFS_BATCH_DIR_BLOCKS];
+  BLOCK_REFERENCE dir_block_refs[OUFS_BATCH_DIR_BLOCKS];
+  int n_dir_blocks;
+  // Blocks released by the batch, discarded after the commit
+  BLOCK_REFERENCE freed[N_BLOCKS_IN_DISK];
+  int n_freed;
+} OUFS_BATCH;
+
+// What oufs_defrag() found and did
+typedef struct oufs_defrag_stats_s
+{
+  // Inodes made of more than one run of blocks, before defragmenting
+  int n_fragmented;
+  // Files and directories moved into fewer runs
+  int n_moved;
+  // Sparse directories packed into fewer blocks
+  int n_compacted;
+  // Inodes left alone because some of their blocks are shared
+  int n_shared;
+  // Blocks written to new places, and blocks given back by compaction
+  int n_blocks_moved;
+  int n_blocks_released;
+  // Total number of runs over all inodes
+  int runs_before;
+  int runs_after;
+} OUFS_DEFRAG_STATS;
+
+// One entry of a directory stream (oufs_readdir())
+typedef struct oufs_dirent_s
+{
+  char name[FILE_NAME_SIZE];
+  INODE_REFERENCE inode;
+  // Type of the inode (IT_DIRECTORY, IT_FILE, ...)
+  char type;
+} OUFS_DIRENT;
+
+// oufs_opendir() flags
+#define OUFS_DIR_SORTED 0x01    // By name (otherwise in the order on the disk)
+
+// An open directory stream.  Unsorted streams hold one directory block at a
+// time; sorted streams hold them all, each sorted, and merge them.  Either
+// way, each inode block is read at most once, for the types
+typedef struct oufs_dir_s
+{
+  INODE dir;
+  int flags;
+  BLOCK_REFERENCE refs[BLOCKS_PER_INODE];
+  int n_blocks;
+  // Unsorted: blocks[0] is block index `block`; sorted: blocks[b] is refs[b]
+  BLOCK blocks[BLOCKS_PER_INODE];
+  int block;
+  // Next entry to look at, per block
+  int next[BLOCKS_PER_INODE];
+  // Inode blocks read so far (bit per block)
+  BLOCK inode_blocks[N_INODE_BLOCKS];
+  unsigned char inode_blocks_loaded;
+  OUFS_DIRENT current;
+} OUFS_DIR;
+
+// An entry of a directory with its inode (oufs_readdirplus())
+typedef struct oufs_direntplus_s
+{
+  OUFS_DIRENT entry;
+  INODE inode;
+} OUFS_DIRENTPLUS;
+
+// Most entries a directory can have
+#define OUFS_MAX_DIR_ENTRIES (BLOCKS_PER_INODE * DIRECTORY_ENTRIES_PER_BLOCK)
+
 // PROVIDED
 void oufs_get_environment(char *cwd, char *disk_name);
+void oufs_classify_blocks(unsigned char *block_class);
 
 // PROJECT 3
-int oufs_format_disk(char  *virtual_disk_name);
+int oufs_format_disk(char *virtual_disk_name, int features, int n_blocks);
 int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode);
 int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode);
 int oufs_find_file(char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERENCE *child, char *local_name);
@@ -23,6 +115,20 @@ int oufs_touch(char* cwd, char* path);
 void oufs_clean_directory_block(INODE_REFERENCE self, INODE_REFERENCE parent, BLOCK *block);
 void oufs_clean_directory_entry(DIRECTORY_ENTRY *entry);
 BLOCK_REFERENCE oufs_allocate_new_block();
+int oufs_allocate_new_blocks(int n_blocks, BLOCK_REFERENCE goal, BLOCK_REFERENCE *refs);
+int oufs_allocate_blocks_in_master(BLOCK *master, int n_blocks, BLOCK_REFERENCE goal, BLOCK_REFERENCE *refs);
+int oufs_master_has_ext(BLOCK *master);
+int oufs_disk_blocks(BLOCK *master);
+int oufs_count_allocated(unsigned char *flags, int n_bits);
+int oufs_free_blocks_in_master(BLOCK *master, BLOCK_REFERENCE *refs, int n_refs);
+int oufs_block_is_shared(BLOCK *master, BLOCK_REFERENCE block_ref);
+int oufs_dedup_enabled(BLOCK *master);
+BLOCK_REFERENCE oufs_dedup_find(BLOCK *master, BLOCK *contents, BLOCK_REFERENCE avoid);
+int oufs_dedup_register(BLOCK *master, BLOCK_REFERENCE block_ref);
+void oufs_discard_blocks(BLOCK_REFERENCE *refs, int n_refs);
+int oufs_block_is_unwritten(BLOCK *master, BLOCK_REFERENCE block_ref);
+int oufs_unshare_block(BLOCK *master, BLOCK_REFERENCE *ref);
+int oufs_write_directory_block(INODE_REFERENCE dir_ref, INODE *dir, int index, BLOCK *block);
 
 // Helper functions to be provided
 int oufs_find_open_bit(unsigned char value);
@@ -30,8 +136,7 @@ int oufs_find_open_bit(unsigned char value);
 // My own added functions
 int get_inode_reference_from_path(char* path);
 int get_inode_reference_from_path_helper(INODE_REFERENCE parentInodeReference, char* name);
-int comparator(const void* p, const void* q);
-// INODE_REFERENCE oufs_find_directory_element(INODE* inode, char* name);
+INODE_REFERENCE oufs_find_directory_element(INODE* inode, char* name);
 
 
 // PROJECT 4 ONLY
@@ -42,5 +147,81 @@ int oufs_fread(OUFILE *fp, unsigned char * buf, int len);
 int oufs_zmore(OUFILE *fp);
 int oufs_remove(char *cwd, char *path);
 int oufs_link(char *cwd, char *path_src, char *path_dst);
+OUFILE* oufs_new_oufile(INODE_REFERENCE inode_reference, char mode, int offset);
+void oufs_readahead(OUFILE *fp, INODE *inode, int block_index);
+int oufs_fflush(OUFILE *fp);
+int oufs_fallocate(OUFILE *fp, int offset, int len);
+int oufs_pwrite(OUFILE *fp, unsigned char *buf, int len, int offset);
+int oufs_pread(OUFILE *fp, unsigned char *buf, int len, int offset);
+int oufs_lseek(OUFILE *fp, int offset, int whence);
+int oufs_read_file_block(BLOCK *master, INODE *inode, int index, BLOCK *block);
+int oufs_read_file_blocks(BLOCK *master, INODE *inode, int first, int n_blocks, BLOCK *blocks);
+int oufs_read_compressed(BLOCK *master, INODE *inode, unsigned char *contents);
+int oufs_write_compressed(BLOCK *master, INODE *inode, unsigned char *contents, BLOCK_REFERENCE *freed, int *n_freed);
+int oufs_is_file(INODE *inode);
+int oufs_promote_inline(INODE *inode, BLOCK *master);
+
+// Tree operations
+int oufs_batch_begin(OUFS_BATCH *batch);
+int oufs_batch_read_inode(OUFS_BATCH *batch, INODE_REFERENCE i, INODE *inode);
+int oufs_batch_write_inode(OUFS_BATCH *batch, INODE_REFERENCE i, INODE *inode);
+INODE_REFERENCE oufs_batch_allocate_inode(OUFS_BATCH *batch);
+int oufs_batch_free_inode(OUFS_BATCH *batch, INODE_REFERENCE i);
+int oufs_batch_commit(OUFS_BATCH *batch);
+int oufs_batch_write_directory_block(OUFS_BATCH *batch, INODE_REFERENCE dir_ref, INODE *dir, int index, BLOCK *block);
+int oufs_batch_add_entry(OUFS_BATCH *batch, INODE_REFERENCE dir_ref, char *name, INODE_REFERENCE child);
+INODE_REFERENCE oufs_batch_remove_entry(OUFS_BATCH *batch, INODE_REFERENCE dir_ref, char *name);
+int oufs_remove_tree(char *cwd, char *path, int recursive);
+int oufs_copy_tree(char *cwd, char *src, char *dst, int recursive);
+int oufs_rename(char *cwd, char *src, char *dst);
+int oufs_clone(char *cwd, char *src, char *dst);
+
+// Snapshots
+int oufs_snapshot_create(char *name);
+int oufs_snapshot_list();
+int oufs_snapshot_rollback(char *name);
+int oufs_snapshot_delete(char *name);
+
+// Defragmentation
+int oufs_inode_runs(INODE *inode);
+int oufs_defrag(int check_only, OUFS_DEFRAG_STATS *stats);
+
+// Resizing
+int oufs_resize(int n_blocks);
+
+// Handles (libouf.so)
+//
+// A mounted disk, with its own open file, block cache and working directory:
+// a program can have several disks mounted at once.  The oufs_fs_* calls
+// work on the handle's disk; a handle must only be used by one thread at a
+// time.
+typedef struct oufs_s OUFS;
+
+// oufs_mount() flags
+#define OUFS_MOUNT_CACHE 0x01   // Keep the disk's blocks in memory (vdisk_set_cache())
+
+OUFS *oufs_mount(char *disk_name, int flags);
+int oufs_unmount(OUFS *fs);
+int oufs_fs_chdir(OUFS *fs, char *path);
+INODE_REFERENCE oufs_fs_resolve(OUFS *fs, char *path);
+INODE_REFERENCE oufs_fs_lookup(OUFS *fs, INODE_REFERENCE dir, char *name);
+int oufs_fs_stat(OUFS *fs, INODE_REFERENCE i, INODE *inode);
+OUFILE *oufs_fs_open(OUFS *fs, char *path, char mode);
+OUFILE *oufs_fs_open_inode(OUFS *fs, INODE_REFERENCE i, char mode);
+int oufs_fs_pread(OUFS *fs, OUFILE *fp, unsigned char *buf, int len, int offset);
+int oufs_fs_pwrite(OUFS *fs, OUFILE *fp, unsigned char *buf, int len, int offset);
+void oufs_fs_close(OUFS *fs, OUFILE *fp);
+int oufs_fs_mkdir(OUFS *fs, char *path);
+int oufs_fs_remove(OUFS *fs, char *path);
+int oufs_fs_link(OUFS *fs, char *path_src, char *path_dst);
+
+// Directory streams
+OUFS_DIR *oufs_opendir(char *cwd, char *path, int flags);
+OUFS_DIRENT *oufs_readdir(OUFS_DIR *dir);
+void oufs_closedir(OUFS_DIR *dir);
+int oufs_readdirplus(char *cwd, char *path, int flags, OUFS_DIRENTPLUS *entries);
+
+// Inode table scan
+int oufs_scan_inodes(int (*visit)(INODE_REFERENCE i, INODE *inode, void *arg), void *arg);
 
 #endif
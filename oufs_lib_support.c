@@ -1,6 +1,9 @@
 #include "oufs_lib.h"
+#include "oufs_lz4.h"
 #include <libgen.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <time.h>
 
 #define debug 0
 
@@ -33,6 +36,119 @@ void oufs_get_environment(char *cwd, char *disk_name) {
     // Exists: copy
     strncpy(disk_name, str, strlen(str));
   }
+
+  // I/O statistics (ZSTATS, ZSTATS_FILE) are split by what the blocks hold
+  vdisk_stats_set_classifier(oufs_classify_blocks);
+}
+
+/**
+ * Tell which kind of contents each block holds, for the I/O statistics
+ *
+ * Blocks that no inode refers to (free blocks, the snapshot table and the
+ * snapshots' copies) are VDISK_CLASS_OTHER.
+ *
+ * @param block_class Out: one VDISK_CLASS_* value per block
+ */
+void oufs_classify_blocks(unsigned char *block_class) {
+  memset(block_class, VDISK_CLASS_OTHER, N_BLOCKS_IN_DISK);
+  block_class[MASTER_BLOCK_REFERENCE] = VDISK_CLASS_MASTER;
+
+  BLOCK inode_blocks[N_INODE_BLOCKS];
+  BLOCK_REFERENCE inode_refs[N_INODE_BLOCKS];
+  for (int b = 0; b < N_INODE_BLOCKS; ++b) {
+    inode_refs[b] = b + 1;
+    block_class[b + 1] = VDISK_CLASS_INODE;
+  }
+  if (vdisk_read_blocks(inode_refs, N_INODE_BLOCKS, inode_blocks) != 0)
+    return;
+  for (int i = 0; i < N_INODES; ++i) {
+    INODE *inode =
+        &inode_blocks[i / INODES_PER_BLOCK].inodes.inode[i % INODES_PER_BLOCK];
+    int c;
+    if (inode->type == IT_DIRECTORY)
+      c = VDISK_CLASS_DIRECTORY;
+    else if (inode->type == IT_FILE || inode->type == IT_COMPRESSED_FILE)
+      c = VDISK_CLASS_DATA;
+    else
+      continue;
+    for (int j = 0; j < BLOCKS_PER_INODE; ++j) {
+      if (inode->data[j] < N_BLOCKS_IN_DISK)
+        block_class[inode->data[j]] = c;
+    }
+  }
+}
+
+/**
+ * Format a virtual disk: an empty file system with only the root directory
+ *
+ * The disk is opened and closed here.
+ *
+ * @param virtual_disk_name The disk file (created if needed).  Whatever it
+ * holds is overwritten, so it is opened even if its checksum table is
+ * missing or damaged
+ * @param features MASTER_FEATURE_* flags
+ * @param n_blocks Size of the disk (OUFS_MIN_BLOCKS ... N_BLOCKS_IN_DISK)
+ * @return 0 on success; <0 on error
+ */
+int oufs_format_disk(char *virtual_disk_name, int features, int n_blocks) {
+  VDISK_TRACE("oufs_format_disk");
+  if (n_blocks < OUFS_MIN_BLOCKS || n_blocks > N_BLOCKS_IN_DISK)
+    return (-2);
+  if (vdisk_disk_open_rebuild(virtual_disk_name) != 0)
+    return (-1);
+  int ret = vdisk_resize(n_blocks);
+
+  // Every block starts out as zeros
+  BLOCK block;
+  memset(&block, 0, sizeof(block));
+  for (int b = 0; ret == 0 && b < n_blocks; ++b)
+    ret = vdisk_write_block(b, &block);
+
+  // Master block: the master, inode, root directory and snapshot table
+  // blocks are in use, and so are the blocks beyond the end of the disk
+  BLOCK master;
+  memset(&master, 0, sizeof(master));
+  for (int b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+    if (b <= SNAPSHOT_TABLE_BLOCK || b >= n_blocks)
+      master.master.block_allocated_flag[b >> 3] |= (1 << (b & 7));
+  }
+  master.master.inode_allocated_flag[0] = 1;
+  master.master_ext.magic[0] = MASTER_EXT_MAGIC_0;
+  master.master_ext.magic[1] = MASTER_EXT_MAGIC_1;
+  master.master_ext.snapshot_table = SNAPSHOT_TABLE_BLOCK;
+  master.master_ext.features = features;
+  master.master_ext.n_blocks = n_blocks;
+  if (ret == 0)
+    ret = vdisk_write_block(MASTER_BLOCK_REFERENCE, &master);
+
+  // Inodes: all free but the root directory's
+  INODE inode;
+  inode.type = IT_NONE;
+  inode.n_references = 0;
+  for (int i = 0; i < BLOCKS_PER_INODE; ++i)
+    inode.data[i] = UNALLOCATED_BLOCK;
+  inode.size = 0;
+  for (int i = 0; i < INODES_PER_BLOCK; ++i)
+    block.inodes.inode[i] = inode;
+  for (int b = 1; ret == 0 && b <= N_INODE_BLOCKS; ++b) {
+    if (b == 1) {
+      INODE *root = &block.inodes.inode[0];
+      root->type = IT_DIRECTORY;
+      root->n_references = 1;
+      root->data[0] = ROOT_DIRECTORY_BLOCK;
+      root->size = 2;
+    }
+    ret = vdisk_write_block(b, &block);
+    block.inodes.inode[0] = inode;
+  }
+
+  // Root directory: "." and ".." are both the root
+  oufs_clean_directory_block(0, 0, &block);
+  if (ret == 0)
+    ret = vdisk_write_block(ROOT_DIRECTORY_BLOCK, &block);
+
+  vdisk_disk_close();
+  return (ret);
 }
 
 /**
@@ -93,9 +209,11 @@ void oufs_clean_directory_block(INODE_REFERENCE self, INODE_REFERENCE parent,
  *
  */
 BLOCK_REFERENCE oufs_allocate_new_block() {
+  VDISK_TRACE("oufs_allocate_new_block");
   BLOCK block;
   // Read the master block
-  vdisk_read_block(MASTER_BLOCK_REFERENCE, &block);
+  if (vdisk_read_block(MASTER_BLOCK_REFERENCE, &block) != 0)
+    return (UNALLOCATED_BLOCK);
 
   // Scan for an available block
   int block_byte;
@@ -127,6 +245,13 @@ BLOCK_REFERENCE oufs_allocate_new_block() {
 
   // Now set the bit in the allocation table
   block.master.block_allocated_flag[block_byte] |= (1 << block_bit);
+  // A freshly allocated block has not been preallocated, has one owner and
+  // is not in the dedup index
+  if (oufs_master_has_ext(&block)) {
+    block.master_ext.block_unwritten_flag[block_byte] &= ~(1 << block_bit);
+    block.master_ext.block_dedup_flag[block_byte] &= ~(1 << block_bit);
+    block.master_ext.block_extra_refs[(block_byte << 3) + block_bit] = 0;
+  }
 
   // Write out the updated master block
   vdisk_write_block(MASTER_BLOCK_REFERENCE, &block);
@@ -144,7 +269,296 @@ BLOCK_REFERENCE oufs_allocate_new_block() {
   return (block_reference);
 }
 
+/**
+ * Allocate a set of data blocks with a single update of the master block
+ *
+ * The blocks are taken as one contiguous run whenever possible: first the run
+ * that starts at goal is tried (so that a file keeps growing in place), then
+ * the first run of n_blocks free blocks on the disk.  If there is no such run,
+ * the first free blocks found are used.
+ *
+ * @param n_blocks Number of blocks wanted
+ * @param goal Preferred first block (UNALLOCATED_BLOCK if there is none)
+ * @param refs Array of at least n_blocks entries, filled with the allocated
+ * block indices in ascending order
+ * @return Number of blocks actually allocated (less than n_blocks when the
+ * disk is full)
+ *
+ */
+int oufs_allocate_new_blocks(int n_blocks, BLOCK_REFERENCE goal,
+                             BLOCK_REFERENCE *refs) {
+  VDISK_TRACE("oufs_allocate_new_blocks");
+  if (n_blocks <= 0)
+    return (0);
+
+  BLOCK block;
+  // Read the master block
+  if (vdisk_read_block(MASTER_BLOCK_REFERENCE, &block) != 0)
+    return (0);
+
+  int n_allocated = oufs_allocate_blocks_in_master(&block, n_blocks, goal, refs);
+
+  // Write the master block once
+  if (n_allocated > 0)
+    vdisk_write_block(MASTER_BLOCK_REFERENCE, &block);
+
+  return (n_allocated);
+}
+
+/**
+ * Same as oufs_allocate_new_blocks(), but works on a master block that the
+ * caller has already loaded and will write back itself.
+ *
+ * @param master The master block (updated in memory only)
+ * @param n_blocks Number of blocks wanted
+ * @param goal Preferred first block (UNALLOCATED_BLOCK if there is none)
+ * @param refs Filled with the allocated block indices
+ * @return Number of blocks actually allocated
+ *
+ */
+int oufs_allocate_blocks_in_master(BLOCK *master, int n_blocks,
+                                   BLOCK_REFERENCE goal,
+                                   BLOCK_REFERENCE *refs) {
+  if (n_blocks <= 0)
+    return (0);
+
+  unsigned char *flags = master->master.block_allocated_flag;
+#define BLOCK_IS_FREE(b) (!(flags[(b) >> 3] & (1 << ((b) & 7))))
+
+  // Find the start of a free run of n_blocks
+  int start = -1;
+  if (goal != UNALLOCATED_BLOCK && goal + n_blocks <= N_BLOCKS_IN_DISK) {
+    start = goal;
+    for (int b = goal; b < goal + n_blocks; ++b) {
+      if (!BLOCK_IS_FREE(b)) {
+        start = -1;
+        break;
+      }
+    }
+  }
+  for (int b = 0, run = 0; start == -1 && b < N_BLOCKS_IN_DISK; ++b) {
+    run = BLOCK_IS_FREE(b) ? run + 1 : 0;
+    if (run == n_blocks)
+      start = b - n_blocks + 1;
+  }
+
+  int n_allocated = 0;
+  if (start != -1) {
+    // Contiguous run
+    for (int b = start; b < start + n_blocks; ++b)
+      refs[n_allocated++] = b;
+  } else {
+    // Fragmented: first fit, one block at a time
+    for (int b = 0; n_allocated < n_blocks && b < N_BLOCKS_IN_DISK; ++b) {
+      if (BLOCK_IS_FREE(b))
+        refs[n_allocated++] = b;
+    }
+  }
+#undef BLOCK_IS_FREE
+
+  // Set the block allocated bits; none of these blocks is preallocated or
+  // in the dedup index, and each has a single owner
+  int has_ext = oufs_master_has_ext(master);
+  for (int i = 0; i < n_allocated; ++i) {
+    flags[refs[i] >> 3] |= (1 << (refs[i] & 7));
+    if (has_ext) {
+      master->master_ext.block_unwritten_flag[refs[i] >> 3] &=
+          ~(1 << (refs[i] & 7));
+      master->master_ext.block_dedup_flag[refs[i] >> 3] &=
+          ~(1 << (refs[i] & 7));
+      master->master_ext.block_extra_refs[refs[i]] = 0;
+    }
+  }
+
+  if (debug)
+    fprintf(stderr, "Allocated %d of %d blocks (first=%d)\n", n_allocated,
+            n_blocks, n_allocated ? refs[0] : -1);
+
+  return (n_allocated);
+}
+
+/**
+ * Release a set of data blocks in a master block that the caller has already
+ * loaded and will write back itself
+ *
+ * Only the allocation bits are cleared.  The blocks' contents are left as they
+ * are: every allocator hands out blocks whose contents are undefined, and
+ * their users initialize them in memory before the first write.  A block that
+ * is shared with a clone only loses one reference and stays allocated.
+ *
+ * @param master The master block (updated in memory only)
+ * @param refs The blocks to release.  On return, the first entries are the
+ * blocks that actually became free
+ * @param n_refs Number of entries in refs
+ * @return Number of blocks that became free
+ */
+int oufs_free_blocks_in_master(BLOCK *master, BLOCK_REFERENCE *refs,
+                               int n_refs) {
+  VDISK_TRACE("oufs_free_blocks_in_master");
+  int has_ext = oufs_master_has_ext(master);
+  int n_freed = 0;
+  for (int i = 0; i < n_refs; ++i) {
+    BLOCK_REFERENCE b = refs[i];
+    if (oufs_block_is_shared(master, b)) {
+      // Still used by a clone: just drop this reference
+      --master->master_ext.block_extra_refs[b];
+      continue;
+    }
+    master->master.block_allocated_flag[b >> 3] &= ~(1 << (b & 7));
+    if (has_ext) {
+      master->master_ext.block_unwritten_flag[b >> 3] &= ~(1 << (b & 7));
+      master->master_ext.block_dedup_flag[b >> 3] &= ~(1 << (b & 7));
+    }
+    refs[n_freed++] = b;
+  }
+  return (n_freed);
+}
+
+/**
+ * Optionally let the host file system reclaim the space of freed blocks
+ *
+ * Enabled by setting the ZDISCARD environment variable.  Must only be called
+ * once the master block that frees the blocks has been written.
+ *
+ * @param refs The freed blocks
+ * @param n_refs Number of entries in refs
+ */
+void oufs_discard_blocks(BLOCK_REFERENCE *refs, int n_refs) {
+  if (n_refs > 0 && getenv("ZDISCARD") != NULL)
+    vdisk_discard_blocks(refs, n_refs);
+}
+
+/**
+ * Is a block referenced more than once (shared by clones)?
+ *
+ * @param master The master block
+ * @param block_ref The data block
+ * @return 1 if the block has to be copied before it is changed; 0 otherwise
+ */
+int oufs_block_is_shared(BLOCK *master, BLOCK_REFERENCE block_ref) {
+  if (!oufs_master_has_ext(master) || block_ref >= N_BLOCKS_IN_DISK)
+    return (0);
+  return (master->master_ext.block_extra_refs[block_ref] > 0);
+}
+
+/**
+ * Is the disk formatted for deduplication (zformat -d)?
+ */
+int oufs_dedup_enabled(BLOCK *master) {
+  return (oufs_master_has_ext(master) &&
+          (master->master_ext.features & MASTER_FEATURE_DEDUP));
+}
+
+/**
+ * Look for an indexed block that already holds some contents (dedup mode)
+ *
+ * Candidates are the blocks in the dedup index with the same checksum; their
+ * contents are compared to rule out collisions.  The block that is found
+ * gains a reference.
+ *
+ * @param master The master block (updated in memory only)
+ * @param contents The block about to be written
+ * @param avoid A block that must not be returned (the write's own target)
+ * @return The matching block; UNALLOCATED_BLOCK if there is none
+ */
+BLOCK_REFERENCE oufs_dedup_find(BLOCK *master, BLOCK *contents,
+                                BLOCK_REFERENCE avoid) {
+  if (!oufs_dedup_enabled(master))
+    return (UNALLOCATED_BLOCK);
+  unsigned int crc = vdisk_checksum(contents);
+  for (int b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+    if (b == avoid || !(master->master_ext.block_dedup_flag[b >> 3] & (1 << (b & 7))) ||
+        vdisk_block_checksum(b) != crc ||
+        master->master_ext.block_extra_refs[b] == UCHAR_MAX)
+      continue;
+    BLOCK candidate;
+    if (vdisk_read_block(b, &candidate) == 0 &&
+        memcmp(&candidate, contents, sizeof(candidate)) == 0) {
+      ++master->master_ext.block_extra_refs[b];
+      return (b);
+    }
+  }
+  return (UNALLOCATED_BLOCK);
+}
+
+/**
+ * Add a file data block that was just written to the dedup index
+ *
+ * @return 1 if the master block changed; 0 otherwise
+ */
+int oufs_dedup_register(BLOCK *master, BLOCK_REFERENCE block_ref) {
+  if (!oufs_dedup_enabled(master) ||
+      (master->master_ext.block_dedup_flag[block_ref >> 3] & (1 << (block_ref & 7))))
+    return (0);
+  master->master_ext.block_dedup_flag[block_ref >> 3] |= (1 << (block_ref & 7));
+  return (1);
+}
+
+/**
+ * Does the master block carry the extended tables (MASTER_EXT)?
+ *
+ * @param master The master block
+ * @return 1 if the disk was formatted with the extended tables; 0 otherwise
+ */
+int oufs_master_has_ext(BLOCK *master) {
+  return (master->master_ext.magic[0] == MASTER_EXT_MAGIC_0 &&
+          master->master_ext.magic[1] == MASTER_EXT_MAGIC_1);
+}
+
+/**
+ * Number of blocks on the disk
+ *
+ * @param master The master block
+ * @return The size chosen by zformat or zresize; N_BLOCKS_IN_DISK for disks
+ * that do not record one
+ */
+int oufs_disk_blocks(BLOCK *master) {
+  if (!oufs_master_has_ext(master) || master->master_ext.n_blocks == 0)
+    return (N_BLOCKS_IN_DISK);
+  return (master->master_ext.n_blocks);
+}
+
+/**
+ * Count the bits set in an allocation table (inode_allocated_flag or
+ * block_allocated_flag)
+ *
+ * Works a 64-bit word at a time, so the cost is one popcount per 64 inodes
+ * or blocks.
+ *
+ * @param flags The table
+ * @param n_bits Number of entries in the table (a multiple of 8)
+ * @return Number of allocated entries
+ */
+int oufs_count_allocated(unsigned char *flags, int n_bits) {
+  int n_bytes = n_bits >> 3;
+  int count = 0;
+  int i = 0;
+  for (; i + 8 <= n_bytes; i += 8) {
+    unsigned long long word;
+    memcpy(&word, flags + i, sizeof(word));
+    count += __builtin_popcountll(word);
+  }
+  for (; i < n_bytes; ++i)
+    count += __builtin_popcount(flags[i]);
+  return (count);
+}
+
+/**
+ * Is a block allocated-but-unwritten (preallocated by oufs_fallocate())?
+ *
+ * @param master The master block
+ * @param block_ref The data block
+ * @return 1 if the block must read back as zeros; 0 otherwise
+ */
+int oufs_block_is_unwritten(BLOCK *master, BLOCK_REFERENCE block_ref) {
+  if (!oufs_master_has_ext(master) || block_ref >= N_BLOCKS_IN_DISK)
+    return (0);
+  return ((master->master_ext.block_unwritten_flag[block_ref >> 3] >>
+           (block_ref & 7)) & 1);
+}
+
 INODE_REFERENCE oufs_allocate_new_directory(INODE_REFERENCE parent) {
+  VDISK_TRACE("oufs_allocate_new_directory");
   // Find available inode, get reference, will be self
   // int self = -1;
   // for(int i = 0; i < N_INODES; ++i){
@@ -157,8 +571,11 @@ INODE_REFERENCE oufs_allocate_new_directory(INODE_REFERENCE parent) {
   // }
   // if(self == -1)
   //   return UNALLOCATED_INODE;
+  // The inode and the block are taken in one copy of the master block,
+  // written last: if anything fails on the way, the disk is unchanged
   BLOCK masterBlock;
-  vdisk_read_block(MASTER_BLOCK_REFERENCE, &masterBlock);
+  if (vdisk_read_block(MASTER_BLOCK_REFERENCE, &masterBlock) != 0)
+    return UNALLOCATED_INODE;
   int b_byte;
   int flag;
   for (b_byte = 0, flag = 1; flag && b_byte < INODES_PER_BLOCK; ++b_byte) {
@@ -167,6 +584,10 @@ INODE_REFERENCE oufs_allocate_new_directory(INODE_REFERENCE parent) {
       break;
     }
   }
+  if (flag) {
+    fprintf(stderr, "Disk is full\n");
+    return UNALLOCATED_INODE;
+  }
 
   int b_bit =
       oufs_find_open_bit(masterBlock.master.inode_allocated_flag[b_byte]);
@@ -174,7 +595,10 @@ INODE_REFERENCE oufs_allocate_new_directory(INODE_REFERENCE parent) {
 
   // Allcoate new block
   BLOCK_REFERENCE b;
-  b = oufs_allocate_new_block();
+  if (oufs_allocate_blocks_in_master(&masterBlock, 1, UNALLOCATED_BLOCK, &b) != 1) {
+    fprintf(stderr, "Disk is full\n");
+    return UNALLOCATED_INODE;
+  }
 
   // Call clean directory block
   BLOCK block;
@@ -189,18 +613,16 @@ INODE_REFERENCE oufs_allocate_new_directory(INODE_REFERENCE parent) {
     inode.data[i] = UNALLOCATED_BLOCK;
   }
   inode.size = 2;
-  oufs_write_inode_by_reference(self, &inode);
 
-  // Store clean directory block in new block
-  vdisk_write_block(b, &block);
+  // Store clean directory block in new block, then the inode
+  if (vdisk_write_block(b, &block) != 0 ||
+      oufs_write_inode_by_reference(self, &inode) != 0)
+    return UNALLOCATED_INODE;
 
   // Mark inode as allocated in master block
-  int byte = self / INODES_PER_BLOCK + 1;
-  int bit = self % INODES_PER_BLOCK;
-  BLOCK master;
-  vdisk_read_block(0, &master);
-  master.master.inode_allocated_flag[byte - 1] |= (1 << (bit));
-  vdisk_write_block(0, &master);
+  masterBlock.master.inode_allocated_flag[self >> 3] |= (1 << (self & 7));
+  if (vdisk_write_block(MASTER_BLOCK_REFERENCE, &masterBlock) != 0)
+    return UNALLOCATED_INODE;
 
   return self;
 }
@@ -210,7 +632,8 @@ INODE_REFERENCE oufs_find_directory_element(INODE *inode, char *name) {
     if (inode->data[i] != UNALLOCATED_BLOCK) {
       BLOCK_REFERENCE ref = inode->data[i];
       BLOCK b;
-      vdisk_read_block(ref, &b);
+      if (vdisk_read_block(ref, &b) != 0)
+        return UNALLOCATED_INODE;
       for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j) {
         // if(b.directory.entry[j].name == name){
         //   return b.directory.entry[j].inode_reference;
@@ -235,6 +658,7 @@ INODE_REFERENCE oufs_find_directory_element(INODE *inode, char *name) {
  *
  */
 int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode) {
+  VDISK_TRACE_ARG("oufs_read_inode_by_reference", "inode", i);
   if (debug)
     fprintf(stderr, "Fetching inode %d\n", i);
 
@@ -253,21 +677,74 @@ int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode) {
 }
 
 int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode) {
+  VDISK_TRACE_ARG("oufs_write_inode_by_reference", "inode", i);
   BLOCK_REFERENCE block = i / INODES_PER_BLOCK + 1;
   int element = i % INODES_PER_BLOCK;
 
+  // Never write back a block that could not be read (or failed its checksum)
   BLOCK b;
-  if (vdisk_read_block(block, &b) == 0) {
-    b.inodes.inode[element].type = inode->type;
-    b.inodes.inode[element].n_references = inode->n_references;
-    for (int i = 0; i < BLOCKS_PER_INODE; ++i) {
-      b.inodes.inode[element].data[i] = inode->data[i];
-    }
-    b.inodes.inode[element].size = inode->size;
+  if (vdisk_read_block(block, &b) != 0)
+    return -1;
+  b.inodes.inode[element].type = inode->type;
+  b.inodes.inode[element].n_references = inode->n_references;
+  for (int i = 0; i < BLOCKS_PER_INODE; ++i) {
+    b.inodes.inode[element].data[i] = inode->data[i];
   }
+  b.inodes.inode[element].size = inode->size;
 
-  vdisk_write_block(block, &b);
-  return 0;
+  return vdisk_write_block(block, &b);
+}
+
+/**
+ * Give a block that is about to be rewritten an owner of its own
+ *
+ * If the block is shared (with a snapshot or a clone), the other owners keep
+ * it: a new block is allocated in its place and the shared one loses a
+ * reference.  The caller writes the new contents to *ref.
+ *
+ * @param master The master block (updated in memory only)
+ * @param ref In: the block about to be written.  Out: where to write it
+ * @return 1 if *ref changed; 0 if the block can be written in place; -1 if
+ * the disk is full
+ */
+int oufs_unshare_block(BLOCK *master, BLOCK_REFERENCE *ref) {
+  if (!oufs_block_is_shared(master, *ref))
+    return (0);
+  BLOCK_REFERENCE copy;
+  if (oufs_allocate_blocks_in_master(master, 1, *ref + 1, &copy) != 1) {
+    fprintf(stderr, "Disk is full\n");
+    return (-1);
+  }
+  --master->master_ext.block_extra_refs[*ref];
+  *ref = copy;
+  return (1);
+}
+
+/**
+ * Write one block of a directory, copying it first if it is shared with a
+ * snapshot
+ *
+ * @param dir_ref The directory
+ * @param dir The directory's inode.  If the block moves, the inode is updated
+ * here and on the disk
+ * @param index Which of the directory's blocks to write
+ * @param block The new contents
+ * @return 0 on success; <0 on error
+ */
+int oufs_write_directory_block(INODE_REFERENCE dir_ref, INODE *dir, int index,
+                               BLOCK *block) {
+  BLOCK master;
+  if (vdisk_read_block(MASTER_BLOCK_REFERENCE, &master) != 0)
+    return (-1);
+  int moved = oufs_unshare_block(&master, &dir->data[index]);
+  if (moved < 0)
+    return (-1);
+  if (moved) {
+    if (vdisk_write_block(MASTER_BLOCK_REFERENCE, &master) != 0 ||
+        oufs_write_inode_by_reference(dir_ref, dir) != 0)
+      return (-1);
+  }
+  return (vdisk_write_block(dir->data[index], block));
 }
 
 // WIll need to come back and complete
@@ -283,217 +760,66 @@ int oufs_find_open_bit(unsigned char value) {
 }
 
 // Removes a specified *empty directory from the virtual disk
+// The parent's entry and the directory's inode are updated in one batch, so
+// that a parent block shared with a snapshot is copied and the directory's
+// own block only loses a reference if a snapshot still uses it
 int oufs_rmdir(char *cwd, char *path) {
+  VDISK_TRACE("oufs_rmdir");
+  INODE_REFERENCE parent;
+  INODE_REFERENCE child;
+  char local_name[MAX_PATH_LENGTH];
 
-  // Creates the absolute path to the directory to be removed
-  // If the path supplied is an absolute path, just that is used
-  char fullPath[strlen(cwd) + strlen(path)];
-  fullPath[0] = '\0';
-  if (path[0] == '/') {
-    strcat(fullPath, path);
-  } else {
-    strcat(fullPath, cwd);
-    strcat(fullPath, path);
+  // If the inode does not exist, throw an error
+  if (oufs_find_file(cwd, path, &parent, &child, local_name) != 0 ||
+      child == UNALLOCATED_INODE) {
+    fprintf(stderr, "Path does not exist\n");
+    return -1;
   }
 
-  // If trying to remove root directory, throw error
-  if (!strcmp(fullPath, "//") || !strcmp(fullPath, "/")) {
+  // If trying to remove root directory (or "." / ".."), throw error
+  if (child == 0 || !strcmp(local_name, ".") || !strcmp(local_name, "..")) {
     fprintf(stderr, "ERROR: cannot delete root directory\n");
     return -1;
   }
 
-  // If the inode does not exist, throw an error
-  int inodeToRemoveReference = get_inode_reference_from_path(fullPath);
-  if (inodeToRemoveReference == -1) {
-    fprintf(stderr, "Path does not exist\n");
-  } else {
-    // Open the inode
-    INODE inodeToRemove;
-    oufs_read_inode_by_reference(inodeToRemoveReference, &inodeToRemove);
-
-    // If the directory is not empty, throw error
-    if (inodeToRemove.size > 2) {
-      fprintf(stderr, "ERROR: Directory not empty\n");
-      return -1;
-    }
-
-    // Get parent inode reference
-    int parentInodeReference;
-    for (int i = 0; i < BLOCKS_PER_INODE; ++i) {
-      if (inodeToRemove.data[i] !=
-          UNALLOCATED_BLOCK) { // Step through available blocks referenced in
-                               // data
-        int ref = inodeToRemove.data[i];
-        BLOCK block;
-        vdisk_read_block(ref, &block); // Open allocated block
-        for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK;
-             ++j) { // Step through entries in the block
-          if (!strcmp(
-                  block.directory.entry[j].name,
-                  "..")) { // If the entry's name is '..' (meaning parent)...
-            parentInodeReference =
-                block.directory.entry[j]
-                    .inode_reference; // Store the parent inode reference
-
-            // Mark the inode and the inode's data block as unallocated in the
-            // master block allocation tables
-            BLOCK masterBlock;
-            vdisk_read_block(MASTER_BLOCK_REFERENCE, &masterBlock);
-            masterBlock.master.block_allocated_flag[ref / 8] &=
-                ~(1 << (ref % 8));
-            masterBlock.master
-                .inode_allocated_flag[inodeToRemoveReference / 8] &=
-                ~(1 << (inodeToRemoveReference % 8));
-            vdisk_write_block(MASTER_BLOCK_REFERENCE, &masterBlock);
-            break;
-          }
-        }
-      }
-    }
-
-    // Get the parent inode location information
-    int parentInodeBlockReference = parentInodeReference / INODES_PER_BLOCK + 1;
-    int parentInodeBlockIndex = parentInodeReference % INODES_PER_BLOCK;
-
-    // Open the parent block
-    BLOCK parentBlock;
-    vdisk_read_block(parentInodeBlockReference, &parentBlock);
-
-    for (int i = 0; i < BLOCKS_PER_INODE;
-         ++i) { // Step through all blocks in the inode
-      int ref = parentBlock.inodes.inode[parentInodeBlockIndex].data[i];
-      if (ref != UNALLOCATED_BLOCK) { // If the block has data in it
-        BLOCK block;
-        vdisk_read_block(ref, &block);
-        for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK;
-             ++j) { // Step through the directory entries in the block
-          int inodeRef = block.directory.entry[j].inode_reference;
-          if (inodeRef == inodeToRemoveReference) { // if the inode referenced
-                                                    // by a directory entry is
-                                                    // the inode being removed...
-            memset(block.directory.entry[j].name, 0,
-                   strlen(block.directory.entry[j]
-                              .name)); // Empty the name in the data block
-            block.directory.entry[j].inode_reference =
-                UNALLOCATED_INODE;          // Mark the inode as unallocated
-            vdisk_write_block(ref, &block); // Write the block back to the disk
-            parentBlock.inodes.inode[parentInodeBlockReference].data[ref] =
-                UNALLOCATED_BLOCK;
-          }
-        }
-      }
-    }
-    // Decrement the parent inode's size
-    --parentBlock.inodes.inode[parentInodeBlockIndex].size;
-    vdisk_write_block(parentInodeBlockReference,
-                      &parentBlock); // Write that block back
-
-    // Get the location information of the inode being removed
-    int inodeBlockReference = inodeToRemoveReference / INODES_PER_BLOCK + 1;
-    int index = inodeToRemoveReference % INODES_PER_BLOCK;
-
-    // Open the block containing the inode
-    BLOCK inodeBlock;
-    vdisk_read_block(inodeBlockReference, &inodeBlock);
-
-    for (int i = 0; i < BLOCKS_PER_INODE; ++i) {
-      int dirBlockRef = 0;
-      BLOCK dirBlock;
-      dirBlockRef = inodeBlock.inodes.inode[index].data[i];
-      if (dirBlockRef != UNALLOCATED_BLOCK) {
-        vdisk_read_block(dirBlockRef, &dirBlock);
-        for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j) {
-          memset(dirBlock.directory.entry[j].name, 0,
-                 strlen(dirBlock.directory.entry[j]
-                            .name)); // Empty the name in the data block
-          dirBlock.directory.entry[j].inode_reference = 0;
-        }
-        vdisk_write_block(dirBlockRef, &dirBlock);
-      }
-    }
-
-    // Go to that specific inode and 0 everything out
-    inodeBlock.inodes.inode[index].type = IT_NONE;
-    inodeBlock.inodes.inode[index].n_references = 0;
-    for (int i = 0; i < BLOCKS_PER_INODE; ++i) {
-      inodeBlock.inodes.inode[index].data[i] = UNALLOCATED_BLOCK;
-    }
-    inodeBlock.inodes.inode[index].size = 0;
+  OUFS_BATCH batch;
+  if (oufs_batch_begin(&batch) != 0)
+    return -1;
+  INODE inode;
+  oufs_batch_read_inode(&batch, child, &inode);
+  if (inode.type != IT_DIRECTORY) {
+    fprintf(stderr, "ERROR: Not a directory\n");
+    return -1;
+  }
 
-    // Write the block that contains the removed inode back to the disk
-    vdisk_write_block(inodeBlockReference, &inodeBlock);
+  // If the directory is not empty, throw error
+  if (inode.size > 2) {
+    fprintf(stderr, "ERROR: Directory not empty\n");
+    return -1;
   }
 
-  return 0;
+  // Drop the name from the parent, then release the inode and its block
+  if (oufs_batch_remove_entry(&batch, parent, local_name) != child ||
+      oufs_batch_free_inode(&batch, child) != 0)
+    return -1;
+  return oufs_batch_commit(&batch);
 }
 
 // Lists the files and directories inside a specific directory
 int oufs_list(char *cwd, char *path) {
+  VDISK_TRACE("oufs_list");
 
-  INODE_REFERENCE parent;
-  INODE_REFERENCE child;
-  char local_name[MAX_PATH_LENGTH];
-  int ret;
-
-  if ((ret = oufs_find_file(cwd, path, &parent, &child, local_name)) < -1) {
-    fprintf(stderr, "zfilez error\n");
-  }
-
-  if(child == UNALLOCATED_INODE){
+  OUFS_DIR *dir = oufs_opendir(cwd, path, OUFS_DIR_SORTED);
+  if (dir == NULL) {
     fprintf(stderr, "zfilez error: directory does not exist\n");
     return -1;
   }
 
-  char *entryNames[DIRECTORY_ENTRIES_PER_BLOCK];
-  char *directoryNames[DIRECTORY_ENTRIES_PER_BLOCK];
-  for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
-    entryNames[i] = "";
-    directoryNames[i] = "";
-  }
-
-  INODE inode;
-  oufs_read_inode_by_reference(child, &inode);
-
-  for (int i = 0; i < BLOCKS_PER_INODE; ++i) {
-    if (inode.data[i] != UNALLOCATED_BLOCK) {
-      BLOCK block;
-      vdisk_read_block(inode.data[i], &block);
-      for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j) {
-        if (block.directory.entry[j].inode_reference != UNALLOCATED_INODE) {
-          INODE curInode;
-          oufs_read_inode_by_reference(block.directory.entry[j].inode_reference,
-                                       &curInode);
-          if (curInode.type == IT_DIRECTORY) {
-            entryNames[j] = strdup(block.directory.entry[j].name);
-            directoryNames[j] = strdup(block.directory.entry[j].name);
-          } else {
-            entryNames[j] = strdup(block.directory.entry[j].name);
-          }
-        }
-      }
-    }
-  }
-
-  // Sorts the directory names in alphabetical order and prints out
-  qsort(entryNames, DIRECTORY_ENTRIES_PER_BLOCK, sizeof(char *), comparator);
-  for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
-    if (strcmp(entryNames[i], "")) { // If the name is not empty
-      int flag = 1;
-      for(int j = 0; flag && j < DIRECTORY_ENTRIES_PER_BLOCK; ++j){ //Determines if entry is a directory or not
-        if(!strcmp(entryNames[i], directoryNames[j])){
-          flag = 0;
-        }
-      }
-      if(flag){ //If entry is not a directory, do not add '/'
-        printf("%s\n", entryNames[i]);
-        fflush(stdout);
-      }
-      else{ //If entry is a directory, add '/'
-        printf("%s/\n", entryNames[i]);
-        fflush(stdout);
-      }
-    }
-  }
+  // Names in alphabetical order; directories get a '/'
+  OUFS_DIRENT *entry;
+  while ((entry = oufs_readdir(dir)) != NULL)
+    printf("%s%s\n", entry->name, entry->type == IT_DIRECTORY ? "/" : "");
+  oufs_closedir(dir);
   return 0;
 }
 
@@ -521,12 +847,14 @@ int get_inode_reference_from_path_helper(INODE_REFERENCE parentInodeReference,
 
   int returner = -1;
   INODE inode;
-  oufs_read_inode_by_reference(parentInodeReference, &inode);
+  if (oufs_read_inode_by_reference(parentInodeReference, &inode) != 0)
+    return -1;
   for (int i = 0; i < BLOCKS_PER_INODE; ++i) {
     if (inode.data[i] != UNALLOCATED_BLOCK) {
       BLOCK_REFERENCE currentBlockRef = inode.data[i];
       BLOCK dirBlock;
-      vdisk_read_block(currentBlockRef, &dirBlock);
+      if (vdisk_read_block(currentBlockRef, &dirBlock) != 0)
+        return -1;
       for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j) {
         if (dirBlock.directory.entry[j].inode_reference != UNALLOCATED_INODE) {
           if (!strncmp(dirBlock.directory.entry[j].name, name, strlen(name))) {
@@ -540,17 +868,10 @@ int get_inode_reference_from_path_helper(INODE_REFERENCE parentInodeReference,
   return returner;
 }
 
-// https://stackoverflow.com/questions/43099269/qsort-function-in-c-used-to-compare-an-array-of-strings
-// Sorts an array in alphabetical order
-int comparator(const void *p, const void *q) {
-  char *a = *(char **)p; // Opens the void pointers as char*
-  char *b = *(char **)q;
-  return strcmp(a, b); // Sorts alphabetically
-}
-
 // Given Code from project 3
 int oufs_find_file(char *cwd, char *path, INODE_REFERENCE *parent,
                    INODE_REFERENCE *child, char *local_name) {
+  VDISK_TRACE("oufs_find_file");
   INODE_REFERENCE grandparent;
   char full_path[MAX_PATH_LENGTH];
 
@@ -600,6 +921,7 @@ int oufs_find_file(char *cwd, char *path, INODE_REFERENCE *parent,
       }
 
       // Real next element
+      VDISK_TRACE_ARG("lookup", "directory", *child);
       INODE inode;
       // Fetch the inode that corresponds to the child
       if (oufs_read_inode_by_reference(*child, &inode) != 0) {
@@ -660,6 +982,7 @@ int oufs_find_file(char *cwd, char *path, INODE_REFERENCE *parent,
 }
 
 int oufs_mkdir(char *cwd, char *path) {
+  VDISK_TRACE("oufs_mkdir");
   INODE_REFERENCE parent;
   INODE_REFERENCE child;
   char local_name[MAX_PATH_LENGTH];
@@ -702,7 +1025,6 @@ int oufs_mkdir(char *cwd, char *path) {
 
           INODE_REFERENCE inode_reference = oufs_allocate_new_directory(parent);
           if (inode_reference == UNALLOCATED_INODE) {
-            fprintf(stderr, "Disk is full\n");
             return (-4);
           }
           // Add the item to the current directory
@@ -714,7 +1036,7 @@ int oufs_mkdir(char *cwd, char *path) {
           block.directory.entry[i].name[FILE_NAME_SIZE - 1] = 0;
 
           // Write the block back out
-          if (vdisk_write_block(inode.data[0], &block) != 0) {
+          if (oufs_write_directory_block(parent, &inode, 0, &block) != 0) {
             return (-7);
           }
 
@@ -754,7 +1076,32 @@ int oufs_mkdir(char *cwd, char *path) {
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 
+/**
+ * Allocate and initialize an open file structure
+ *
+ * @param inode_reference Inode of the file that is being opened
+ * @param mode Mode the file is opened in
+ * @param offset Initial file offset
+ * @return The new OUFILE.  The caller is responsible for freeing it
+ */
+OUFILE* oufs_new_oufile(INODE_REFERENCE inode_reference, char mode, int offset) {
+  OUFILE *file = malloc(sizeof(OUFILE));
+  file->inode_reference = inode_reference;
+  file->mode = mode;
+  file->offset = offset;
+  file->ra_next_block = 0;
+  file->ra_window = 0;
+  file->ra_prefetched = 0;
+  file->wbuf = NULL;
+  file->wbuf_offset = offset;
+  file->wbuf_len = 0;
+  file->truncated = 0;
+  file->compress = 0;
+  return file;
+}
+
 OUFILE* oufs_fopen(char *cwd, char *path, char mode) {
+  VDISK_TRACE("oufs_fopen");
   INODE_REFERENCE parent;
   INODE_REFERENCE child;
   char local_name[MAX_PATH_LENGTH];
@@ -772,9 +1119,33 @@ OUFILE* oufs_fopen(char *cwd, char *path, char mode) {
     }
     // If parent is a directory
     if (parentInode.type == IT_DIRECTORY) {
+      // Find the first free entry in the directory's blocks before anything
+      // is allocated, so that a full directory leaves the disk alone
+      int slot_block = -1;
+      int slot_entry = -1;
+      BLOCK block;
+      for (int i = 0; slot_block == -1 && i < BLOCKS_PER_INODE; ++i) {
+        if (parentInode.data[i] == UNALLOCATED_BLOCK)
+          continue;
+        if (vdisk_read_block(parentInode.data[i], &block) != 0)
+          return NULL; // A block that failed its checksum fails the call
+        for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j) {
+          if (block.directory.entry[j].inode_reference == UNALLOCATED_INODE) {
+            slot_block = i;
+            slot_entry = j;
+            break;
+          }
+        }
+      }
+      if (slot_block == -1) {
+        fprintf(stderr, "Parent is full\n");
+        return NULL;
+      }
+
       // Get next open inode for child inode location;
       BLOCK masterBlock;
-      vdisk_read_block(MASTER_BLOCK_REFERENCE, &masterBlock);
+      if (vdisk_read_block(MASTER_BLOCK_REFERENCE, &masterBlock) != 0)
+        return NULL;
       int byte;
       int flag;
       for (byte = 0, flag = 1; flag && byte < INODES_PER_BLOCK; ++byte) {
@@ -783,6 +1154,10 @@ OUFILE* oufs_fopen(char *cwd, char *path, char mode) {
           break;
         }
       }
+      if (flag) {
+        fprintf(stderr, "Disk is full\n");
+        return NULL;
+      }
       int bit =
           oufs_find_open_bit(masterBlock.master.inode_allocated_flag[byte]);
       INODE_REFERENCE childLocation = (byte << 3) + bit;
@@ -797,34 +1172,23 @@ OUFILE* oufs_fopen(char *cwd, char *path, char mode) {
         childInode.data[i] = UNALLOCATED_BLOCK;
       }
       childInode.size = 0;
-      oufs_write_inode_by_reference(childLocation, &childInode);
+      if (oufs_write_inode_by_reference(childLocation, &childInode) != 0)
+        return NULL;
       // Increment master inode table
       masterBlock.master.inode_allocated_flag[byte] |= (1 << (bit));
-      vdisk_write_block(MASTER_BLOCK_REFERENCE, &masterBlock);
+      if (vdisk_write_block(MASTER_BLOCK_REFERENCE, &masterBlock) != 0)
+        return NULL;
       // Link child location inside of parentInode
-      for (int i = 0; i < BLOCKS_PER_INODE; ++i) {
-        if (parentInode.data[i] != UNALLOCATED_BLOCK) {
-          BLOCK_REFERENCE ref = parentInode.data[i];
-          BLOCK block;
-          vdisk_read_block(ref, &block);
-          for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j) {
-            if (block.directory.entry[j].inode_reference == UNALLOCATED_INODE) {
-              strncpy(block.directory.entry[j].name, local_name,
-                      strlen(local_name));
-              block.directory.entry[j].inode_reference = childLocation;
-              vdisk_write_block(ref, &block);
-              ++parentInode.size;
-              break;
-            }
-          }
-        }
-      }
-      oufs_write_inode_by_reference(parent, &parentInode);
-      OUFILE *file = malloc(sizeof(OUFILE));
-      file->inode_reference = childLocation;
-      file->mode = mode;
-      file->offset = 0;
-      return file;
+      strncpy(block.directory.entry[slot_entry].name, local_name,
+              FILE_NAME_SIZE - 1);
+      block.directory.entry[slot_entry].name[FILE_NAME_SIZE - 1] = 0;
+      block.directory.entry[slot_entry].inode_reference = childLocation;
+      if (oufs_write_directory_block(parent, &parentInode, slot_block, &block) != 0)
+        return NULL;
+      ++parentInode.size;
+      if (oufs_write_inode_by_reference(parent, &parentInode) != 0)
+        return NULL;
+      return oufs_new_oufile(childLocation, mode, 0);
     }
     // Parent is not a directory, throw error
     else {
@@ -840,13 +1204,11 @@ OUFILE* oufs_fopen(char *cwd, char *path, char mode) {
       return NULL;
     }
     // If child is file, do nothing
-    if (childInode.type == IT_FILE) {
-      //TODO: return the oufile
-      OUFILE *file = malloc(sizeof(OUFILE));
-      file->inode_reference = child;
-      file->mode = mode;
-      file->offset = childInode.size;
-      return file;
+    if (oufs_is_file(&childInode)) {
+      //'w' discards the contents and 'r' reads them, so both start at the
+      //beginning; the other modes add to the end
+      return oufs_new_oufile(child, mode,
+                             (mode == 'w' || mode == 'r') ? 0 : childInode.size);
     }
     // If child is directory, throw error
     else {
@@ -863,119 +1225,793 @@ OUFILE* oufs_fopen(char *cwd, char *path, char mode) {
   return NULL;
 }
 
+/**
+ * Write to an open file
+ *
+ * The data is only copied into the file's write buffer; no block is allocated
+ * or written until the buffer is flushed by oufs_fflush() or oufs_fclose().
+ * This lets a series of small writes end up in one contiguous run of blocks.
+ *
+ * @param fp The open file
+ * @param buf Bytes to write
+ * @param len Number of bytes in buf
+ * @return Number of bytes accepted (less than len if the file would exceed
+ * its maximum size)
+ */
 int oufs_fwrite(OUFILE *fp, unsigned char* buf, int len){
+  VDISK_TRACE("oufs_fwrite");
+  int n = oufs_pwrite(fp, buf, len, fp->offset);
+  if(n > 0)
+    fp->offset += n;
+  return n;
+}
+
+/**
+ * Write to an open file at a given offset, without moving the file offset
+ *
+ * The offset may lie past the end of the file: the data blocks in between are
+ * left unallocated (a hole) and read back as zeros.  Like oufs_fwrite(), the
+ * data is only buffered until the next flush.
+ *
+ * @param fp The open file
+ * @param buf Bytes to write
+ * @param len Number of bytes in buf
+ * @param offset File offset of the first byte
+ * @return Number of bytes accepted; -1 on error
+ */
+int oufs_pwrite(OUFILE *fp, unsigned char* buf, int len, int offset){
+  VDISK_TRACE("oufs_pwrite");
+  if(offset < 0 || len < 0)
+    return -1;
+
+  //The buffer can only hold one contiguous run: flush it if this write does
+  //not continue it
+  if(fp->wbuf_len > 0 && offset != fp->wbuf_offset + fp->wbuf_len)
+    oufs_fflush(fp);
+
+  if(fp->wbuf == NULL)
+    fp->wbuf = malloc(BLOCKS_PER_INODE * BLOCK_SIZE);
+  if(fp->wbuf_len == 0)
+    fp->wbuf_offset = offset;
+
+  //Never buffer past the maximum size of a file
+  int room = BLOCKS_PER_INODE * BLOCK_SIZE - (fp->wbuf_offset + fp->wbuf_len);
+  if(len > room)
+    len = room;
+  if(len <= 0)
+    return 0;
+
+  memcpy(fp->wbuf + fp->wbuf_len, buf, len);
+  fp->wbuf_len += len;
+  return len;
+}
+
+/**
+ * Move the offset of an open file
+ *
+ * Seeking past the end of the file is allowed; a later write there leaves a
+ * hole.
+ *
+ * @param fp The open file
+ * @param offset New offset, relative to whence
+ * @param whence SEEK_SET, SEEK_CUR or SEEK_END
+ * @return The new offset; -1 on error
+ */
+int oufs_lseek(OUFILE *fp, int offset, int whence){
+  int base;
+  if(whence == SEEK_SET){
+    base = 0;
+  }
+  else if(whence == SEEK_CUR){
+    base = fp->offset;
+  }
+  else if(whence == SEEK_END){
+    INODE file_inode;
+    if(oufs_read_inode_by_reference(fp->inode_reference, &file_inode) != 0)
+      return -1;
+    base = file_inode.size;
+    //Buffered data may already extend the file
+    if(fp->wbuf_len > 0 && fp->wbuf_offset + fp->wbuf_len > base)
+      base = fp->wbuf_offset + fp->wbuf_len;
+  }
+  else{
+    return -1;
+  }
+
+  if(base + offset < 0)
+    return -1;
+  fp->offset = base + offset;
+  return fp->offset;
+}
+
+/**
+ * Store the buffered writes of an open file on the disk
+ *
+ * All of the data blocks the buffered run needs are allocated at once with
+ * oufs_allocate_new_blocks(), preferably right after the file's current last
+ * block, and the master block is written a single time.
+ *
+ * @param fp The open file
+ * @return 0 on success; <0 on error
+ */
+int oufs_fflush(OUFILE *fp){
+  VDISK_TRACE("oufs_fflush");
+  int truncate = (fp->mode == 'w' && !fp->truncated);
+  if(!truncate && fp->wbuf_len == 0)
+    return 0; //Nothing to do
+
   INODE_REFERENCE file_inode_reference = fp->inode_reference;
   INODE file_inode;
-  oufs_read_inode_by_reference(file_inode_reference, &file_inode);
-  char mode = fp->mode;
-
-  //If the file is from 'zcreate', 0 out the file and write from beginning, otherwise
-  //skip this step
-  if(mode == 'w'){
-    //Zero out all data blocks
-    BLOCK master;
-    vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
+  if(oufs_read_inode_by_reference(file_inode_reference, &file_inode) != 0)
+    return -1;
+
+  //Allocation changes are collected here and written out once at the end.
+  //The master block is only loaded when blocks are involved
+  BLOCK master;
+  int master_loaded = 0;
+  int master_dirty = 0;
+  //Blocks released by the truncation or by a shrinking compressed file
+  //(discarded once the master is written)
+  BLOCK_REFERENCE freed[2 * BLOCKS_PER_INODE];
+  int n_freed = 0;
+
+  //If the file is from 'zcreate', 0 out the file before the first write
+  if(truncate && file_inode.type == IT_INLINE_FILE){
+    //An inline file has no blocks to give back
+    for(int i = 0; i < BLOCKS_PER_INODE; ++i)
+      file_inode.data[i] = UNALLOCATED_BLOCK;
+    file_inode.type = IT_FILE;
+  }
+  else if(truncate){
+    if(vdisk_read_block(MASTER_BLOCK_REFERENCE, &master) != 0)
+      return -1;
+    master_loaded = 1;
+    //Give back all data blocks; their old contents are not touched
+    n_freed = 0;
     for(int i = 0; i < BLOCKS_PER_INODE; ++i){
-      if(file_inode.data[i] != UNALLOCATED_BLOCK){
-        BLOCK b;
-        vdisk_read_block(file_inode.data[i], &b);
-        for(int j = 0; j < BLOCK_SIZE; ++j){
-          b.data.data[j] = 0;
-        }
-        master.master.block_allocated_flag[file_inode.data[i] / 8] &= ~(1 << (file_inode.data[i] % 8)); //Mark the data blocks as unallocated in the master allocation table
-        file_inode.data[i] = UNALLOCATED_BLOCK;
-      }
+      if(file_inode.data[i] != UNALLOCATED_BLOCK)
+        freed[n_freed++] = file_inode.data[i];
+      file_inode.data[i] = UNALLOCATED_BLOCK;
     }
+    n_freed = oufs_free_blocks_in_master(&master, freed, n_freed);
+    master_dirty = 1;
+  }
+  if(truncate){
     file_inode.size = 0;
-    fp->offset = 0;
-    oufs_write_inode_by_reference(file_inode_reference, &file_inode); //Write changes back to file
-    vdisk_write_block(MASTER_BLOCK_REFERENCE, &master); //^^
-  }
-
-  //To know which data block to insert into, do offset / BLOCK_SIZE
-  //To know where in the data block to insert into, do offset % BLOCK_SIZE
-  int offset = file_inode.size;
-  int location = offset;
-  int data_block_index = offset / BLOCK_SIZE;
-  BLOCK data_block;
-  if(offset != 0) //If there is data present, load the data
-    vdisk_read_block(file_inode.data[data_block_index], &data_block);
-
-  //Gets what will be the total size of the file after writing
-  int total_size = file_inode.size + len;
-  //If the size of the file is too big, shrink to max size available
-  if(total_size > (BLOCKS_PER_INODE * BLOCK_SIZE))
-    total_size = BLOCKS_PER_INODE * BLOCK_SIZE;
-
-  //Gets total number of blocks after adding buf 
-  int num_data_blocks;
-  if(total_size % BLOCK_SIZE == 0)
-    num_data_blocks = total_size / BLOCK_SIZE;
-  else
-    num_data_blocks = total_size / BLOCK_SIZE + 1;
+    fp->truncated = 1;
+    if(fp->compress)
+      file_inode.type = IT_COMPRESSED_FILE; //Empty now: start compressing
+  }
+  int end = fp->wbuf_offset + fp->wbuf_len;
 
-  //Must always start at 0 for buf 
-  int buf_index = 0;
-  for(int i = file_inode.size; i < num_data_blocks * BLOCK_SIZE; ++i){
-    if(offset % BLOCK_SIZE == 0){ //At the end of a block, need to allocate new block
-      if(offset != 0)
-        vdisk_write_block(file_inode.data[data_block_index], &data_block); //Writes the full data block back to the disk
-
-      data_block_index = offset / BLOCK_SIZE; //Gets the location in the inode where this block will be placed
-      BLOCK_REFERENCE bf = oufs_allocate_new_block();
-      file_inode.data[data_block_index] = bf; //Places the new data block in the inode
-    }
-    //If more chars need to be written, write them to the correct place
-    if(i < total_size){
-      data_block.data.data[offset % BLOCK_SIZE] = buf[buf_index];
-      ++buf_index;
-      ++offset;
-      ++location;
-    }
-    //All of chars have been written, now write 0s
-    else {
-      data_block.data.data[location % BLOCK_SIZE] = 0;
-      ++location;
+  //Compressed file: the whole file is decompressed, updated and compressed
+  //again, so that it is always stored as one stream
+  if(file_inode.type == IT_COMPRESSED_FILE){
+    if(!master_loaded && vdisk_read_block(MASTER_BLOCK_REFERENCE, &master) != 0)
+      return -1;
+    unsigned char contents[BLOCKS_PER_INODE * BLOCK_SIZE];
+    if(oufs_read_compressed(&master, &file_inode, contents) != 0)
+      return -1;
+    unsigned int old_size = file_inode.size;
+    if(fp->wbuf_len > 0){
+      if(fp->wbuf_offset > file_inode.size)
+        memset(contents + file_inode.size, 0, fp->wbuf_offset - file_inode.size);
+      memcpy(contents + fp->wbuf_offset, fp->wbuf, fp->wbuf_len);
+      file_inode.size = MAX(end, (int) file_inode.size);
+      fp->wbuf_offset = end;
+      fp->wbuf_len = 0;
+    }
+    if(oufs_write_compressed(&master, &file_inode, contents, freed, &n_freed) == 0)
+      master_dirty = 1;
+    else
+      file_inode.size = old_size; //Disk full: the old stream is still there
+
+    if(master_dirty)
+      vdisk_write_block(MASTER_BLOCK_REFERENCE, &master);
+    oufs_write_inode_by_reference(file_inode_reference, &file_inode);
+    oufs_discard_blocks(freed, n_freed);
+    return 0;
+  }
+
+  //Small enough to keep (or put) the contents in the inode: no block
+  //allocation and no data block I/O at all
+  if(MAX(end, (int) file_inode.size) <= INLINE_DATA_SIZE){
+    int has_blocks = 0;
+    for(int i = 0; file_inode.type != IT_INLINE_FILE && i < BLOCKS_PER_INODE; ++i)
+      if(file_inode.data[i] != UNALLOCATED_BLOCK)
+        has_blocks = 1;
+    if(!has_blocks){
+      if(file_inode.type != IT_INLINE_FILE && fp->wbuf_len > 0){
+        //The file has no blocks, so its contents so far are all zeros
+        memset(file_inode.data, 0, INLINE_DATA_SIZE);
+        file_inode.type = IT_INLINE_FILE;
+      }
+      if(fp->wbuf_len > 0){
+        memcpy((unsigned char *) file_inode.data + fp->wbuf_offset, fp->wbuf,
+               fp->wbuf_len);
+        file_inode.size = MAX(end, (int) file_inode.size);
+        fp->wbuf_offset = end;
+        fp->wbuf_len = 0;
+      }
+      if(master_dirty)
+        vdisk_write_block(MASTER_BLOCK_REFERENCE, &master);
+      oufs_write_inode_by_reference(file_inode_reference, &file_inode);
+      oufs_discard_blocks(freed, n_freed);
+      return 0;
+    }
+  }
+
+  if(!master_loaded && vdisk_read_block(MASTER_BLOCK_REFERENCE, &master) != 0)
+    return -1;
+
+  //Growing out of the inode: move the contents to a real block first
+  if(file_inode.type == IT_INLINE_FILE){
+    if(oufs_promote_inline(&file_inode, &master) != 0)
+      return -2;
+    master_dirty = 1;
+  }
+
+  if(fp->wbuf_len > 0){
+    int start = fp->wbuf_offset;
+    int first_block = start / BLOCK_SIZE;
+    int last_block = (end - 1) / BLOCK_SIZE;
+
+    //Allocate every block the run still needs in one go: the missing ones,
+    //and the shared ones, which are copied before they are changed
+    int n_new = 0;
+    BLOCK_REFERENCE goal = UNALLOCATED_BLOCK;
+    for(int i = 0; i <= last_block; ++i){
+      BLOCK_REFERENCE ref = file_inode.data[i];
+      if(i >= first_block && (ref == UNALLOCATED_BLOCK || oufs_block_is_shared(&master, ref)))
+        ++n_new;
+      else if(ref != UNALLOCATED_BLOCK && (i < first_block || n_new == 0))
+        goal = ref + 1; //Continue right after the last block
+    }
+    BLOCK_REFERENCE new_refs[BLOCKS_PER_INODE];
+    int n_allocated = oufs_allocate_blocks_in_master(&master, n_new, goal, new_refs);
+    if(n_allocated > 0)
+      master_dirty = 1;
+    if(n_allocated < n_new)
+      fprintf(stderr, "Disk is full\n");
+
+    //Copy the buffered bytes into the blocks, one block at a time
+    int n_used = 0;
+    int buf_index = 0;
+    for(int i = first_block; i <= last_block; ++i){
+      //Part of block i that the run covers
+      int block_start = (i == first_block) ? start % BLOCK_SIZE : 0;
+      int block_end = MIN(end - i * BLOCK_SIZE, BLOCK_SIZE);
+      BLOCK data_block;
+      BLOCK_REFERENCE old = file_inode.data[i];
+      int shared = (old != UNALLOCATED_BLOCK && oufs_block_is_shared(&master, old));
+      int is_new = (old == UNALLOCATED_BLOCK || shared);
+      if(is_new){
+        if(n_used == n_allocated)
+          break; //Out of space: keep what has been written so far
+        file_inode.data[i] = new_refs[n_used++];
+      }
+
+      if(old == UNALLOCATED_BLOCK){
+        memset(&data_block, 0, sizeof(data_block)); //New blocks start out empty
+      }
+      else if(oufs_block_is_unwritten(&master, old)){
+        //Preallocated: the old contents are undefined, so start from zeros
+        memset(&data_block, 0, sizeof(data_block));
+        if(!shared){
+          master.master_ext.block_unwritten_flag[old / 8] &= ~(1 << (old % 8));
+          master_dirty = 1;
+        }
+      }
+      else if(block_start > 0 || block_end < BLOCK_SIZE){
+        if(vdisk_read_block(old, &data_block) != 0) //Partial update
+          return -1;
+      }
+
+      if(shared){
+        //Copy on write: the other owners keep the old block
+        --master.master_ext.block_extra_refs[old];
+        master_dirty = 1;
+      }
+      memcpy(data_block.data.data + block_start, fp->wbuf + buf_index,
+             block_end - block_start);
+      buf_index += block_end - block_start;
+
+      //Dedup mode: share a block that already holds these bytes, and give
+      //back the one the data was headed for
+      BLOCK_REFERENCE same = oufs_dedup_find(&master, &data_block, file_inode.data[i]);
+      if(same != UNALLOCATED_BLOCK){
+        BLOCK_REFERENCE unused = file_inode.data[i];
+        if(oufs_free_blocks_in_master(&master, &unused, 1) == 1 && !is_new)
+          freed[n_freed++] = unused; //Only blocks with old data need a discard
+        file_inode.data[i] = same;
+        master_dirty = 1;
+        continue;
+      }
+      vdisk_write_block(file_inode.data[i], &data_block);
+      if(oufs_dedup_register(&master, file_inode.data[i]))
+        master_dirty = 1;
     }
+
+    if(start + buf_index > file_inode.size)
+      file_inode.size = start + buf_index;
+    fp->wbuf_offset = end;
+    fp->wbuf_len = 0;
   }
-  //Write the changes back to the file
-  vdisk_write_block(file_inode.data[data_block_index], &data_block);
-  file_inode.size = total_size;
+
+  //Write the changes back to the disk
+  if(master_dirty)
+    vdisk_write_block(MASTER_BLOCK_REFERENCE, &master);
   oufs_write_inode_by_reference(file_inode_reference, &file_inode);
-  vdisk_write_block(file_inode.data[data_block_index], &data_block); 
+  oufs_discard_blocks(freed, n_freed);
+  return 0;
 }
 
-int oufs_fread(OUFILE *fp, unsigned char* buf, int len){
-  INODE_REFERENCE file_inode_reference = fp->inode_reference;
+/**
+ * Preallocate data blocks for a range of an open file
+ *
+ * Every block of [offset, offset + len) that the file does not have yet is
+ * allocated (as one contiguous run when possible) and flagged as unwritten in
+ * the master block, so that it reads back as zeros without ever being
+ * written.  The file grows to offset + len if it was smaller.
+ *
+ * @param fp The open file
+ * @param offset First byte of the range
+ * @param len Length of the range in bytes
+ * @return 0 on success; -1 if the range is invalid; -2 if the disk is full
+ */
+int oufs_fallocate(OUFILE *fp, int offset, int len){
+  VDISK_TRACE("oufs_fallocate");
+  if(offset < 0 || len <= 0 || offset + len > BLOCKS_PER_INODE * BLOCK_SIZE)
+    return -1;
+
+  //Buffered writes must land first, so that they are not zeroed
+  oufs_fflush(fp);
+
   INODE file_inode;
-  oufs_read_inode_by_reference(file_inode_reference, &file_inode);
+  if(oufs_read_inode_by_reference(fp->inode_reference, &file_inode) != 0)
+    return -1;
+  if(file_inode.type == IT_COMPRESSED_FILE){
+    fprintf(stderr, "oufs_fallocate(): compressed files cannot be preallocated\n");
+    return -1;
+  }
 
-  int num_data_blocks;
-  if(file_inode.size % BLOCK_SIZE == 0)
-    num_data_blocks = file_inode.size / BLOCK_SIZE;
-  else
-    num_data_blocks = file_inode.size / BLOCK_SIZE + 1;
-
-  for(int i = 0; i < num_data_blocks; ++i){
-    BLOCK b;
-    vdisk_read_block(file_inode.data[i], &b);
-    if(i == num_data_blocks - 1){
-      for(int j = 0; j < file_inode.size % BLOCK_SIZE; ++j){
-        printf("%c", b.data.data[j]);
-        fflush(stdout);
-      }
-    } 
+  BLOCK master;
+  if(vdisk_read_block(MASTER_BLOCK_REFERENCE, &master) != 0)
+    return -1;
+  if(!oufs_master_has_ext(&master)){
+    fprintf(stderr, "oufs_fallocate(): disk has no unwritten-block table; reformat it\n");
+    return -1;
+  }
+  //Preallocation needs real blocks
+  if(file_inode.type == IT_INLINE_FILE && oufs_promote_inline(&file_inode, &master) != 0)
+    return -2;
+
+  int first_block = offset / BLOCK_SIZE;
+  int last_block = (offset + len - 1) / BLOCK_SIZE;
+
+  //Count the missing blocks and find where the run should start
+  int n_new = 0;
+  BLOCK_REFERENCE goal = UNALLOCATED_BLOCK;
+  for(int i = 0; i <= last_block; ++i){
+    if(file_inode.data[i] == UNALLOCATED_BLOCK){
+      if(i >= first_block)
+        ++n_new;
+    }
+    else if(i < first_block || n_new == 0){
+      goal = file_inode.data[i] + 1;
+    }
+  }
+
+  BLOCK_REFERENCE new_refs[BLOCKS_PER_INODE];
+  if(oufs_allocate_blocks_in_master(&master, n_new, goal, new_refs) < n_new){
+    fprintf(stderr, "Disk is full\n");
+    return -2; //The master block is not written: nothing was allocated
+  }
+
+  //Hand the blocks to the file, flagged as unwritten
+  for(int i = first_block, n_used = 0; i <= last_block; ++i){
+    if(file_inode.data[i] == UNALLOCATED_BLOCK){
+      BLOCK_REFERENCE b = new_refs[n_used++];
+      master.master_ext.block_unwritten_flag[b / 8] |= (1 << (b % 8));
+      file_inode.data[i] = b;
+    }
+  }
+  if(offset + len > file_inode.size)
+    file_inode.size = offset + len;
+
+  vdisk_write_block(MASTER_BLOCK_REFERENCE, &master);
+  oufs_write_inode_by_reference(fp->inode_reference, &file_inode);
+  return 0;
+}
+
+/**
+ * Close an open file: flush its buffered writes and release it
+ *
+ * @param fp The open file (may be NULL)
+ */
+void oufs_fclose(OUFILE *fp){
+  VDISK_TRACE("oufs_fclose");
+  if(fp == NULL)
+    return;
+  oufs_fflush(fp);
+  free(fp->wbuf);
+  free(fp);
+}
+
+/**
+ * Is an inode a regular file, whatever way its contents are stored?
+ *
+ * @param inode The inode
+ * @return 1 for files; 0 for directories and free inodes
+ */
+int oufs_is_file(INODE *inode){
+  return inode->type == IT_FILE || inode->type == IT_INLINE_FILE ||
+         inode->type == IT_COMPRESSED_FILE;
+}
+
+/**
+ * Turn an inline file into a regular file
+ *
+ * The contents are moved from the inode into a newly allocated data block.
+ * The inode is only changed in memory, and the allocation is only made in the
+ * given master block: the caller writes both back.
+ *
+ * @param inode An IT_INLINE_FILE inode
+ * @param master The master block
+ * @return 0 on success; -1 if the disk is full
+ */
+int oufs_promote_inline(INODE *inode, BLOCK *master){
+  BLOCK_REFERENCE ref;
+  if(oufs_allocate_blocks_in_master(master, 1, UNALLOCATED_BLOCK, &ref) != 1){
+    fprintf(stderr, "Disk is full\n");
+    return -1;
+  }
+
+  BLOCK block;
+  memset(&block, 0, sizeof(block));
+  memcpy(block.data.data, inode->data, inode->size);
+  vdisk_write_block(ref, &block);
+
+  inode->type = IT_FILE;
+  inode->data[0] = ref;
+  for(int i = 1; i < BLOCKS_PER_INODE; ++i)
+    inode->data[i] = UNALLOCATED_BLOCK;
+  return 0;
+}
+
+/**
+ * Load data block index of a file
+ *
+ * Holes (entries with no block) and preallocated blocks that were never
+ * written come back as zeros without a disk read.
+ *
+ * @param master The master block (used for the unwritten-block table)
+ * @param inode The file's inode
+ * @param index Index into inode->data
+ * @param block Filled with the block contents
+ * @return 0 on success; <0 on error
+ */
+int oufs_read_file_block(BLOCK *master, INODE *inode, int index, BLOCK *block){
+  BLOCK_REFERENCE ref = inode->data[index];
+  if(ref == UNALLOCATED_BLOCK || oufs_block_is_unwritten(master, ref)){
+    memset(block, 0, sizeof(*block));
+    return 0;
+  }
+  return vdisk_read_block(ref, block);
+}
+
+/**
+ * Load a range of data blocks of a file
+ *
+ * Like oufs_read_file_block(), but the blocks that are on the disk are read
+ * together, so that each run of consecutive blocks is one read and its
+ * checksums are verified in one pass.
+ *
+ * @param master The master block (used for the unwritten-block table)
+ * @param inode The file's inode
+ * @param first Index into inode->data of the first block
+ * @param n_blocks Number of blocks
+ * @param blocks Filled with the contents of the n_blocks blocks
+ * @return 0 on success; <0 on error
+ */
+int oufs_read_file_blocks(BLOCK *master, INODE *inode, int first, int n_blocks,
+                          BLOCK *blocks){
+  BLOCK_REFERENCE refs[BLOCKS_PER_INODE];
+  int slots[BLOCKS_PER_INODE];
+  int n_refs = 0;
+  for(int i = 0; i < n_blocks; ++i){
+    BLOCK_REFERENCE ref = inode->data[first + i];
+    if(ref == UNALLOCATED_BLOCK || oufs_block_is_unwritten(master, ref)){
+      memset(&blocks[i], 0, sizeof(blocks[i]));
+      continue;
+    }
+    refs[n_refs] = ref;
+    slots[n_refs++] = i;
+  }
+
+  BLOCK on_disk[BLOCKS_PER_INODE];
+  int ret = vdisk_read_blocks(refs, n_refs, on_disk);
+  for(int i = 0; i < n_refs; ++i)
+    blocks[slots[i]] = on_disk[i];
+  return ret;
+}
+
+/**
+ * Load and decompress the contents of a compressed file
+ *
+ * @param master The master block
+ * @param inode An IT_COMPRESSED_FILE inode
+ * @param contents Buffer of BLOCKS_PER_INODE * BLOCK_SIZE bytes.  Receives
+ * inode->size bytes
+ * @return 0 on success; <0 if the stream cannot be read or is damaged
+ */
+int oufs_read_compressed(BLOCK *master, INODE *inode, unsigned char *contents){
+  if(inode->size == 0)
+    return 0;
+  int n_blocks = 0;
+  while(n_blocks < BLOCKS_PER_INODE && inode->data[n_blocks] != UNALLOCATED_BLOCK)
+    ++n_blocks;
+
+  //The blocks of the stream, back to back
+  BLOCK blocks[BLOCKS_PER_INODE];
+  if(n_blocks == 0 || oufs_read_file_blocks(master, inode, 0, n_blocks, blocks) != 0)
+    return -1;
+  unsigned char *stream = (unsigned char *) blocks;
+  int room = n_blocks * BLOCK_SIZE - COMPRESSED_HEADER_SIZE;
+  int stream_len = stream[0] | (stream[1] << 8);
+
+  if(stream_len == COMPRESSED_RAW && (int) inode->size <= room){
+    memcpy(contents, stream + COMPRESSED_HEADER_SIZE, inode->size);
+    return 0;
+  }
+  if(stream_len != COMPRESSED_RAW && stream_len <= room &&
+     oufs_lz4_decompress(stream + COMPRESSED_HEADER_SIZE, stream_len, contents,
+                         inode->size) == (int) inode->size)
+    return 0;
+  fprintf(stderr, "Compressed file is damaged\n");
+  return -1;
+}
+
+/**
+ * Compress the contents of a file and store them in its blocks
+ *
+ * Blocks the file owns are rewritten in place, shared blocks are replaced
+ * (see oufs_unshare_block()) and blocks that are no longer needed are
+ * released.  Contents that do not compress are stored as they are; if even
+ * the stream header does not fit, the file becomes a plain IT_FILE.
+ *
+ * @param master The master block (updated in memory only)
+ * @param inode An IT_COMPRESSED_FILE inode, whose size is already the new size
+ * @param contents inode->size bytes
+ * @param freed Released blocks are added here (to be discarded later)
+ * @param n_freed Number of entries in freed; updated
+ * @return 0 on success; -1 if the disk is full (nothing changes)
+ */
+int oufs_write_compressed(BLOCK *master, INODE *inode, unsigned char *contents,
+                          BLOCK_REFERENCE *freed, int *n_freed){
+  INODE updated = *inode;
+  BLOCK blocks[BLOCKS_PER_INODE];
+  unsigned char *stream = (unsigned char *) blocks;
+  int capacity = BLOCKS_PER_INODE * BLOCK_SIZE;
+  int size = inode->size;
+
+  int stream_len = 0;
+  if(size > 0){
+    int len = oufs_lz4_compress(contents, size, stream + COMPRESSED_HEADER_SIZE,
+                                capacity - COMPRESSED_HEADER_SIZE);
+    if(len > 0 && len < size){
+      stream[0] = len & 0xFF;
+      stream[1] = len >> 8;
+      stream_len = COMPRESSED_HEADER_SIZE + len;
+    }
+    else if(size + COMPRESSED_HEADER_SIZE <= capacity){
+      //Does not compress: keep the bytes as they are
+      stream[0] = COMPRESSED_RAW & 0xFF;
+      stream[1] = COMPRESSED_RAW >> 8;
+      memcpy(stream + COMPRESSED_HEADER_SIZE, contents, size);
+      stream_len = COMPRESSED_HEADER_SIZE + size;
+    }
     else{
-      for(int j = 0; j < BLOCK_SIZE; ++j){
-        printf("%c", b.data.data[j]);
-        fflush(stdout);
-      }
+      //No room left for the header: store a plain file
+      memcpy(stream, contents, size);
+      stream_len = size;
+      updated.type = IT_FILE;
+    }
+  }
+  int n_blocks = (stream_len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  memset(stream + stream_len, 0, n_blocks * BLOCK_SIZE - stream_len);
+
+  //Blocks to allocate: missing ones, and shared ones that must be copied
+  int n_new = 0;
+  BLOCK_REFERENCE goal = UNALLOCATED_BLOCK;
+  for(int i = 0; i < n_blocks; ++i){
+    BLOCK_REFERENCE ref = updated.data[i];
+    if(ref == UNALLOCATED_BLOCK || oufs_block_is_shared(master, ref))
+      ++n_new;
+    else if(n_new == 0)
+      goal = ref + 1;
+  }
+  BLOCK_REFERENCE new_refs[BLOCKS_PER_INODE];
+  int n_allocated = oufs_allocate_blocks_in_master(master, n_new, goal, new_refs);
+  if(n_allocated < n_new){
+    oufs_free_blocks_in_master(master, new_refs, n_allocated);
+    fprintf(stderr, "Disk is full\n");
+    return -1;
+  }
+
+  BLOCK_REFERENCE released[BLOCKS_PER_INODE];
+  int n_released = 0;
+  for(int i = 0, n_used = 0; i < BLOCKS_PER_INODE; ++i){
+    BLOCK_REFERENCE ref = updated.data[i];
+    if(i >= n_blocks){
+      //The stream got shorter
+      if(ref != UNALLOCATED_BLOCK)
+        released[n_released++] = ref;
+      updated.data[i] = UNALLOCATED_BLOCK;
+      continue;
     }
+    if(ref != UNALLOCATED_BLOCK && oufs_block_is_shared(master, ref))
+      --master->master_ext.block_extra_refs[ref]; //The other owners keep it
+    else if(ref != UNALLOCATED_BLOCK)
+      continue;
+    updated.data[i] = new_refs[n_used++];
   }
+  n_released = oufs_free_blocks_in_master(master, released, n_released);
+  memcpy(freed + *n_freed, released, n_released * sizeof(BLOCK_REFERENCE));
+  *n_freed += n_released;
+
+  for(int i = 0; i < n_blocks; ++i)
+    vdisk_write_block(updated.data[i], &blocks[i]);
+  *inode = updated;
   return 0;
 }
 
+/**
+ * Read from an open file
+ *
+ * With a NULL buf, the whole file is written to stdout instead (zmore).
+ *
+ * @param fp The open file
+ * @param buf Buffer for the data, or NULL
+ * @param len Size of buf
+ * @return Number of bytes read (0 at the end of the file); <0 on error
+ */
+int oufs_fread(OUFILE *fp, unsigned char* buf, int len){
+  VDISK_TRACE("oufs_fread");
+  if(buf == NULL){
+    unsigned char contents[BLOCKS_PER_INODE * BLOCK_SIZE];
+    int n = oufs_pread(fp, contents, sizeof(contents), 0);
+    if(n > 0){
+      fwrite(contents, 1, n, stdout);
+      fflush(stdout);
+    }
+    return n;
+  }
+
+  int n = oufs_pread(fp, buf, len, fp->offset);
+  if(n > 0)
+    fp->offset += n;
+  return n;
+}
+
+/**
+ * Read from an open file at a given offset, without moving the file offset
+ *
+ * @param fp The open file
+ * @param buf Buffer for the data
+ * @param len Number of bytes wanted
+ * @param offset File offset of the first byte
+ * @return Number of bytes read (0 at or past the end of the file); <0 on error
+ */
+int oufs_pread(OUFILE *fp, unsigned char* buf, int len, int offset){
+  VDISK_TRACE("oufs_pread");
+  if(offset < 0 || len < 0)
+    return -1;
+
+  //Buffered writes have to be visible to the reader
+  oufs_fflush(fp);
+
+  INODE file_inode;
+  if(oufs_read_inode_by_reference(fp->inode_reference, &file_inode) != 0)
+    return -1;
+  if(offset >= file_inode.size || len == 0)
+    return 0;
+  len = MIN(len, file_inode.size - offset);
+
+  //Tiny file: the inode block was the only read needed
+  if(file_inode.type == IT_INLINE_FILE){
+    memcpy(buf, (unsigned char *) file_inode.data + offset, len);
+    return len;
+  }
+
+  //Needed to recognize preallocated blocks
+  BLOCK master;
+  if(vdisk_read_block(MASTER_BLOCK_REFERENCE, &master) != 0)
+    return -1;
+
+  //Compressed file: only readable as a whole
+  if(file_inode.type == IT_COMPRESSED_FILE){
+    unsigned char contents[BLOCKS_PER_INODE * BLOCK_SIZE];
+    if(oufs_read_compressed(&master, &file_inode, contents) != 0)
+      return -1;
+    memcpy(buf, contents + offset, len);
+    return len;
+  }
+
+  int end = offset + len;
+  int first_block = offset / BLOCK_SIZE;
+  int last_block = (end - 1) / BLOCK_SIZE;
+
+  //Get the kernel started on the blocks that follow this range
+  for(int i = first_block; i <= last_block; ++i)
+    oufs_readahead(fp, &file_inode, i);
+
+  //All of the blocks in one go
+  BLOCK blocks[BLOCKS_PER_INODE];
+  if(oufs_read_file_blocks(&master, &file_inode, first_block,
+                           last_block - first_block + 1, blocks) != 0)
+    return -1;
+
+  int buf_index = 0;
+  for(int i = first_block; i <= last_block; ++i){
+    //Part of block i that was asked for
+    int block_start = (buf_index == 0) ? offset % BLOCK_SIZE : 0;
+    int block_end = MIN(end - i * BLOCK_SIZE, BLOCK_SIZE);
+    memcpy(buf + buf_index, blocks[i - first_block].data.data + block_start,
+           block_end - block_start);
+    buf_index += block_end - block_start;
+  }
+  return buf_index;
+}
+
+/**
+ * Track sequential reads of an open file and prefetch the blocks ahead of the
+ * reader
+ *
+ * Called just before data block block_index of the file is read.  While the
+ * reader keeps asking for the next block in order, the readahead window
+ * doubles (from OUFS_READAHEAD_MIN up to OUFS_READAHEAD_MAX blocks) and the
+ * next window is requested as soon as the reader reaches the last block that
+ * was already prefetched.  Any other access pattern resets the window.
+ *
+ * @param fp The open file
+ * @param inode The file's inode
+ * @param block_index Index (into inode->data) of the block about to be read
+ */
+void oufs_readahead(OUFILE *fp, INODE *inode, int block_index) {
+  if(block_index != fp->ra_next_block){
+    //Not sequential: forget about the window
+    fp->ra_window = 0;
+    fp->ra_prefetched = block_index + 1;
+  }
+  else if(block_index + 1 >= fp->ra_prefetched){
+    //Sequential and about to run out of prefetched blocks: grow the window
+    if(fp->ra_window == 0)
+      fp->ra_window = OUFS_READAHEAD_MIN;
+    else
+      fp->ra_window = MIN(2 * fp->ra_window, OUFS_READAHEAD_MAX);
+
+    int start = block_index + 1;
+    if(fp->ra_prefetched > start)
+      start = fp->ra_prefetched;
+    int end = MIN(start + fp->ra_window, BLOCKS_PER_INODE);
+
+    //Collect the blocks of the window, skipping entries that hold no block
+    BLOCK_REFERENCE refs[BLOCKS_PER_INODE];
+    int n_refs = 0;
+    for(int i = start; i < end; ++i){
+      if(inode->data[i] != UNALLOCATED_BLOCK)
+        refs[n_refs++] = inode->data[i];
+    }
+    if(n_refs > 0)
+      vdisk_prefetch_blocks(refs, n_refs);
+    fp->ra_prefetched = end;
+  }
+  fp->ra_next_block = block_index + 1;
+}
+
 int oufs_remove(char *cwd, char* path){
+  VDISK_TRACE("oufs_remove");
   INODE_REFERENCE parent_ref;
   INODE_REFERENCE child_ref;
   char local_name[MAX_PATH_LENGTH];
@@ -985,20 +2021,26 @@ int oufs_remove(char *cwd, char* path){
   }
 
   if(child_ref != UNALLOCATED_INODE){
-    //Remove entry from parent's data block
+    //Both inodes are read before anything changes
     INODE parent_inode;
-    oufs_read_inode_by_reference(parent_ref, &parent_inode);
+    INODE child_inode;
+    if(oufs_read_inode_by_reference(parent_ref, &parent_inode) != 0 ||
+       oufs_read_inode_by_reference(child_ref, &child_inode) != 0)
+      return -1;
+
+    //Remove entry from parent's data block
 
     //Step through the parents directory block to remove the entry
     for(int i = 0; i < BLOCKS_PER_INODE; ++i){
       if(parent_inode.data[i] != UNALLOCATED_BLOCK){
         BLOCK b;
-        vdisk_read_block(parent_inode.data[i], &b);
+        if(vdisk_read_block(parent_inode.data[i], &b) != 0)
+          return -1;
         for(int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j){ //Load individual directory blocks
           if(!strcmp(b.directory.entry[j].name, local_name)){ //If entry matches the target
             strncpy(b.directory.entry[j].name, "", 1); //Set name to empty
             b.directory.entry[j].inode_reference = UNALLOCATED_INODE; //Mark inode as unallocated in parent
-            vdisk_write_block(parent_inode.data[i], &b); //Write changes back to disk
+            oufs_write_directory_block(parent_ref, &parent_inode, i, &b); //Write changes back to disk
             --parent_inode.size; //Decrement the parent's size
             oufs_write_inode_by_reference(parent_ref, &parent_inode); //Write changes back to disk
           }
@@ -1007,38 +2049,39 @@ int oufs_remove(char *cwd, char* path){
     }
     
     //Decrement n_references in inode
-    INODE child_inode;
-    oufs_read_inode_by_reference(child_ref, &child_inode);
     --child_inode.n_references;
-    oufs_write_inode_by_reference(child_ref, &child_inode);
 
     //If n_references is now 0, the inode and all associated data blocks are deallocated
     if(child_inode.n_references == 0){
-      BLOCK master;
-      vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
-      //Step through all the data blocks and emtpy
-      for(int i = 0; i < BLOCKS_PER_INODE; ++i){
-        if(child_inode.data[i] != UNALLOCATED_BLOCK){
-          BLOCK b;
-          vdisk_read_block(child_inode.data[i], &b);
-          for(int j = 0; j < BLOCK_SIZE; ++j){ //Empty entire block
-            b.data.data[j] = 0; 
-          }
-          vdisk_write_block(child_inode.data[i], &b); //Write emtpy block back to disk
-          master.master.block_allocated_flag[child_inode.data[i] / 8] &= ~(1 << (child_inode.data[i] % 8)); //Mark block as unallocated in master
-        }
+      //Only the allocation bits change: the old contents are left on the disk
+      //and overwritten whenever the blocks are handed out again
+      BLOCK_REFERENCE refs[BLOCKS_PER_INODE];
+      int n_refs = 0;
+      for(int i = 0; child_inode.type != IT_INLINE_FILE && i < BLOCKS_PER_INODE; ++i){
+        if(child_inode.data[i] != UNALLOCATED_BLOCK)
+          refs[n_refs++] = child_inode.data[i];
+        child_inode.data[i] = UNALLOCATED_BLOCK;
       }
+
+      BLOCK master;
+      if(vdisk_read_block(MASTER_BLOCK_REFERENCE, &master) != 0)
+        return -1;
+      n_refs = oufs_free_blocks_in_master(&master, refs, n_refs);
+      master.master.inode_allocated_flag[child_ref / 8] &= ~(1 << (child_ref % 8)); //Mark inode as unallocated in master block
+      vdisk_write_block(MASTER_BLOCK_REFERENCE, &master); //Write master block back to disk
+      oufs_discard_blocks(refs, n_refs);
+
       //Deallocate inode
       child_inode.type = IT_NONE;
       child_inode.size = 0;
-      oufs_write_inode_by_reference(child_ref, &child_inode); //Write emtpy inode back to disk
-      master.master.inode_allocated_flag[child_ref / 8] &= ~(1 << (child_ref % 8)); //Mark inode as unallocated in master block
-      vdisk_write_block(MASTER_BLOCK_REFERENCE, &master); //Write master block back to disk
     }
+    oufs_write_inode_by_reference(child_ref, &child_inode);
   }
+  return 0;
 }
 
 int oufs_link(char* cwd, char *path_src, char* path_dst){
+  VDISK_TRACE("oufs_link");
   //Checking if source exists
   INODE_REFERENCE src_parent_ref;
   INODE_REFERENCE src_child_ref;
@@ -1049,18 +2092,20 @@ int oufs_link(char* cwd, char *path_src, char* path_dst){
   }
 
   INODE src_child_inode;
+  src_child_inode.type = IT_NONE;
   if(src_child_ref != UNALLOCATED_INODE){
     oufs_read_inode_by_reference(src_child_ref, &src_child_inode);
   }
   
   //If the source does exist
-  if(src_child_inode.type == IT_FILE){
+  if(oufs_is_file(&src_child_inode)){
     //Opens source OUFILE 
     OUFILE* src_file;
     src_file = oufs_fopen(cwd, path_src, 'r');
     INODE_REFERENCE src_file_inode_ref = src_file->inode_reference;
     INODE src_file_inode;
-    oufs_read_inode_by_reference(src_file_inode_ref, &src_file_inode);
+    if(oufs_read_inode_by_reference(src_file_inode_ref, &src_file_inode) != 0)
+      return -1;
 
     //Gets destination file information
     INODE_REFERENCE dst_parent_ref;
@@ -1081,12 +2126,14 @@ int oufs_link(char* cwd, char *path_src, char* path_dst){
           if(dst_parent_inode.data[i] != UNALLOCATED_BLOCK){
             BLOCK_REFERENCE ref = dst_parent_inode.data[i];
             BLOCK block;
-            vdisk_read_block(ref, &block);
+            if(vdisk_read_block(ref, &block) != 0)
+              return -1;
             for(int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j){
               if(block.directory.entry[j].inode_reference == UNALLOCATED_INODE){
-                strncpy(block.directory.entry[j].name, local_name, strlen(local_name));
+                strncpy(block.directory.entry[j].name, local_name, FILE_NAME_SIZE - 1);
+                block.directory.entry[j].name[FILE_NAME_SIZE - 1] = 0;
                 block.directory.entry[j].inode_reference = src_file->inode_reference;
-                vdisk_write_block(ref, &block);
+                oufs_write_directory_block(dst_parent_ref, &dst_parent_inode, i, &block);
                 ++dst_parent_inode.size;
                 oufs_write_inode_by_reference(dst_parent_ref, &dst_parent_inode);
                 ++src_file_inode.n_references;
@@ -1106,3 +2153,1895 @@ int oufs_link(char* cwd, char *path_src, char* path_dst){
   fprintf(stderr, "\t 'new_name' must not exist and parent must be an existing directory\n");
   return -1;
 }
+
+// Tree operations
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+/**
+ * Start a batch of metadata updates
+ *
+ * The master block is loaded now; inode blocks are loaded the first time one
+ * of their inodes is needed.  Until oufs_batch_commit(), the only blocks
+ * written are ones the batch allocated (still free on the disk), so an
+ * operation that fails half way can simply drop the batch.
+ *
+ * @param batch The batch to initialize
+ * @return 0 on success; <0 on error
+ */
+int oufs_batch_begin(OUFS_BATCH *batch) {
+  memset(batch->inode_block_state, 0, sizeof(batch->inode_block_state));
+  batch->master_dirty = 0;
+  batch->n_dir_blocks = 0;
+  batch->n_freed = 0;
+  return vdisk_read_block(MASTER_BLOCK_REFERENCE, &batch->master);
+}
+
+/**
+ * Make sure the inode block holding inode i is in the batch
+ *
+ * @return The inode, inside the batch's copy of its block; NULL on error
+ */
+static INODE *oufs_batch_inode(OUFS_BATCH *batch, INODE_REFERENCE i) {
+  if (i >= N_INODES)
+    return NULL;
+  int block = i / INODES_PER_BLOCK;
+  if (batch->inode_block_state[block] == 0) {
+    if (vdisk_read_block(block + 1, &batch->inode_blocks[block]) != 0)
+      return NULL;
+    batch->inode_block_state[block] = 1;
+  }
+  return &batch->inode_blocks[block].inodes.inode[i % INODES_PER_BLOCK];
+}
+
+/**
+ * Read an inode, as modified so far by the batch
+ *
+ * @return 0 on success; -1 on error
+ */
+int oufs_batch_read_inode(OUFS_BATCH *batch, INODE_REFERENCE i, INODE *inode) {
+  INODE *p = oufs_batch_inode(batch, i);
+  if (p == NULL)
+    return -1;
+  *inode = *p;
+  return 0;
+}
+
+/**
+ * Update an inode in the batch
+ *
+ * @return 0 on success; -1 on error
+ */
+int oufs_batch_write_inode(OUFS_BATCH *batch, INODE_REFERENCE i, INODE *inode) {
+  INODE *p = oufs_batch_inode(batch, i);
+  if (p == NULL)
+    return -1;
+  *p = *inode;
+  batch->inode_block_state[i / INODES_PER_BLOCK] = 2;
+  return 0;
+}
+
+/**
+ * Allocate an inode in the batch's master block
+ *
+ * @return The new inode; UNALLOCATED_INODE if there is none left
+ */
+INODE_REFERENCE oufs_batch_allocate_inode(OUFS_BATCH *batch) {
+  for (int i = 0; i < N_INODES; ++i) {
+    if (!(batch->master.master.inode_allocated_flag[i >> 3] & (1 << (i & 7)))) {
+      batch->master.master.inode_allocated_flag[i >> 3] |= (1 << (i & 7));
+      batch->master_dirty = 1;
+      return i;
+    }
+  }
+  return UNALLOCATED_INODE;
+}
+
+/**
+ * Release an inode and all of its data blocks in the batch
+ *
+ * @return 0 on success; -1 on error
+ */
+int oufs_batch_free_inode(OUFS_BATCH *batch, INODE_REFERENCE i) {
+  INODE inode;
+  if (oufs_batch_read_inode(batch, i, &inode) != 0)
+    return -1;
+
+  BLOCK_REFERENCE *refs = batch->freed + batch->n_freed;
+  int n_refs = 0;
+  for (int b = 0; inode.type != IT_INLINE_FILE && b < BLOCKS_PER_INODE; ++b) {
+    if (inode.data[b] != UNALLOCATED_BLOCK)
+      refs[n_refs++] = inode.data[b];
+  }
+  batch->n_freed += oufs_free_blocks_in_master(&batch->master, refs, n_refs);
+
+  inode.type = IT_NONE;
+  inode.n_references = 0;
+  for (int b = 0; b < BLOCKS_PER_INODE; ++b)
+    inode.data[b] = UNALLOCATED_BLOCK;
+  inode.size = 0;
+  oufs_batch_write_inode(batch, i, &inode);
+
+  batch->master.master.inode_allocated_flag[i >> 3] &= ~(1 << (i & 7));
+  batch->master_dirty = 1;
+  return 0;
+}
+
+/**
+ * Write all of the batch's changes to the disk: the directory blocks, then
+ * each modified inode block once, then the master block once
+ *
+ * @return 0 on success; <0 on error
+ */
+int oufs_batch_commit(OUFS_BATCH *batch) {
+  VDISK_TRACE("oufs_batch_commit");
+  for (int d = 0; d < batch->n_dir_blocks; ++d) {
+    if (vdisk_write_block(batch->dir_block_refs[d], &batch->dir_blocks[d]) != 0)
+      return -1;
+  }
+  batch->n_dir_blocks = 0;
+  for (int b = 0; b < N_INODE_BLOCKS; ++b) {
+    if (batch->inode_block_state[b] == 2) {
+      if (vdisk_write_block(b + 1, &batch->inode_blocks[b]) != 0)
+        return -1;
+      batch->inode_block_state[b] = 1;
+    }
+  }
+  if (batch->master_dirty) {
+    if (vdisk_write_block(MASTER_BLOCK_REFERENCE, &batch->master) != 0)
+      return -1;
+    batch->master_dirty = 0;
+  }
+  oufs_discard_blocks(batch->freed, batch->n_freed);
+  batch->n_freed = 0;
+  return 0;
+}
+
+/**
+ * Read a directory block, as modified so far by the batch
+ *
+ * @return 0 on success; <0 on error
+ */
+static int oufs_batch_read_directory_block(OUFS_BATCH *batch,
+                                           BLOCK_REFERENCE ref, BLOCK *block) {
+  for (int d = 0; d < batch->n_dir_blocks; ++d) {
+    if (batch->dir_block_refs[d] == ref) {
+      *block = batch->dir_blocks[d];
+      return 0;
+    }
+  }
+  return vdisk_read_block(ref, block);
+}
+
+/**
+ * Write one block of a directory in the batch, copying it first if it is
+ * shared with a snapshot.  The block reaches the disk at the commit.
+ *
+ * @param dir_ref The directory
+ * @param dir The directory's inode.  If the block moves, the inode is updated
+ * here and in the batch
+ * @param index Which of the directory's blocks to write
+ * @param block The new contents
+ * @return 0 on success; <0 on error
+ */
+int oufs_batch_write_directory_block(OUFS_BATCH *batch, INODE_REFERENCE dir_ref,
+                                     INODE *dir, int index, BLOCK *block) {
+  int d = 0;
+  while (d < batch->n_dir_blocks && batch->dir_block_refs[d] != dir->data[index])
+    ++d;
+  if (d == OUFS_BATCH_DIR_BLOCKS)
+    return -1;
+
+  int moved = oufs_unshare_block(&batch->master, &dir->data[index]);
+  if (moved < 0)
+    return -1;
+  if (moved) {
+    batch->master_dirty = 1;
+    if (oufs_batch_write_inode(batch, dir_ref, dir) != 0)
+      return -1;
+  }
+  if (d == batch->n_dir_blocks)
+    ++batch->n_dir_blocks;
+  batch->dir_block_refs[d] = dir->data[index];
+  batch->dir_blocks[d] = *block;
+  return 0;
+}
+
+/**
+ * Add a name to a directory
+ *
+ * The first free entry of the directory's blocks is used.  When they are all
+ * full, the directory grows by one block, allocated in the batch.
+ *
+ * @param dir_ref The directory
+ * @param name Name of the new entry
+ * @param child Inode the entry refers to
+ * @return 0 on success; -1 if the directory is full
+ */
+int oufs_batch_add_entry(OUFS_BATCH *batch, INODE_REFERENCE dir_ref, char *name,
+                         INODE_REFERENCE child) {
+  INODE dir;
+  if (oufs_batch_read_inode(batch, dir_ref, &dir) != 0)
+    return -1;
+
+  BLOCK block;
+  int hole = -1;
+  int entry = -1;
+  for (int i = 0; entry == -1 && i < BLOCKS_PER_INODE; ++i) {
+    if (dir.data[i] == UNALLOCATED_BLOCK) {
+      if (hole == -1)
+        hole = i;
+      continue;
+    }
+    if (oufs_batch_read_directory_block(batch, dir.data[i], &block) != 0)
+      return -1;
+    for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j) {
+      if (block.directory.entry[j].inode_reference == UNALLOCATED_INODE) {
+        hole = i;
+        entry = j;
+        break;
+      }
+    }
+  }
+
+  if (entry == -1) {
+    // Every block is full: grow the directory
+    if (hole == -1) {
+      fprintf(stderr, "Directory is full\n");
+      return -1;
+    }
+    BLOCK_REFERENCE goal = hole > 0 ? dir.data[hole - 1] + 1 : UNALLOCATED_BLOCK;
+    if (oufs_allocate_blocks_in_master(&batch->master, 1, goal,
+                                       &dir.data[hole]) != 1) {
+      fprintf(stderr, "Disk is full\n");
+      return -1;
+    }
+    batch->master_dirty = 1;
+    for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j)
+      oufs_clean_directory_entry(&block.directory.entry[j]);
+    entry = 0;
+  }
+
+  strncpy(block.directory.entry[entry].name, name, FILE_NAME_SIZE - 1);
+  block.directory.entry[entry].name[FILE_NAME_SIZE - 1] = 0;
+  block.directory.entry[entry].inode_reference = child;
+  if (oufs_batch_write_directory_block(batch, dir_ref, &dir, hole, &block) != 0)
+    return -1;
+
+  ++dir.size;
+  return oufs_batch_write_inode(batch, dir_ref, &dir);
+}
+
+/**
+ * Remove a name from a directory
+ *
+ * @param dir_ref The directory
+ * @param name Name of the entry ("." and ".." cannot be removed)
+ * @return The inode the entry referred to; UNALLOCATED_INODE if there was none
+ */
+INODE_REFERENCE oufs_batch_remove_entry(OUFS_BATCH *batch,
+                                        INODE_REFERENCE dir_ref, char *name) {
+  INODE dir;
+  if (!strcmp(name, ".") || !strcmp(name, "..") ||
+      oufs_batch_read_inode(batch, dir_ref, &dir) != 0)
+    return UNALLOCATED_INODE;
+
+  for (int i = 0; i < BLOCKS_PER_INODE; ++i) {
+    if (dir.data[i] == UNALLOCATED_BLOCK)
+      continue;
+    BLOCK block;
+    if (oufs_batch_read_directory_block(batch, dir.data[i], &block) != 0)
+      return UNALLOCATED_INODE;
+    for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j) {
+      DIRECTORY_ENTRY *e = &block.directory.entry[j];
+      if (e->inode_reference != UNALLOCATED_INODE && !strcmp(e->name, name)) {
+        INODE_REFERENCE child = e->inode_reference;
+        oufs_clean_directory_entry(e);
+        --dir.size;
+        if (oufs_batch_write_directory_block(batch, dir_ref, &dir, i, &block) != 0 ||
+            oufs_batch_write_inode(batch, dir_ref, &dir) != 0)
+          return UNALLOCATED_INODE;
+        return child;
+      }
+    }
+  }
+  return UNALLOCATED_INODE;
+}
+
+/**
+ * Is directory ancestor the same as dir, or one of its ancestors?
+ *
+ * Walks up from dir through the ".." entries.
+ */
+static int oufs_batch_is_ancestor(OUFS_BATCH *batch, INODE_REFERENCE ancestor,
+                                  INODE_REFERENCE dir) {
+  for (int depth = 0; depth < N_INODES; ++depth) {
+    if (dir == ancestor)
+      return 1;
+    if (dir == 0)
+      return 0; // Reached the root
+    INODE inode;
+    BLOCK block;
+    if (oufs_batch_read_inode(batch, dir, &inode) != 0 ||
+        inode.data[0] == UNALLOCATED_BLOCK ||
+        oufs_batch_read_directory_block(batch, inode.data[0], &block) != 0)
+      return 0;
+    dir = block.directory.entry[1].inode_reference;
+  }
+  return 0;
+}
+
+/**
+ * Drop one reference to inode ref and, for a directory, to everything below
+ * it.  Inodes that lose their last reference are freed with their blocks.
+ * The directory blocks of the subtree are never rewritten: they are just
+ * released.
+ */
+static int oufs_batch_remove_subtree(OUFS_BATCH *batch, INODE_REFERENCE ref) {
+  INODE inode;
+  if (oufs_batch_read_inode(batch, ref, &inode) != 0)
+    return -1;
+
+  if (inode.type == IT_DIRECTORY) {
+    for (int i = 0; i < BLOCKS_PER_INODE; ++i) {
+      if (inode.data[i] == UNALLOCATED_BLOCK)
+        continue;
+      BLOCK block;
+      if (oufs_batch_read_directory_block(batch, inode.data[i], &block) != 0)
+        return -1;
+      for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j) {
+        DIRECTORY_ENTRY *e = &block.directory.entry[j];
+        if (e->inode_reference == UNALLOCATED_INODE || !strcmp(e->name, ".") ||
+            !strcmp(e->name, ".."))
+          continue;
+        if (oufs_batch_remove_subtree(batch, e->inode_reference) != 0)
+          return -1;
+      }
+    }
+  }
+
+  // Other hard links may still refer to a file
+  if (inode.n_references > 1) {
+    --inode.n_references;
+    return oufs_batch_write_inode(batch, ref, &inode);
+  }
+  return oufs_batch_free_inode(batch, ref);
+}
+
+/**
+ * Remove a file, or a directory together with everything below it
+ *
+ * The whole tree is removed in one traversal: the master block and each
+ * inode block are written once at the end, and the only directory block
+ * rewritten is the one that held the name.
+ *
+ * @param cwd Current working directory
+ * @param path What to remove
+ * @param recursive Nonzero to allow removing a non-empty directory
+ * @return 0 on success; <0 on error
+ */
+int oufs_remove_tree(char *cwd, char *path, int recursive) {
+  VDISK_TRACE("oufs_remove_tree");
+  INODE_REFERENCE parent;
+  INODE_REFERENCE child;
+  char local_name[MAX_PATH_LENGTH];
+  if (oufs_find_file(cwd, path, &parent, &child, local_name) != 0 ||
+      child == UNALLOCATED_INODE) {
+    fprintf(stderr, "%s does not exist\n", path);
+    return -1;
+  }
+  if (child == 0 || !strcmp(local_name, ".") || !strcmp(local_name, "..")) {
+    fprintf(stderr, "Cannot remove %s\n", path);
+    return -2;
+  }
+
+  OUFS_BATCH batch;
+  if (oufs_batch_begin(&batch) != 0)
+    return -3;
+  INODE inode;
+  oufs_batch_read_inode(&batch, child, &inode);
+  if (inode.type == IT_DIRECTORY && inode.size > 2 && !recursive) {
+    fprintf(stderr, "%s is a non-empty directory\n", path);
+    return -2;
+  }
+
+  if (oufs_batch_remove_entry(&batch, parent, local_name) != child ||
+      oufs_batch_remove_subtree(&batch, child) != 0)
+    return -3;
+  return oufs_batch_commit(&batch);
+}
+
+/**
+ * Copy the contents of a file into a new inode
+ *
+ * @return 0 on success; -1 if the disk is full or a block cannot be read
+ */
+static int oufs_batch_copy_file(OUFS_BATCH *batch, INODE *src, INODE *dst) {
+  *dst = *src;
+  dst->n_references = 1;
+  if (src->type == IT_INLINE_FILE)
+    return 0; // The contents came with the inode
+
+  // One contiguous run for all of the blocks with data (holes and
+  // preallocated-but-unwritten blocks stay holes)
+  int n_blocks = 0;
+  for (int i = 0; i < BLOCKS_PER_INODE; ++i) {
+    if (src->data[i] != UNALLOCATED_BLOCK &&
+        !oufs_block_is_unwritten(&batch->master, src->data[i]))
+      ++n_blocks;
+  }
+  BLOCK_REFERENCE refs[BLOCKS_PER_INODE];
+  if (oufs_allocate_blocks_in_master(&batch->master, n_blocks,
+                                     UNALLOCATED_BLOCK, refs) != n_blocks) {
+    fprintf(stderr, "Disk is full\n");
+    return -1;
+  }
+  batch->master_dirty = 1;
+
+  for (int i = 0, n_used = 0; i < BLOCKS_PER_INODE; ++i) {
+    if (src->data[i] == UNALLOCATED_BLOCK ||
+        oufs_block_is_unwritten(&batch->master, src->data[i])) {
+      dst->data[i] = UNALLOCATED_BLOCK;
+      continue;
+    }
+    BLOCK block;
+    if (vdisk_read_block(src->data[i], &block) != 0)
+      return -1;
+    dst->data[i] = refs[n_used++];
+    BLOCK_REFERENCE same = oufs_dedup_find(&batch->master, &block, dst->data[i]);
+    if (same != UNALLOCATED_BLOCK) {
+      // Dedup mode: the copy shares the indexed block
+      oufs_free_blocks_in_master(&batch->master, &dst->data[i], 1);
+      dst->data[i] = same;
+      continue;
+    }
+    vdisk_write_block(dst->data[i], &block);
+    oufs_dedup_register(&batch->master, dst->data[i]);
+  }
+  return 0;
+}
+
+/**
+ * Copy the subtree rooted at src into a new inode whose parent directory is
+ * new_parent.  Each new directory block is filled in memory and written once.
+ *
+ * @return The new inode; UNALLOCATED_INODE if the disk is full
+ */
+static INODE_REFERENCE oufs_batch_copy_subtree(OUFS_BATCH *batch,
+                                               INODE_REFERENCE src,
+                                               INODE_REFERENCE new_parent) {
+  INODE src_inode;
+  if (oufs_batch_read_inode(batch, src, &src_inode) != 0)
+    return UNALLOCATED_INODE;
+  INODE_REFERENCE dst = oufs_batch_allocate_inode(batch);
+  if (dst == UNALLOCATED_INODE) {
+    fprintf(stderr, "No inodes left\n");
+    return UNALLOCATED_INODE;
+  }
+
+  INODE dst_inode;
+  if (src_inode.type != IT_DIRECTORY) {
+    if (oufs_batch_copy_file(batch, &src_inode, &dst_inode) != 0)
+      return UNALLOCATED_INODE;
+    oufs_batch_write_inode(batch, dst, &dst_inode);
+    return dst;
+  }
+
+  // Directory: gather its entries, without "." and ".."
+  DIRECTORY_ENTRY entries[BLOCKS_PER_INODE * DIRECTORY_ENTRIES_PER_BLOCK];
+  int n_entries = 0;
+  for (int i = 0; i < BLOCKS_PER_INODE; ++i) {
+    if (src_inode.data[i] == UNALLOCATED_BLOCK)
+      continue;
+    BLOCK block;
+    if (oufs_batch_read_directory_block(batch, src_inode.data[i], &block) != 0)
+      return UNALLOCATED_INODE;
+    for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j) {
+      DIRECTORY_ENTRY *e = &block.directory.entry[j];
+      if (e->inode_reference != UNALLOCATED_INODE && strcmp(e->name, ".") &&
+          strcmp(e->name, ".."))
+        entries[n_entries++] = *e;
+    }
+  }
+
+  // The copy packs the entries into as few blocks as possible
+  int n_blocks = (n_entries + 2 + DIRECTORY_ENTRIES_PER_BLOCK - 1) /
+                 DIRECTORY_ENTRIES_PER_BLOCK;
+  dst_inode.type = IT_DIRECTORY;
+  dst_inode.n_references = 1;
+  for (int i = 0; i < BLOCKS_PER_INODE; ++i)
+    dst_inode.data[i] = UNALLOCATED_BLOCK;
+  dst_inode.size = n_entries + 2;
+  if (oufs_allocate_blocks_in_master(&batch->master, n_blocks,
+                                     UNALLOCATED_BLOCK,
+                                     dst_inode.data) != n_blocks) {
+    fprintf(stderr, "Disk is full\n");
+    return UNALLOCATED_INODE;
+  }
+  batch->master_dirty = 1;
+  // Written now so that the subtree below can find its parent
+  oufs_batch_write_inode(batch, dst, &dst_inode);
+
+  int next = 0;
+  for (int i = 0; i < n_blocks; ++i) {
+    BLOCK block;
+    int first = 0;
+    if (i == 0) {
+      oufs_clean_directory_block(dst, new_parent, &block);
+      first = 2;
+    } else {
+      for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j)
+        oufs_clean_directory_entry(&block.directory.entry[j]);
+    }
+    for (int j = first; j < DIRECTORY_ENTRIES_PER_BLOCK && next < n_entries;
+         ++j, ++next) {
+      INODE_REFERENCE copy =
+          oufs_batch_copy_subtree(batch, entries[next].inode_reference, dst);
+      if (copy == UNALLOCATED_INODE)
+        return UNALLOCATED_INODE;
+      block.directory.entry[j] = entries[next];
+      block.directory.entry[j].inode_reference = copy;
+    }
+    vdisk_write_block(dst_inode.data[i], &block);
+  }
+  return dst;
+}
+
+/**
+ * Resolve the destination of a copy or a move
+ *
+ * If dst names an existing directory, the item goes inside it under its own
+ * name; otherwise dst must not exist yet and its parent must be a directory.
+ *
+ * @param name In: the source's name.  Out: the name to create
+ * @param dst_parent Out: the directory that receives the new name
+ * @return 0 on success; <0 on error (already reported)
+ */
+static int oufs_resolve_destination(OUFS_BATCH *batch, char *cwd, char *dst,
+                                    char *name, INODE_REFERENCE *dst_parent) {
+  INODE_REFERENCE parent;
+  INODE_REFERENCE child;
+  char local_name[MAX_PATH_LENGTH];
+  oufs_find_file(cwd, dst, &parent, &child, local_name);
+
+  INODE inode;
+  if (child != UNALLOCATED_INODE) {
+    oufs_batch_read_inode(batch, child, &inode);
+    if (inode.type != IT_DIRECTORY) {
+      fprintf(stderr, "%s already exists\n", dst);
+      return -1;
+    }
+    // Into an existing directory, keeping the name
+    *dst_parent = child;
+    if (oufs_find_directory_element(&inode, name) != UNALLOCATED_INODE) {
+      fprintf(stderr, "%s/%s already exists\n", dst, name);
+      return -1;
+    }
+    return 0;
+  }
+
+  if (parent == UNALLOCATED_INODE) {
+    fprintf(stderr, "Parent of %s does not exist\n", dst);
+    return -2;
+  }
+  oufs_batch_read_inode(batch, parent, &inode);
+  if (inode.type != IT_DIRECTORY) {
+    fprintf(stderr, "Parent of %s is a file\n", dst);
+    return -2;
+  }
+  *dst_parent = parent;
+  strncpy(name, local_name, MAX_PATH_LENGTH - 1);
+  name[MAX_PATH_LENGTH - 1] = 0;
+  return 0;
+}
+
+/**
+ * Copy a file, or a directory together with everything below it
+ *
+ * The copy is built in one traversal.  Either the whole tree is copied or,
+ * if the disk fills up, nothing changes: the batch is only committed once
+ * the copy is complete.
+ *
+ * @param cwd Current working directory
+ * @param src What to copy
+ * @param dst Name of the copy, or an existing directory to copy into
+ * @param recursive Nonzero to allow copying a directory
+ * @return 0 on success; <0 on error
+ */
+int oufs_copy_tree(char *cwd, char *src, char *dst, int recursive) {
+  VDISK_TRACE("oufs_copy_tree");
+  INODE_REFERENCE src_parent;
+  INODE_REFERENCE src_child;
+  char name[MAX_PATH_LENGTH];
+  if (oufs_find_file(cwd, src, &src_parent, &src_child, name) != 0 ||
+      src_child == UNALLOCATED_INODE) {
+    fprintf(stderr, "%s does not exist\n", src);
+    return -1;
+  }
+
+  OUFS_BATCH batch;
+  if (oufs_batch_begin(&batch) != 0)
+    return -3;
+  INODE inode;
+  oufs_batch_read_inode(&batch, src_child, &inode);
+  if (inode.type == IT_DIRECTORY && !recursive) {
+    fprintf(stderr, "%s is a directory\n", src);
+    return -2;
+  }
+
+  INODE_REFERENCE dst_parent;
+  if (oufs_resolve_destination(&batch, cwd, dst, name, &dst_parent) != 0)
+    return -2;
+  if (inode.type == IT_DIRECTORY &&
+      oufs_batch_is_ancestor(&batch, src_child, dst_parent)) {
+    fprintf(stderr, "Cannot copy %s into itself\n", src);
+    return -2;
+  }
+
+  INODE_REFERENCE copy = oufs_batch_copy_subtree(&batch, src_child, dst_parent);
+  if (copy == UNALLOCATED_INODE ||
+      oufs_batch_add_entry(&batch, dst_parent, name, copy) != 0)
+    return -3;
+  return oufs_batch_commit(&batch);
+}
+
+/**
+ * Rename or move a file or directory
+ *
+ * Only directory entries change: the data is not copied.  A directory that
+ * moves to a new parent has its ".." entry updated.
+ *
+ * @param cwd Current working directory
+ * @param src What to move
+ * @param dst New name, or an existing directory to move into
+ * @return 0 on success; <0 on error
+ */
+int oufs_rename(char *cwd, char *src, char *dst) {
+  VDISK_TRACE("oufs_rename");
+  INODE_REFERENCE src_parent;
+  INODE_REFERENCE src_child;
+  char src_name[MAX_PATH_LENGTH];
+  if (oufs_find_file(cwd, src, &src_parent, &src_child, src_name) != 0 ||
+      src_child == UNALLOCATED_INODE) {
+    fprintf(stderr, "%s does not exist\n", src);
+    return -1;
+  }
+  if (src_child == 0 || !strcmp(src_name, ".") || !strcmp(src_name, "..")) {
+    fprintf(stderr, "Cannot move %s\n", src);
+    return -2;
+  }
+
+  OUFS_BATCH batch;
+  if (oufs_batch_begin(&batch) != 0)
+    return -3;
+  char name[MAX_PATH_LENGTH];
+  strcpy(name, src_name);
+  INODE_REFERENCE dst_parent;
+  if (oufs_resolve_destination(&batch, cwd, dst, name, &dst_parent) != 0)
+    return -2;
+
+  INODE inode;
+  oufs_batch_read_inode(&batch, src_child, &inode);
+  if (inode.type == IT_DIRECTORY &&
+      oufs_batch_is_ancestor(&batch, src_child, dst_parent)) {
+    fprintf(stderr, "Cannot move %s into itself\n", src);
+    return -2;
+  }
+
+  // All of the changes are staged in the batch: a failure on the way (a full
+  // directory or disk) leaves the disk as it was
+  if (oufs_batch_add_entry(&batch, dst_parent, name, src_child) != 0 ||
+      oufs_batch_remove_entry(&batch, src_parent, src_name) != src_child)
+    return -3;
+
+  if (inode.type == IT_DIRECTORY && dst_parent != src_parent) {
+    // Point ".." at the new parent
+    BLOCK block;
+    if (oufs_batch_read_directory_block(&batch, inode.data[0], &block) != 0)
+      return -3;
+    block.directory.entry[1].inode_reference = dst_parent;
+    if (oufs_batch_write_directory_block(&batch, src_child, &inode, 0, &block) != 0)
+      return -3;
+  }
+  return oufs_batch_commit(&batch);
+}
+
+/**
+ * Clone a file: the new inode shares the source's data blocks
+ *
+ * Each shared block counts one more reference in the master block.  No data
+ * is copied now; the first write to a shared block, through either file,
+ * gives that file its own copy of just that block.
+ *
+ * @param cwd Current working directory
+ * @param src The file to clone
+ * @param dst Name of the clone, or an existing directory to clone into
+ * @return 0 on success; <0 on error
+ */
+int oufs_clone(char *cwd, char *src, char *dst) {
+  VDISK_TRACE("oufs_clone");
+  INODE_REFERENCE src_parent;
+  INODE_REFERENCE src_child;
+  char name[MAX_PATH_LENGTH];
+  if (oufs_find_file(cwd, src, &src_parent, &src_child, name) != 0 ||
+      src_child == UNALLOCATED_INODE) {
+    fprintf(stderr, "%s does not exist\n", src);
+    return -1;
+  }
+
+  OUFS_BATCH batch;
+  if (oufs_batch_begin(&batch) != 0)
+    return -3;
+  if (!oufs_master_has_ext(&batch.master)) {
+    fprintf(stderr, "Disk does not support clones; reformat it\n");
+    return -3;
+  }
+  INODE inode;
+  oufs_batch_read_inode(&batch, src_child, &inode);
+  if (!oufs_is_file(&inode)) {
+    fprintf(stderr, "%s is not a file\n", src);
+    return -2;
+  }
+
+  INODE_REFERENCE dst_parent;
+  if (oufs_resolve_destination(&batch, cwd, dst, name, &dst_parent) != 0)
+    return -2;
+
+  INODE clone = inode;
+  clone.n_references = 1;
+  if (inode.type != IT_INLINE_FILE) {
+    for (int i = 0; i < BLOCKS_PER_INODE; ++i) {
+      BLOCK_REFERENCE b = inode.data[i];
+      if (b == UNALLOCATED_BLOCK)
+        continue;
+      if (oufs_block_is_unwritten(&batch.master, b)) {
+        clone.data[i] = UNALLOCATED_BLOCK; // Nothing to share: a hole
+        continue;
+      }
+      if (batch.master.master_ext.block_extra_refs[b] == UCHAR_MAX) {
+        fprintf(stderr, "Too many clones of %s\n", src);
+        return -3;
+      }
+    }
+    for (int i = 0; i < BLOCKS_PER_INODE; ++i) {
+      if (clone.data[i] != UNALLOCATED_BLOCK)
+        ++batch.master.master_ext.block_extra_refs[clone.data[i]];
+    }
+    batch.master_dirty = 1;
+  }
+
+  INODE_REFERENCE ref = oufs_batch_allocate_inode(&batch);
+  if (ref == UNALLOCATED_INODE) {
+    fprintf(stderr, "No inodes left\n");
+    return -3;
+  }
+  oufs_batch_write_inode(&batch, ref, &clone);
+  if (oufs_batch_add_entry(&batch, dst_parent, name, ref) != 0)
+    return -3;
+  return oufs_batch_commit(&batch);
+}
+
+// Snapshots
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+/**
+ * Load the master block and the snapshot table
+ *
+ * @return 0 on success; -1 if the disk has no snapshot table
+ */
+static int oufs_snapshot_load(BLOCK *master, BLOCK *table) {
+  if (vdisk_read_block(MASTER_BLOCK_REFERENCE, master) != 0)
+    return -1;
+  if (!oufs_master_has_ext(master) || master->master_ext.snapshot_table == 0) {
+    fprintf(stderr, "Disk has no snapshot table; reformat it\n");
+    return -1;
+  }
+  return vdisk_read_block(master->master_ext.snapshot_table, table);
+}
+
+/**
+ * Find a snapshot by name
+ *
+ * @return Index of the snapshot in the table; -1 if there is none
+ */
+static int oufs_snapshot_find(BLOCK *table, char *name) {
+  for (int i = 0; i < SNAPSHOTS_PER_BLOCK; ++i) {
+    SNAPSHOT_ENTRY *e = &table->snapshots.entry[i];
+    if (e->name[0] != 0 && !strncmp(e->name, name, FILE_NAME_SIZE - 1))
+      return i;
+  }
+  return -1;
+}
+
+/**
+ * List every block referenced by the inodes of a set of inode blocks
+ *
+ * @param inode_blocks The N_INODE_BLOCKS inode blocks
+ * @param refs Out: the blocks (room for N_INODES * BLOCKS_PER_INODE)
+ * @return Number of entries in refs
+ */
+static int oufs_snapshot_collect(BLOCK *inode_blocks, BLOCK_REFERENCE *refs) {
+  int n_refs = 0;
+  for (int b = 0; b < N_INODE_BLOCKS; ++b) {
+    for (int i = 0; i < INODES_PER_BLOCK; ++i) {
+      INODE *inode = &inode_blocks[b].inodes.inode[i];
+      if (inode->type != IT_FILE && inode->type != IT_DIRECTORY &&
+          inode->type != IT_COMPRESSED_FILE)
+        continue; // Free, or contents kept in the inode
+      for (int j = 0; j < BLOCKS_PER_INODE; ++j) {
+        if (inode->data[j] != UNALLOCATED_BLOCK)
+          refs[n_refs++] = inode->data[j];
+      }
+    }
+  }
+  return n_refs;
+}
+
+/**
+ * Add one reference to each of a list of blocks
+ *
+ * @return 0 on success; -1 (and nothing changes) if a counter would overflow
+ */
+static int oufs_snapshot_share(BLOCK *master, BLOCK_REFERENCE *refs,
+                               int n_refs) {
+  unsigned char *extra = master->master_ext.block_extra_refs;
+  for (int i = 0; i < n_refs; ++i) {
+    if (extra[refs[i]] == UCHAR_MAX) {
+      fprintf(stderr, "Block %d is shared too many times\n", refs[i]);
+      return -1;
+    }
+  }
+  for (int i = 0; i < n_refs; ++i)
+    ++extra[refs[i]];
+  return 0;
+}
+
+/**
+ * Take a snapshot of the whole file system
+ *
+ * Only the master block and the inode blocks are copied.  Every file and
+ * directory block gains a reference, so the next write to it, from either
+ * side, goes to a new block.
+ *
+ * @param name Name of the snapshot
+ * @return 0 on success; <0 on error
+ */
+int oufs_snapshot_create(char *name) {
+  VDISK_TRACE("oufs_snapshot_create");
+  BLOCK master;
+  BLOCK table;
+  if (oufs_snapshot_load(&master, &table) != 0)
+    return -1;
+  if (name[0] == 0 || oufs_snapshot_find(&table, name) != -1) {
+    fprintf(stderr, "Snapshot %s already exists\n", name);
+    return -2;
+  }
+  int slot;
+  for (slot = 0; slot < SNAPSHOTS_PER_BLOCK; ++slot) {
+    if (table.snapshots.entry[slot].name[0] == 0)
+      break;
+  }
+  if (slot == SNAPSHOTS_PER_BLOCK) {
+    fprintf(stderr, "Snapshot table is full\n");
+    return -2;
+  }
+
+  BLOCK copies[1 + N_INODE_BLOCKS];
+  BLOCK_REFERENCE inode_refs[N_INODE_BLOCKS];
+  for (int b = 0; b < N_INODE_BLOCKS; ++b)
+    inode_refs[b] = b + 1;
+  copies[0] = master;
+  if (vdisk_read_blocks(inode_refs, N_INODE_BLOCKS, copies + 1) != 0)
+    return -1;
+
+  BLOCK_REFERENCE refs[N_INODES * BLOCKS_PER_INODE];
+  int n_refs = oufs_snapshot_collect(copies + 1, refs);
+  BLOCK_REFERENCE copy_refs[1 + N_INODE_BLOCKS];
+  if (oufs_allocate_blocks_in_master(&master, 1 + N_INODE_BLOCKS,
+                                     UNALLOCATED_BLOCK,
+                                     copy_refs) != 1 + N_INODE_BLOCKS) {
+    fprintf(stderr, "Disk is full\n");
+    return -3;
+  }
+  if (oufs_snapshot_share(&master, refs, n_refs) != 0)
+    return -3;
+
+  for (int b = 0; b <= N_INODE_BLOCKS; ++b)
+    vdisk_write_block(copy_refs[b], &copies[b]);
+  vdisk_write_block(MASTER_BLOCK_REFERENCE, &master);
+
+  SNAPSHOT_ENTRY *e = &table.snapshots.entry[slot];
+  strncpy(e->name, name, FILE_NAME_SIZE - 1);
+  e->name[FILE_NAME_SIZE - 1] = 0;
+  e->master = copy_refs[0];
+  for (int b = 0; b < N_INODE_BLOCKS; ++b)
+    e->inode_blocks[b] = copy_refs[b + 1];
+  e->created = time(NULL);
+  return vdisk_write_block(master.master_ext.snapshot_table, &table);
+}
+
+/**
+ * Print the name and the creation time of every snapshot
+ *
+ * @return 0 on success; <0 on error
+ */
+int oufs_snapshot_list() {
+  VDISK_TRACE("oufs_snapshot_list");
+  BLOCK master;
+  BLOCK table;
+  if (oufs_snapshot_load(&master, &table) != 0)
+    return -1;
+  for (int i = 0; i < SNAPSHOTS_PER_BLOCK; ++i) {
+    SNAPSHOT_ENTRY *e = &table.snapshots.entry[i];
+    if (e->name[0] == 0)
+      continue;
+    time_t created = e->created;
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&created));
+    printf("%s %s\n", e->name, when);
+  }
+  return 0;
+}
+
+/**
+ * Return the file system to the state it had when a snapshot was taken
+ *
+ * The snapshot's inode blocks and inode table replace the live ones.  The
+ * blocks of the live inodes lose a reference, so those that only the live
+ * file system used are freed.  The snapshot is kept, and can be rolled back
+ * to again.
+ *
+ * @param name Name of the snapshot
+ * @return 0 on success; <0 on error
+ */
+int oufs_snapshot_rollback(char *name) {
+  VDISK_TRACE("oufs_snapshot_rollback");
+  BLOCK master;
+  BLOCK table;
+  if (oufs_snapshot_load(&master, &table) != 0)
+    return -1;
+  int slot = oufs_snapshot_find(&table, name);
+  if (slot == -1) {
+    fprintf(stderr, "Snapshot %s does not exist\n", name);
+    return -2;
+  }
+  SNAPSHOT_ENTRY *e = &table.snapshots.entry[slot];
+
+  BLOCK saved_master;
+  BLOCK saved[N_INODE_BLOCKS];
+  BLOCK live[N_INODE_BLOCKS];
+  BLOCK_REFERENCE inode_refs[N_INODE_BLOCKS];
+  for (int b = 0; b < N_INODE_BLOCKS; ++b)
+    inode_refs[b] = b + 1;
+  if (vdisk_read_block(e->master, &saved_master) != 0 ||
+      vdisk_read_blocks(e->inode_blocks, N_INODE_BLOCKS, saved) != 0 ||
+      vdisk_read_blocks(inode_refs, N_INODE_BLOCKS, live) != 0)
+    return -1;
+
+  // The snapshot's blocks gain a reference before the live ones lose theirs,
+  // so that blocks the two have in common are never freed
+  BLOCK_REFERENCE refs[N_INODES * BLOCKS_PER_INODE];
+  int n_refs = oufs_snapshot_collect(saved, refs);
+  if (oufs_snapshot_share(&master, refs, n_refs) != 0)
+    return -3;
+  n_refs = oufs_snapshot_collect(live, refs);
+  n_refs = oufs_free_blocks_in_master(&master, refs, n_refs);
+  memcpy(master.master.inode_allocated_flag,
+         saved_master.master.inode_allocated_flag,
+         sizeof(master.master.inode_allocated_flag));
+
+  for (int b = 0; b < N_INODE_BLOCKS; ++b)
+    vdisk_write_block(b + 1, &saved[b]);
+  vdisk_write_block(MASTER_BLOCK_REFERENCE, &master);
+  oufs_discard_blocks(refs, n_refs);
+  return 0;
+}
+
+/**
+ * Delete a snapshot
+ *
+ * The copies of the master and inode blocks are freed, and the blocks that
+ * only the snapshot still used go with them.
+ *
+ * @param name Name of the snapshot
+ * @return 0 on success; <0 on error
+ */
+int oufs_snapshot_delete(char *name) {
+  VDISK_TRACE("oufs_snapshot_delete");
+  BLOCK master;
+  BLOCK table;
+  if (oufs_snapshot_load(&master, &table) != 0)
+    return -1;
+  int slot = oufs_snapshot_find(&table, name);
+  if (slot == -1) {
+    fprintf(stderr, "Snapshot %s does not exist\n", name);
+    return -2;
+  }
+  SNAPSHOT_ENTRY *e = &table.snapshots.entry[slot];
+
+  BLOCK saved[N_INODE_BLOCKS];
+  if (vdisk_read_blocks(e->inode_blocks, N_INODE_BLOCKS, saved) != 0)
+    return -1;
+  BLOCK_REFERENCE refs[N_INODES * BLOCKS_PER_INODE + 1 + N_INODE_BLOCKS];
+  int n_refs = oufs_snapshot_collect(saved, refs);
+  refs[n_refs++] = e->master;
+  for (int b = 0; b < N_INODE_BLOCKS; ++b)
+    refs[n_refs++] = e->inode_blocks[b];
+  n_refs = oufs_free_blocks_in_master(&master, refs, n_refs);
+
+  memset(e, 0, sizeof(*e));
+  vdisk_write_block(master.master_ext.snapshot_table, &table);
+  vdisk_write_block(MASTER_BLOCK_REFERENCE, &master);
+  oufs_discard_blocks(refs, n_refs);
+  return 0;
+}
+
+// Defragmentation
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+/**
+ * Count the runs of consecutive blocks that make up an inode's contents
+ *
+ * Holes (UNALLOCATED_BLOCK) are skipped: two blocks on either side of a hole
+ * are in the same run if they are adjacent on the disk.
+ *
+ * @param inode The inode
+ * @return Number of discontiguous runs (0 if the inode has no blocks)
+ */
+int oufs_inode_runs(INODE *inode) {
+  if (inode->type != IT_FILE && inode->type != IT_DIRECTORY &&
+      inode->type != IT_COMPRESSED_FILE)
+    return 0;
+  int runs = 0;
+  BLOCK_REFERENCE last = UNALLOCATED_BLOCK;
+  for (int i = 0; i < BLOCKS_PER_INODE; ++i) {
+    BLOCK_REFERENCE b = inode->data[i];
+    if (b == UNALLOCATED_BLOCK)
+      continue;
+    if (last == UNALLOCATED_BLOCK || b != last + 1)
+      ++runs;
+    last = b;
+  }
+  return runs;
+}
+
+/**
+ * Pack the live entries of a directory into as few blocks as possible
+ *
+ * Entries keep their order, so "." and ".." stay first.
+ *
+ * @param blocks In: the directory's blocks, in data[] order.  Out: the packed
+ * blocks
+ * @param n_blocks Number of entries in blocks
+ * @return Number of packed blocks
+ */
+static int oufs_defrag_pack_directory(BLOCK *blocks, int n_blocks) {
+  int n_entries = 0;
+  for (int i = 0; i < n_blocks; ++i) {
+    for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j) {
+      DIRECTORY_ENTRY e = blocks[i].directory.entry[j];
+      if (e.inode_reference == UNALLOCATED_INODE)
+        continue;
+      // Entries only move towards the front, so the source is never
+      // overwritten before it is read
+      blocks[n_entries / DIRECTORY_ENTRIES_PER_BLOCK]
+          .directory.entry[n_entries % DIRECTORY_ENTRIES_PER_BLOCK] = e;
+      ++n_entries;
+    }
+  }
+  int n_packed = MAX(1, (n_entries + DIRECTORY_ENTRIES_PER_BLOCK - 1) /
+                            DIRECTORY_ENTRIES_PER_BLOCK);
+  for (int k = n_entries; k < n_packed * DIRECTORY_ENTRIES_PER_BLOCK; ++k)
+    oufs_clean_directory_entry(
+        &blocks[k / DIRECTORY_ENTRIES_PER_BLOCK]
+             .directory.entry[k % DIRECTORY_ENTRIES_PER_BLOCK]);
+  return n_packed;
+}
+
+/**
+ * Move the contents of one inode into a contiguous run of free blocks
+ *
+ * The new copy is written in full before the inode is switched over to it,
+ * and the old blocks are only released afterwards: the master block marks the
+ * new blocks allocated before anything is written to them, so a crash at any
+ * point leaves either the old or the new copy in place (at worst with a few
+ * leaked blocks, which zfsck reclaims).  Directories are also compacted:
+ * entries left sparse by removals are packed into as few blocks as possible.
+ *
+ * Inodes with blocks shared with a clone, a snapshot or the dedup index
+ * (block_extra_refs) are left alone: moving them would unshare the blocks and
+ * take more space.
+ *
+ * @param i The inode
+ * @param stats Updated with what was done
+ * @return 1 if the inode moved; 0 if it was left as it is; <0 on error
+ */
+static int oufs_defrag_inode(INODE_REFERENCE i, OUFS_DEFRAG_STATS *stats) {
+  OUFS_BATCH batch;
+  if (oufs_batch_begin(&batch) != 0)
+    return -1;
+  INODE inode;
+  if (oufs_batch_read_inode(&batch, i, &inode) != 0)
+    return -1;
+  int runs = oufs_inode_runs(&inode);
+  if (runs == 0)
+    return 0;
+
+  // The allocated blocks, in file order
+  int index[BLOCKS_PER_INODE];
+  BLOCK_REFERENCE old_refs[BLOCKS_PER_INODE];
+  int n_old = 0;
+  for (int j = 0; j < BLOCKS_PER_INODE; ++j) {
+    if (inode.data[j] == UNALLOCATED_BLOCK)
+      continue;
+    if (oufs_block_is_shared(&batch.master, inode.data[j])) {
+      ++stats->n_shared;
+      return 0;
+    }
+    index[n_old] = j;
+    old_refs[n_old++] = inode.data[j];
+  }
+
+  BLOCK contents[BLOCKS_PER_INODE];
+  if (vdisk_read_blocks(old_refs, n_old, contents) != 0)
+    return -1;
+  int n_new = n_old;
+  int sparse = 0;
+  if (inode.type == IT_DIRECTORY) {
+    n_new = oufs_defrag_pack_directory(contents, n_old);
+    sparse = n_new < n_old || index[n_old - 1] != n_old - 1;
+  }
+  if (runs == 1 && !sparse)
+    return 0;
+
+  // Take the new blocks; give up unless that is an improvement
+  BLOCK_REFERENCE new_refs[BLOCKS_PER_INODE];
+  if (oufs_allocate_blocks_in_master(&batch.master, n_new, UNALLOCATED_BLOCK,
+                                     new_refs) != n_new)
+    return 0;
+  INODE moved = inode;
+  for (int j = 0; j < BLOCKS_PER_INODE; ++j)
+    moved.data[j] = UNALLOCATED_BLOCK;
+  for (int k = 0; k < n_new; ++k)
+    moved.data[inode.type == IT_DIRECTORY ? k : index[k]] = new_refs[k];
+  if (oufs_inode_runs(&moved) >= runs && !sparse)
+    return 0;
+
+  // Flags that describe the contents travel with them
+  int has_ext = oufs_master_has_ext(&batch.master);
+  for (int k = 0; has_ext && inode.type != IT_DIRECTORY && k < n_new; ++k) {
+    BLOCK_REFERENCE from = old_refs[k];
+    BLOCK_REFERENCE to = new_refs[k];
+    if (oufs_block_is_unwritten(&batch.master, from))
+      batch.master.master_ext.block_unwritten_flag[to >> 3] |= (1 << (to & 7));
+    if (batch.master.master_ext.block_dedup_flag[from >> 3] & (1 << (from & 7)))
+      batch.master.master_ext.block_dedup_flag[to >> 3] |= (1 << (to & 7));
+  }
+  if (vdisk_write_block(MASTER_BLOCK_REFERENCE, &batch.master) != 0)
+    return -1;
+  for (int k = 0; k < n_new; ++k) {
+    if (vdisk_write_block(new_refs[k], &contents[k]) != 0)
+      return -1;
+  }
+
+  oufs_batch_write_inode(&batch, i, &moved);
+  batch.n_freed = oufs_free_blocks_in_master(&batch.master, old_refs, n_old);
+  memcpy(batch.freed, old_refs, batch.n_freed * sizeof(BLOCK_REFERENCE));
+  batch.master_dirty = 1;
+  if (oufs_batch_commit(&batch) != 0)
+    return -1;
+
+  if (inode.type == IT_DIRECTORY && sparse)
+    ++stats->n_compacted;
+  else
+    ++stats->n_moved;
+  stats->n_blocks_moved += n_new;
+  stats->n_blocks_released += n_old - n_new;
+  stats->runs_after += oufs_inode_runs(&moved) - runs;
+  return 1;
+}
+
+/**
+ * Defragment the whole disk
+ *
+ * Every file and directory made of more than one run of blocks is moved, in
+ * inode order, into the first free run that can hold it whole; sparse
+ * directories are compacted on the way.  The blocks that an inode leaves
+ * behind become free for the inodes after it.
+ *
+ * @param check_only Only count the fragmented inodes; change nothing
+ * @param stats Out: what was found and done
+ * @return 0 on success; <0 on error
+ */
+int oufs_defrag(int check_only, OUFS_DEFRAG_STATS *stats) {
+  VDISK_TRACE("oufs_defrag");
+  memset(stats, 0, sizeof(*stats));
+  BLOCK master;
+  BLOCK inode_blocks[N_INODE_BLOCKS];
+  BLOCK_REFERENCE inode_refs[N_INODE_BLOCKS];
+  for (int b = 0; b < N_INODE_BLOCKS; ++b)
+    inode_refs[b] = b + 1;
+  if (vdisk_read_block(MASTER_BLOCK_REFERENCE, &master) != 0 ||
+      vdisk_read_blocks(inode_refs, N_INODE_BLOCKS, inode_blocks) != 0)
+    return -1;
+
+  for (int i = 0; i < N_INODES; ++i) {
+    if (!(master.master.inode_allocated_flag[i >> 3] & (1 << (i & 7))))
+      continue;
+    INODE *inode =
+        &inode_blocks[i / INODES_PER_BLOCK].inodes.inode[i % INODES_PER_BLOCK];
+    int runs = oufs_inode_runs(inode);
+    stats->runs_before += runs;
+    if (runs > 1)
+      ++stats->n_fragmented;
+    if (!check_only && oufs_defrag_inode(i, stats) < 0)
+      return -1;
+  }
+  stats->runs_after += stats->runs_before;
+  return 0;
+}
+
+// Resizing
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+/**
+ * Point the block references of a set of inode blocks to where the blocks
+ * moved
+ *
+ * @param inode_blocks The N_INODE_BLOCKS inode blocks
+ * @param remap For each block, where it is now
+ * @param dirty Out: for each inode block, 1 if it changed
+ */
+static void oufs_resize_remap_inodes(BLOCK *inode_blocks,
+                                     BLOCK_REFERENCE *remap,
+                                     unsigned char *dirty) {
+  for (int b = 0; b < N_INODE_BLOCKS; ++b) {
+    dirty[b] = 0;
+    for (int i = 0; i < INODES_PER_BLOCK; ++i) {
+      INODE *inode = &inode_blocks[b].inodes.inode[i];
+      if (inode->type != IT_FILE && inode->type != IT_DIRECTORY &&
+          inode->type != IT_COMPRESSED_FILE)
+        continue; // Free, or contents kept in the inode
+      for (int j = 0; j < BLOCKS_PER_INODE; ++j) {
+        BLOCK_REFERENCE ref = inode->data[j];
+        if (ref < N_BLOCKS_IN_DISK && remap[ref] != ref) {
+          inode->data[j] = remap[ref];
+          dirty[b] = 1;
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Shrink the disk: move the blocks in use beyond the new end into free blocks
+ * before it
+ *
+ * Every reference to a moved block is updated: live inodes, the inodes kept
+ * by snapshots, and the snapshots' own copies of the master and inode
+ * blocks.  Blocks shared by several owners move once, keeping their
+ * reference counts.  The old blocks are only released once nothing refers to
+ * them, so a crash at any point leaves at worst leaked blocks.
+ *
+ * @param master The master block
+ * @param n_blocks New number of blocks
+ * @return 0 on success; <0 on error.  -3 (not enough free space) and a
+ * failure to read the blocks to move leave the disk as it was.  A later
+ * failure leaves the copies and the free blocks past the new end marked
+ * allocated: some references may already point at the copies, the rest
+ * still at the old blocks, and whichever blocks end up unused stay leaked
+ * until zfsck frees them.  The disk keeps its old size.
+ */
+static int oufs_resize_shrink(BLOCK *master, int n_blocks) {
+  MASTER_EXT *ext = &master->master_ext;
+  unsigned char *flags = master->master.block_allocated_flag;
+  int old_blocks = oufs_disk_blocks(master);
+
+  // The blocks to move; the free ones in the tail are taken out of use
+  BLOCK_REFERENCE from[N_BLOCKS_IN_DISK];
+  BLOCK_REFERENCE to[N_BLOCKS_IN_DISK];
+  int n_moving = 0;
+  for (int b = n_blocks; b < old_blocks; ++b) {
+    if (flags[b >> 3] & (1 << (b & 7)))
+      from[n_moving++] = b;
+    else
+      flags[b >> 3] |= (1 << (b & 7));
+  }
+  if (oufs_allocate_blocks_in_master(master, n_moving, UNALLOCATED_BLOCK, to) !=
+      n_moving) {
+    fprintf(stderr, "Not enough free space to shrink the disk to %d blocks\n",
+            n_blocks);
+    return -3;
+  }
+  BLOCK contents[N_BLOCKS_IN_DISK];
+  if (vdisk_read_blocks(from, n_moving, contents) != 0)
+    return -4;
+
+  // The copies take over the flags and the reference counts of the blocks
+  BLOCK_REFERENCE remap[N_BLOCKS_IN_DISK];
+  for (int b = 0; b < N_BLOCKS_IN_DISK; ++b)
+    remap[b] = b;
+  for (int k = 0; k < n_moving; ++k) {
+    BLOCK_REFERENCE f = from[k];
+    BLOCK_REFERENCE t = to[k];
+    remap[f] = t;
+    ext->block_extra_refs[t] = ext->block_extra_refs[f];
+    if (ext->block_unwritten_flag[f >> 3] & (1 << (f & 7)))
+      ext->block_unwritten_flag[t >> 3] |= (1 << (t & 7));
+    if (ext->block_dedup_flag[f >> 3] & (1 << (f & 7)))
+      ext->block_dedup_flag[t >> 3] |= (1 << (t & 7));
+  }
+  if (vdisk_write_block(MASTER_BLOCK_REFERENCE, master) != 0)
+    return -4;
+  for (int k = 0; k < n_moving; ++k) {
+    if (vdisk_write_block(to[k], &contents[k]) != 0)
+      return -4;
+  }
+
+  // Live inodes
+  BLOCK inode_blocks[N_INODE_BLOCKS];
+  BLOCK_REFERENCE inode_refs[N_INODE_BLOCKS];
+  unsigned char dirty[N_INODE_BLOCKS];
+  for (int b = 0; b < N_INODE_BLOCKS; ++b)
+    inode_refs[b] = b + 1;
+  if (vdisk_read_blocks(inode_refs, N_INODE_BLOCKS, inode_blocks) != 0)
+    return -4;
+  oufs_resize_remap_inodes(inode_blocks, remap, dirty);
+  for (int b = 0; b < N_INODE_BLOCKS; ++b) {
+    if (dirty[b] && vdisk_write_block(inode_refs[b], &inode_blocks[b]) != 0)
+      return -4;
+  }
+
+  // Snapshots (their copies of the inode blocks were moved above if needed)
+  if (ext->snapshot_table != 0) {
+    BLOCK table;
+    if (vdisk_read_block(ext->snapshot_table, &table) != 0)
+      return -4;
+    for (int s = 0; s < SNAPSHOTS_PER_BLOCK; ++s) {
+      SNAPSHOT_ENTRY *e = &table.snapshots.entry[s];
+      if (e->name[0] == 0)
+        continue;
+      e->master = remap[e->master];
+      for (int b = 0; b < N_INODE_BLOCKS; ++b)
+        e->inode_blocks[b] = remap[e->inode_blocks[b]];
+      if (vdisk_read_blocks(e->inode_blocks, N_INODE_BLOCKS, inode_blocks) != 0)
+        return -4;
+      oufs_resize_remap_inodes(inode_blocks, remap, dirty);
+      for (int b = 0; b < N_INODE_BLOCKS; ++b) {
+        if (dirty[b] && vdisk_write_block(e->inode_blocks[b], &inode_blocks[b]) != 0)
+          return -4;
+      }
+    }
+    if (vdisk_write_block(ext->snapshot_table, &table) != 0)
+      return -4;
+  }
+
+  // Nothing refers to the tail any more: it stays marked allocated
+  for (int k = 0; k < n_moving; ++k) {
+    BLOCK_REFERENCE f = from[k];
+    ext->block_extra_refs[f] = 0;
+    ext->block_unwritten_flag[f >> 3] &= ~(1 << (f & 7));
+    ext->block_dedup_flag[f >> 3] &= ~(1 << (f & 7));
+  }
+  ext->n_blocks = n_blocks;
+  if (vdisk_write_block(MASTER_BLOCK_REFERENCE, master) != 0)
+    return -4;
+  return vdisk_resize(n_blocks);
+}
+
+/**
+ * Change the number of blocks on the disk
+ *
+ * Growing extends the disk file and makes the new blocks free.  Shrinking
+ * first moves whatever is stored beyond the new end (see
+ * oufs_resize_shrink()).  The size can go from OUFS_MIN_BLOCKS up to
+ * N_BLOCKS_IN_DISK, the most that the block table can describe, which is
+ * also the size zformat gives by default: only a disk formatted (or shrunk)
+ * smaller can grow.
+ *
+ * @param n_blocks New number of blocks
+ * @return 0 on success; <0 on error
+ */
+int oufs_resize(int n_blocks) {
+  VDISK_TRACE("oufs_resize");
+  BLOCK master;
+  if (vdisk_read_block(MASTER_BLOCK_REFERENCE, &master) != 0)
+    return -1;
+  if (!oufs_master_has_ext(&master)) {
+    fprintf(stderr, "Disk does not support resizing; reformat it\n");
+    return -1;
+  }
+  if (n_blocks < OUFS_MIN_BLOCKS || n_blocks > N_BLOCKS_IN_DISK) {
+    fprintf(stderr, "Size must be between %d and %d blocks\n", OUFS_MIN_BLOCKS,
+            N_BLOCKS_IN_DISK);
+    return -2;
+  }
+  int old_blocks = oufs_disk_blocks(&master);
+  if (n_blocks < old_blocks)
+    return oufs_resize_shrink(&master, n_blocks);
+
+  // Grow: the disk file first, then the new blocks become free
+  if (n_blocks > old_blocks && vdisk_resize(n_blocks) != 0)
+    return -4;
+  for (int b = old_blocks; b < n_blocks; ++b)
+    master.master.block_allocated_flag[b >> 3] &= ~(1 << (b & 7));
+  master.master_ext.n_blocks = n_blocks;
+  return vdisk_write_block(MASTER_BLOCK_REFERENCE, &master);
+}
+
+// Handles
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+struct oufs_s {
+  VDISK *disk;
+  char cwd[MAX_PATH_LENGTH];
+  int flags;
+};
+
+/**
+ * Mount a disk
+ *
+ * @param disk_name File holding the disk
+ * @param flags OUFS_MOUNT_* flags
+ * @return The handle; NULL if the disk cannot be opened or holds no file
+ * system
+ */
+OUFS *oufs_mount(char *disk_name, int flags) {
+  VDISK_TRACE("oufs_mount");
+  OUFS *fs = calloc(1, sizeof(OUFS));
+  if (fs == NULL || (fs->disk = vdisk_new()) == NULL) {
+    free(fs);
+    return NULL;
+  }
+  strcpy(fs->cwd, "/");
+  fs->flags = flags;
+  vdisk_stats_set_classifier(oufs_classify_blocks);
+
+  VDISK *previous = vdisk_select(fs->disk);
+  INODE root;
+  int ret = vdisk_disk_open(disk_name);
+  if (ret == 0 && (flags & OUFS_MOUNT_CACHE))
+    ret = vdisk_set_cache(1);
+  if (ret == 0 && (oufs_read_inode_by_reference(0, &root) != 0 ||
+                   root.type != IT_DIRECTORY)) {
+    fprintf(stderr, "oufs_mount(): no file system on %s\n", disk_name);
+    ret = -1;
+  }
+  vdisk_select(previous);
+  if (ret != 0) {
+    vdisk_free(fs->disk);
+    free(fs);
+    return NULL;
+  }
+  return fs;
+}
+
+/**
+ * Unmount a disk (its files must be closed first)
+ *
+ * @return 0 on success
+ */
+int oufs_unmount(OUFS *fs) {
+  VDISK_TRACE("oufs_unmount");
+  vdisk_free(fs->disk);
+  free(fs);
+  return 0;
+}
+
+/**
+ * Set the directory that relative paths start from
+ *
+ * @return 0 on success; -1 if path is not a directory
+ */
+int oufs_fs_chdir(OUFS *fs, char *path) {
+  INODE_REFERENCE dir = oufs_fs_resolve(fs, path);
+  INODE inode;
+  if (dir == UNALLOCATED_INODE || oufs_fs_stat(fs, dir, &inode) != 0 ||
+      inode.type != IT_DIRECTORY)
+    return -1;
+  if (path[0] == '/') {
+    strncpy(fs->cwd, path, MAX_PATH_LENGTH - 1);
+  } else {
+    char cwd[MAX_PATH_LENGTH];
+    snprintf(cwd, sizeof(cwd), "%s%s%s", fs->cwd,
+             fs->cwd[strlen(fs->cwd) - 1] == '/' ? "" : "/", path);
+    strcpy(fs->cwd, cwd);
+  }
+  return 0;
+}
+
+/**
+ * Inode of a path (relative to the handle's working directory)
+ *
+ * @return The inode; UNALLOCATED_INODE if there is none
+ */
+INODE_REFERENCE oufs_fs_resolve(OUFS *fs, char *path) {
+  VDISK *previous = vdisk_select(fs->disk);
+  INODE_REFERENCE parent;
+  INODE_REFERENCE child;
+  if (oufs_find_file(fs->cwd, path, &parent, &child, NULL) != 0)
+    child = UNALLOCATED_INODE;
+  vdisk_select(previous);
+  return child;
+}
+
+/**
+ * Inode of a name in a directory, without any path to resolve
+ *
+ * @param dir The directory's inode
+ * @param name One name (no /)
+ * @return The inode; UNALLOCATED_INODE if there is none
+ */
+INODE_REFERENCE oufs_fs_lookup(OUFS *fs, INODE_REFERENCE dir, char *name) {
+  VDISK_TRACE_ARG("oufs_fs_lookup", "directory", dir);
+  VDISK *previous = vdisk_select(fs->disk);
+  INODE inode;
+  INODE_REFERENCE child = UNALLOCATED_INODE;
+  if (name[0] != 0 && dir < N_INODES &&
+      oufs_read_inode_by_reference(dir, &inode) == 0 &&
+      inode.type == IT_DIRECTORY)
+    child = oufs_find_directory_element(&inode, name);
+  vdisk_select(previous);
+  return child;
+}
+
+/**
+ * Read an inode
+ *
+ * @return 0 on success; -1 on error
+ */
+int oufs_fs_stat(OUFS *fs, INODE_REFERENCE i, INODE *inode) {
+  if (i >= N_INODES)
+    return -1;
+  VDISK *previous = vdisk_select(fs->disk);
+  int ret = oufs_read_inode_by_reference(i, inode);
+  vdisk_select(previous);
+  return ret;
+}
+
+/**
+ * Open (or create) a file by path, as oufs_fopen()
+ */
+OUFILE *oufs_fs_open(OUFS *fs, char *path, char mode) {
+  VDISK *previous = vdisk_select(fs->disk);
+  OUFILE *fp = oufs_fopen(fs->cwd, path, mode);
+  vdisk_select(previous);
+  return fp;
+}
+
+/**
+ * Open an existing file by inode, without any path to resolve
+ *
+ * @param mode As for oufs_fopen(): 'r' and 'w' start at the beginning (and
+ * 'w' discards the contents), 'a' at the end
+ * @return The open file; NULL if the inode is not a file
+ */
+OUFILE *oufs_fs_open_inode(OUFS *fs, INODE_REFERENCE i, char mode) {
+  VDISK_TRACE_ARG("oufs_fs_open_inode", "inode", i);
+  INODE inode;
+  if (oufs_fs_stat(fs, i, &inode) != 0 || !oufs_is_file(&inode))
+    return NULL;
+  return oufs_new_oufile(i, mode, (mode == 'w' || mode == 'r') ? 0 : inode.size);
+}
+
+/**
+ * Read from an open file, as oufs_pread()
+ */
+int oufs_fs_pread(OUFS *fs, OUFILE *fp, unsigned char *buf, int len, int offset) {
+  VDISK *previous = vdisk_select(fs->disk);
+  int ret = oufs_pread(fp, buf, len, offset);
+  vdisk_select(previous);
+  return ret;
+}
+
+/**
+ * Write to an open file, as oufs_pwrite()
+ */
+int oufs_fs_pwrite(OUFS *fs, OUFILE *fp, unsigned char *buf, int len, int offset) {
+  VDISK *previous = vdisk_select(fs->disk);
+  int ret = oufs_pwrite(fp, buf, len, offset);
+  vdisk_select(previous);
+  return ret;
+}
+
+/**
+ * Close an open file, writing out what is still buffered
+ */
+void oufs_fs_close(OUFS *fs, OUFILE *fp) {
+  VDISK *previous = vdisk_select(fs->disk);
+  oufs_fclose(fp);
+  vdisk_select(previous);
+}
+
+/**
+ * Make a directory, as oufs_mkdir()
+ */
+int oufs_fs_mkdir(OUFS *fs, char *path) {
+  VDISK *previous = vdisk_select(fs->disk);
+  int ret = oufs_mkdir(fs->cwd, path);
+  vdisk_select(previous);
+  return ret;
+}
+
+/**
+ * Remove a name of a file, as oufs_remove()
+ */
+int oufs_fs_remove(OUFS *fs, char *path) {
+  VDISK *previous = vdisk_select(fs->disk);
+  int ret = oufs_remove(fs->cwd, path);
+  vdisk_select(previous);
+  return ret;
+}
+
+/**
+ * Give a file another name, as oufs_link()
+ */
+int oufs_fs_link(OUFS *fs, char *path_src, char *path_dst) {
+  VDISK *previous = vdisk_select(fs->disk);
+  int ret = oufs_link(fs->cwd, path_src, path_dst);
+  vdisk_select(previous);
+  return ret;
+}
+
+// Directory streams
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+// Order of directory entries: by name, with the free entries last
+static int oufs_dir_compare(const void *p, const void *q) {
+  const DIRECTORY_ENTRY *a = p;
+  const DIRECTORY_ENTRY *b = q;
+  int a_free = a->inode_reference == UNALLOCATED_INODE;
+  int b_free = b->inode_reference == UNALLOCATED_INODE;
+  if (a_free || b_free)
+    return a_free - b_free;
+  return strncmp(a->name, b->name, FILE_NAME_SIZE);
+}
+
+/**
+ * Open a directory to read its entries
+ *
+ * A sorted stream reads all of the directory blocks here, in one request,
+ * and sorts each one; oufs_readdir() then merges them.  An unsorted stream
+ * reads the blocks one at a time as it gets to them.
+ *
+ * @param cwd Current working directory
+ * @param path The directory
+ * @param flags OUFS_DIR_* flags
+ * @return The stream; NULL if path is not a directory
+ */
+OUFS_DIR *oufs_opendir(char *cwd, char *path, int flags) {
+  VDISK_TRACE("oufs_opendir");
+  INODE_REFERENCE parent;
+  INODE_REFERENCE child;
+  if (oufs_find_file(cwd, path, &parent, &child, NULL) != 0 ||
+      child == UNALLOCATED_INODE)
+    return NULL;
+
+  OUFS_DIR *dir = malloc(sizeof(OUFS_DIR));
+  if (dir == NULL)
+    return NULL;
+  if (oufs_read_inode_by_reference(child, &dir->dir) != 0 ||
+      dir->dir.type != IT_DIRECTORY) {
+    free(dir);
+    return NULL;
+  }
+  dir->flags = flags;
+  dir->n_blocks = 0;
+  for (int b = 0; b < BLOCKS_PER_INODE; ++b) {
+    if (dir->dir.data[b] != UNALLOCATED_BLOCK)
+      dir->refs[dir->n_blocks++] = dir->dir.data[b];
+  }
+  dir->block = -1;
+  memset(dir->next, 0, sizeof(dir->next));
+  dir->inode_blocks_loaded = 0;
+
+  if (flags & OUFS_DIR_SORTED) {
+    if (vdisk_read_blocks(dir->refs, dir->n_blocks, dir->blocks) != 0) {
+      free(dir);
+      return NULL;
+    }
+    for (int b = 0; b < dir->n_blocks; ++b)
+      qsort(dir->blocks[b].directory.entry, DIRECTORY_ENTRIES_PER_BLOCK,
+            sizeof(DIRECTORY_ENTRY), oufs_dir_compare);
+  }
+  return dir;
+}
+
+// Type of an inode, from its inode block (read the first time it is needed)
+static char oufs_dir_type(OUFS_DIR *dir, INODE_REFERENCE i) {
+  if (i >= N_INODES)
+    return IT_NONE;
+  int b = i / INODES_PER_BLOCK;
+  if (!(dir->inode_blocks_loaded & (1 << b))) {
+    if (vdisk_read_block(b + 1, &dir->inode_blocks[b]) != 0)
+      return IT_NONE;
+    dir->inode_blocks_loaded |= 1 << b;
+  }
+  return dir->inode_blocks[b].inodes.inode[i % INODES_PER_BLOCK].type;
+}
+
+// Next entry in use of a directory stream, as it is on the disk; NULL when
+// there are no more
+static DIRECTORY_ENTRY *oufs_readdir_entry(OUFS_DIR *dir) {
+  DIRECTORY_ENTRY *entry = NULL;
+  if (dir->flags & OUFS_DIR_SORTED) {
+    // k-way merge: the smallest of the next entries of the sorted blocks
+    int best = -1;
+    for (int b = 0; b < dir->n_blocks; ++b) {
+      if (dir->next[b] == DIRECTORY_ENTRIES_PER_BLOCK)
+        continue;
+      DIRECTORY_ENTRY *e = &dir->blocks[b].directory.entry[dir->next[b]];
+      if (e->inode_reference == UNALLOCATED_INODE) {
+        // Only free entries are left in this block
+        dir->next[b] = DIRECTORY_ENTRIES_PER_BLOCK;
+        continue;
+      }
+      if (best == -1 || oufs_dir_compare(e, entry) < 0) {
+        best = b;
+        entry = e;
+      }
+    }
+    if (best == -1)
+      return NULL;
+    ++dir->next[best];
+  } else {
+    // The next entry in use, moving on to the next block when one runs out
+    while (entry == NULL) {
+      if (dir->block == -1 || dir->next[0] == DIRECTORY_ENTRIES_PER_BLOCK) {
+        if (dir->block + 1 >= dir->n_blocks)
+          return NULL;
+        ++dir->block;
+        if (vdisk_read_block(dir->refs[dir->block], &dir->blocks[0]) != 0)
+          return NULL;
+        dir->next[0] = 0;
+      }
+      DIRECTORY_ENTRY *e = &dir->blocks[0].directory.entry[dir->next[0]++];
+      if (e->inode_reference != UNALLOCATED_INODE)
+        entry = e;
+    }
+  }
+  return entry;
+}
+
+/**
+ * Next entry of a directory stream ("." and ".." included)
+ *
+ * @param dir The stream
+ * @return The entry, valid until the next call; NULL when there are no more
+ */
+OUFS_DIRENT *oufs_readdir(OUFS_DIR *dir) {
+  DIRECTORY_ENTRY *entry = oufs_readdir_entry(dir);
+  if (entry == NULL)
+    return NULL;
+  memcpy(dir->current.name, entry->name, FILE_NAME_SIZE);
+  dir->current.name[FILE_NAME_SIZE - 1] = 0;
+  dir->current.inode = entry->inode_reference;
+  dir->current.type = oufs_dir_type(dir, entry->inode_reference);
+  return &dir->current;
+}
+
+/**
+ * Close a directory stream
+ */
+void oufs_closedir(OUFS_DIR *dir) {
+  free(dir);
+}
+
+/**
+ * All of the entries of a directory, each with its inode
+ *
+ * The entries are gathered first; then every inode block that holds one of
+ * their inodes is read, once, in a single request in block order.  A
+ * directory of n entries costs about n / INODES_PER_BLOCK inode block reads
+ * instead of n.
+ *
+ * @param cwd Current working directory
+ * @param path The directory
+ * @param flags OUFS_DIR_* flags (OUFS_DIR_SORTED: by name)
+ * @param entries Out: room for OUFS_MAX_DIR_ENTRIES entries
+ * @return Number of entries; -1 if path is not a directory, -2 if the inode
+ * blocks cannot be read
+ */
+int oufs_readdirplus(char *cwd, char *path, int flags, OUFS_DIRENTPLUS *entries) {
+  VDISK_TRACE("oufs_readdirplus");
+  OUFS_DIR *dir = oufs_opendir(cwd, path, flags);
+  if (dir == NULL)
+    return -1;
+
+  int n = 0;
+  unsigned char wanted = 0;
+  DIRECTORY_ENTRY *entry;
+  while (n < OUFS_MAX_DIR_ENTRIES && (entry = oufs_readdir_entry(dir)) != NULL) {
+    memcpy(entries[n].entry.name, entry->name, FILE_NAME_SIZE);
+    entries[n].entry.name[FILE_NAME_SIZE - 1] = 0;
+    entries[n].entry.inode = entry->inode_reference;
+    if (entry->inode_reference < N_INODES)
+      wanted |= 1 << (entry->inode_reference / INODES_PER_BLOCK);
+    ++n;
+  }
+  oufs_closedir(dir);
+
+  // The inode blocks, in order, each once
+  BLOCK_REFERENCE refs[N_INODE_BLOCKS];
+  int slot[N_INODE_BLOCKS];
+  int n_refs = 0;
+  for (int b = 0; b < N_INODE_BLOCKS; ++b) {
+    if (wanted & (1 << b)) {
+      slot[b] = n_refs;
+      refs[n_refs++] = b + 1;
+    }
+  }
+  BLOCK blocks[N_INODE_BLOCKS];
+  if (vdisk_read_blocks(refs, n_refs, blocks) != 0)
+    return -2;
+
+  for (int i = 0; i < n; ++i) {
+    INODE_REFERENCE ref = entries[i].entry.inode;
+    if (ref < N_INODES) {
+      entries[i].inode = blocks[slot[ref / INODES_PER_BLOCK]].inodes.inode[ref % INODES_PER_BLOCK];
+    } else {
+      memset(&entries[i].inode, 0, sizeof(INODE));
+      entries[i].inode.type = IT_NONE;
+    }
+    entries[i].entry.type = entries[i].inode.type;
+  }
+  return n;
+}
+
+// Inode table scan
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+/**
+ * Call a function for every allocated inode, in inode order
+ *
+ * The inode blocks are read in one sequential pass, skipping those whose
+ * inodes are all free in inode_allocated_flag.  Each inode is visited once,
+ * however many names it has (n_references), so this finds every file and
+ * directory without walking the tree.
+ *
+ * @param visit Called with each allocated inode and arg; a nonzero return
+ * stops the scan
+ * @param arg Passed on to visit
+ * @return 0 once every inode has been visited; what visit returned if it
+ * stopped the scan; -1 if the master or inode blocks cannot be read
+ */
+int oufs_scan_inodes(int (*visit)(INODE_REFERENCE i, INODE *inode, void *arg), void *arg) {
+  VDISK_TRACE("oufs_scan_inodes");
+  BLOCK master;
+  if (vdisk_read_block(MASTER_BLOCK_REFERENCE, &master) != 0)
+    return -1;
+
+  // The inode blocks with at least one allocated inode
+  unsigned char *flags = master.master.inode_allocated_flag;
+  BLOCK_REFERENCE refs[N_INODE_BLOCKS];
+  int n_refs = 0;
+  for (int b = 0; b < N_INODE_BLOCKS; ++b) {
+    for (int i = b * INODES_PER_BLOCK; i < (b + 1) * INODES_PER_BLOCK; ++i) {
+      if (flags[i >> 3] & (1 << (i & 7))) {
+        refs[n_refs++] = b + 1;
+        break;
+      }
+    }
+  }
+  BLOCK blocks[N_INODE_BLOCKS];
+  if (vdisk_read_blocks(refs, n_refs, blocks) != 0)
+    return -1;
+
+  for (int r = 0; r < n_refs; ++r) {
+    int first = (refs[r] - 1) * INODES_PER_BLOCK;
+    for (int i = first; i < first + (int) INODES_PER_BLOCK; ++i) {
+      if (!(flags[i >> 3] & (1 << (i & 7))))
+        continue;
+      int ret = visit(i, &blocks[r].inodes.inode[i - first], arg);
+      if (ret != 0)
+        return ret;
+    }
+  }
+  return 0;
+}
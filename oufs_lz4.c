@@ -0,0 +1,181 @@
+#include "oufs_lz4.h"
+#include <stdint.h>
+#include <string.h>
+
+// Format constants (see the LZ4 block format description)
+#define LZ4_MIN_MATCH 4
+// The last 5 bytes are always literals
+#define LZ4_LAST_LITERALS 5
+// The last match must start at least 12 bytes before the end
+#define LZ4_MFLIMIT 12
+#define LZ4_MAX_OFFSET 65535
+
+// Hash table of recently seen 4-byte sequences
+#define LZ4_HASH_LOG 12
+
+static uint32_t lz4_read32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static int lz4_hash(uint32_t v) {
+  return (int) ((v * 2654435761u) >> (32 - LZ4_HASH_LOG));
+}
+
+/**
+ * Append one sequence: literals, then (unless match_len is 0) a match
+ *
+ * @return New output position; -1 if dst is too small
+ */
+static int lz4_emit(unsigned char *dst, int op, int dst_capacity,
+                    const unsigned char *literals, int lit_len,
+                    int offset, int match_len) {
+  int extra = match_len > 0 ? match_len - LZ4_MIN_MATCH : 0;
+  int needed = 1 + lit_len / 255 + 1 + lit_len;
+  if (match_len > 0)
+    needed += 2 + extra / 255 + 1;
+  if (op + needed > dst_capacity)
+    return -1;
+
+  unsigned char *token = &dst[op++];
+  *token = (unsigned char) ((lit_len < 15 ? lit_len : 15) << 4);
+  if (lit_len >= 15) {
+    int n = lit_len - 15;
+    for (; n >= 255; n -= 255)
+      dst[op++] = 255;
+    dst[op++] = (unsigned char) n;
+  }
+  memcpy(dst + op, literals, lit_len);
+  op += lit_len;
+
+  if (match_len > 0) {
+    dst[op++] = (unsigned char) (offset & 0xFF);
+    dst[op++] = (unsigned char) (offset >> 8);
+    *token |= (unsigned char) (extra < 15 ? extra : 15);
+    if (extra >= 15) {
+      int n = extra - 15;
+      for (; n >= 255; n -= 255)
+        dst[op++] = 255;
+      dst[op++] = (unsigned char) n;
+    }
+  }
+  return op;
+}
+
+/**
+ * Compress a buffer into an LZ4 block
+ *
+ * @param src Bytes to compress
+ * @param src_len Number of bytes in src
+ * @param dst Buffer for the compressed block
+ * @param dst_capacity Size of dst
+ * @return Size of the compressed block; 0 if it does not fit in dst
+ */
+int oufs_lz4_compress(const unsigned char *src, int src_len, unsigned char *dst,
+                      int dst_capacity) {
+  int table[1 << LZ4_HASH_LOG];
+  for (int i = 0; i < (1 << LZ4_HASH_LOG); ++i)
+    table[i] = -1;
+
+  int ip = 0;
+  int anchor = 0;
+  int op = 0;
+  int match_limit = src_len - LZ4_MFLIMIT;
+  while (ip < match_limit) {
+    uint32_t seq = lz4_read32(src + ip);
+    int h = lz4_hash(seq);
+    int ref = table[h];
+    table[h] = ip;
+    if (ref < 0 || ip - ref > LZ4_MAX_OFFSET || lz4_read32(src + ref) != seq) {
+      ++ip;
+      continue;
+    }
+
+    // Extend the match forwards, then backwards over pending literals
+    int len = LZ4_MIN_MATCH;
+    while (ip + len < src_len - LZ4_LAST_LITERALS && src[ref + len] == src[ip + len])
+      ++len;
+    while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+      --ip;
+      --ref;
+      ++len;
+    }
+
+    op = lz4_emit(dst, op, dst_capacity, src + anchor, ip - anchor, ip - ref, len);
+    if (op < 0)
+      return 0;
+    ip += len;
+    anchor = ip;
+  }
+
+  // Whatever is left goes out as literals
+  op = lz4_emit(dst, op, dst_capacity, src + anchor, src_len - anchor, 0, 0);
+  return op < 0 ? 0 : op;
+}
+
+/**
+ * Decompress an LZ4 block
+ *
+ * Every length and offset is checked, so a damaged block is reported rather
+ * than read or written out of bounds.
+ *
+ * @param src The compressed block
+ * @param src_len Size of the compressed block
+ * @param dst Buffer for the decompressed bytes
+ * @param dst_capacity Size of dst
+ * @return Number of decompressed bytes; -1 if the block is malformed or
+ * does not fit in dst
+ */
+int oufs_lz4_decompress(const unsigned char *src, int src_len, unsigned char *dst,
+                        int dst_capacity) {
+  int ip = 0;
+  int op = 0;
+  while (ip < src_len) {
+    int token = src[ip++];
+
+    // Literals
+    int lit_len = token >> 4;
+    if (lit_len == 15) {
+      int b;
+      do {
+        if (ip >= src_len)
+          return -1;
+        b = src[ip++];
+        lit_len += b;
+      } while (b == 255);
+    }
+    if (lit_len > src_len - ip || lit_len > dst_capacity - op)
+      return -1;
+    memcpy(dst + op, src + ip, lit_len);
+    ip += lit_len;
+    op += lit_len;
+    if (ip == src_len)
+      break; // The last sequence has no match
+
+    // Match
+    if (src_len - ip < 2)
+      return -1;
+    int offset = src[ip] | (src[ip + 1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > op)
+      return -1;
+    int match_len = token & 15;
+    if (match_len == 15) {
+      int b;
+      do {
+        if (ip >= src_len)
+          return -1;
+        b = src[ip++];
+        match_len += b;
+      } while (b == 255);
+    }
+    match_len += LZ4_MIN_MATCH;
+    if (match_len > dst_capacity - op)
+      return -1;
+    // Byte by byte: the match may overlap the bytes it produces
+    for (int i = 0; i < match_len; ++i, ++op)
+      dst[op] = dst[op - offset];
+  }
+  return op;
+}
@@ -0,0 +1,16 @@
+// Only evaluate these definitions once, even if included multiple times
+#ifndef OUFS_LZ4_H
+#define OUFS_LZ4_H
+
+/*
+ * Small LZ4 block-format codec, used for compressed files.
+ *
+ * The output is a raw LZ4 block (no frame header), so it can be checked with
+ * any LZ4 implementation.  Matches are found with a single hash table of
+ * 4-byte sequences, which is all that files of a few KiB need.
+ */
+
+int oufs_lz4_compress(const unsigned char *src, int src_len, unsigned char *dst, int dst_capacity);
+int oufs_lz4_decompress(const unsigned char *src, int src_len, unsigned char *dst, int dst_capacity);
+
+#endif
@@ -1,33 +1,755 @@
+// For fallocate() hole punching
+#define _GNU_SOURCE
 #include "vdisk.h"
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 /*
  * Virtual disk implementation.
  *
  * The disk is implemented on top of a file.  Access provided by this
  * library is on a block-by-block basis
+ *
+ * Every block has a CRC32C checksum.  The checksum table is kept in the same
+ * file, right after the last block: a header (VDISK_CRC_MAGIC and the number
+ * of blocks) followed by one checksum per block.  Checksums are updated on
+ * every write and verified on every read.
+ *
+ * A disk holds at most N_BLOCKS_IN_DISK blocks, but may be smaller: the
+ * number of blocks is found from the size of the file when it is opened, and
+ * changed with vdisk_resize().
  */
 
 // Debug flag
 #define debug 0
 
-// File descriptor for virtual disk.  Private to this file
-// Yes, global variables are generally a bad idea...
+// Everything about one open disk
+struct vdisk_s
+{
+  // File descriptor for virtual disk (0: not open)
+  int fd;
+
+  // Number of blocks on the disk
+  int n_blocks;
+
+  // Copy of the checksum table
+  uint32_t crc[N_BLOCKS_IN_DISK];
+
+  // I/O statistics, and the blocks that readahead has asked for and that
+  // have not been read since
+  VDISK_STATS stats;
+  unsigned char prefetched[N_BLOCKS_IN_DISK >> 3];
 
-int vdisk_fd = 0;
+  // Block cache (vdisk_set_cache()): NULL when off; otherwise a copy of
+  // every block whose bit is set in cached
+  unsigned char *cache;
+  unsigned char cached[N_BLOCKS_IN_DISK >> 3];
+};
+
+// The disk of vdisk_disk_open() when no other is selected, and the disk the
+// calling thread has selected
+static VDISK vdisk_default = { .n_blocks = N_BLOCKS_IN_DISK };
+static __thread VDISK *vdisk_selected = NULL;
+
+static VDISK *vdisk_current()
+{
+  return(vdisk_selected != NULL ? vdisk_selected : &vdisk_default);
+}
 
 /**
- * Open the virtual disk
+ * Make a new disk, not open yet (vdisk_select() it, then vdisk_disk_open())
  *
- * @param virtual_disk_name Name of the file containing the virtual disk
- * @return 0 on success; < 0 on error
+ * @return The disk; NULL if out of memory
+ */
+VDISK *vdisk_new()
+{
+  VDISK *disk = calloc(1, sizeof(VDISK));
+  if(disk != NULL)
+    disk->n_blocks = N_BLOCKS_IN_DISK;
+  return(disk);
+}
+
+/**
+ * Release a disk made by vdisk_new() (closed first, if it is open)
+ */
+void vdisk_free(VDISK *disk)
+{
+  if(disk == NULL)
+    return;
+  if(disk->fd != 0) {
+    VDISK *previous = vdisk_select(disk);
+    vdisk_disk_close();
+    vdisk_select(previous);
+  }
+  free(disk->cache);
+  free(disk);
+}
+
+/**
+ * Make a disk the current disk of the calling thread
  *
+ * @param disk The disk; NULL for the default disk
+ * @return The disk that was current before (NULL: the default disk), to
+ * select again when done
  */
-int vdisk_disk_open(char *virtual_disk_name)
+VDISK *vdisk_select(VDISK *disk)
+{
+  VDISK *previous = vdisk_selected;
+  vdisk_selected = disk;
+  return(previous);
+}
+
+// Block cache of a disk
+static int vdisk_cache_get(VDISK *disk, BLOCK_REFERENCE block_ref, void *block)
+{
+  if(disk->cache == NULL || !(disk->cached[block_ref >> 3] & (1 << (block_ref & 7))))
+    return(-1);
+  memcpy(block, disk->cache + (size_t) block_ref * BLOCK_SIZE, BLOCK_SIZE);
+  return(0);
+}
+
+static void vdisk_cache_put(VDISK *disk, BLOCK_REFERENCE block_ref, const void *block)
+{
+  if(disk->cache == NULL)
+    return;
+  memcpy(disk->cache + (size_t) block_ref * BLOCK_SIZE, block, BLOCK_SIZE);
+  disk->cached[block_ref >> 3] |= 1 << (block_ref & 7);
+}
+
+static void vdisk_cache_drop(VDISK *disk, int first, int n_blocks)
+{
+  for(int b = first; b < first + n_blocks; ++b)
+    disk->cached[b >> 3] &= ~(1 << (b & 7));
+}
+
+/**
+ * Keep a copy of the blocks of the current disk in memory
+ *
+ * Every block is then read from the file at most once; writes still go
+ * straight to the file.  Only for a disk that no other process writes to
+ * while it is open.  Reads served from the cache are not counted in the I/O
+ * statistics.
+ *
+ * @param on 1 to start caching, 0 to stop (and drop the copies)
+ * @return 0 on success; <0 if out of memory
+ */
+int vdisk_set_cache(int on)
+{
+  VDISK *disk = vdisk_current();
+  if(!on) {
+    free(disk->cache);
+    disk->cache = NULL;
+  }else if(disk->cache == NULL) {
+    disk->cache = malloc((size_t) N_BLOCKS_IN_DISK * BLOCK_SIZE);
+    if(disk->cache == NULL)
+      return(-1);
+  }
+  vdisk_cache_drop(disk, 0, N_BLOCKS_IN_DISK);
+  return(0);
+}
+
+// Checksum table: location in the file (of the disk in the local variable
+// disk)
+#define VDISK_CRC_MAGIC 0x31435243 // "CRC1"
+#define VDISK_CRC_OFFSET ((off_t) disk->n_blocks * BLOCK_SIZE)
+#define VDISK_CRC_TABLE_OFFSET (VDISK_CRC_OFFSET + 2 * sizeof(uint32_t))
+
+/**
+ * CRC32C (Castagnoli), one byte at a time from a lookup table
+ *
+ * Used when the processor has no crc32 instruction.
+ */
+static uint32_t vdisk_crc32c_table[256];
+
+static uint32_t vdisk_crc32c_portable(const unsigned char *data, size_t len)
+{
+  uint32_t crc = 0xFFFFFFFF;
+  while(len--)
+    crc = vdisk_crc32c_table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+  return(~crc);
+}
+
+#if defined(__x86_64__)
+/**
+ * CRC32C with the SSE4.2 crc32 instruction, 8 bytes at a time
+ */
+__attribute__((target("sse4.2")))
+static uint32_t vdisk_crc32c_sse42(const unsigned char *data, size_t len)
+{
+  uint64_t crc = 0xFFFFFFFF;
+  for(; len >= sizeof(uint64_t); len -= sizeof(uint64_t), data += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc = _mm_crc32_u64(crc, word);
+  }
+  uint32_t crc32 = (uint32_t) crc;
+  while(len--)
+    crc32 = _mm_crc32_u8(crc32, *data++);
+  return(~crc32);
+}
+#endif
+
+// The implementation picked by vdisk_crc32c_init()
+static uint32_t (*vdisk_crc32c)(const unsigned char *data, size_t len) = NULL;
+
+/**
+ * Choose the fastest CRC32C implementation that the processor supports
+ */
+static void vdisk_crc32c_init()
+{
+  if(vdisk_crc32c != NULL)
+    return;
+#if defined(__x86_64__)
+  if(__builtin_cpu_supports("sse4.2")) {
+    vdisk_crc32c = vdisk_crc32c_sse42;
+    return;
+  }
+#endif
+  for(uint32_t i = 0; i < 256; ++i) {
+    uint32_t crc = i;
+    for(int bit = 0; bit < 8; ++bit)
+      crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+    vdisk_crc32c_table[i] = crc;
+  }
+  vdisk_crc32c = vdisk_crc32c_portable;
+}
+
+/**
+ * Checksum of a block-sized buffer
+ *
+ * @param block BLOCK_SIZE bytes
+ * @return Its CRC32C
+ */
+unsigned int vdisk_checksum(const void *block)
+{
+  vdisk_crc32c_init();
+  return(vdisk_crc32c(block, BLOCK_SIZE));
+}
+
+/**
+ * Checksum of a block on the disk, from the checksum table (no disk read)
+ *
+ * @param block_ref The block
+ * @return The CRC32C of its current contents
+ */
+unsigned int vdisk_block_checksum(BLOCK_REFERENCE block_ref)
+{
+  VDISK *disk = vdisk_current();
+  if(block_ref >= disk->n_blocks)
+    return(0);
+  return(disk->crc[block_ref]);
+}
+
+/**
+ * Store the checksums of a run of blocks in the table on the disk
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_crc_store(BLOCK_REFERENCE first, int n_blocks)
+{
+  VDISK *disk = vdisk_current();
+  size_t size = n_blocks * sizeof(uint32_t);
+  if(pwrite(disk->fd, &disk->crc[first], size,
+	    VDISK_CRC_TABLE_OFFSET + first * sizeof(uint32_t)) != size) {
+    fprintf(stderr, "vdisk: cannot update the checksum table\n");
+    return(-1);
+  }
+  return(0);
+}
+
+/**
+ * Load the checksum table
+ *
+ * An empty file (new disk) and a file of exactly N_BLOCKS_IN_DISK blocks (a
+ * disk written before checksums existed) get a table built from what the
+ * blocks hold now.  Any other file without a valid table is refused, unless
+ * rebuild is set: checksumming its blocks as they are would hide whatever
+ * damaged them.
+ *
+ * @param rebuild Nonzero to rebuild a missing or damaged table
+ * @return 0 on success; -1 on error; -2 if the table is missing or damaged
+ */
+static int vdisk_crc_load(int rebuild)
+{
+  VDISK *disk = vdisk_current();
+  // A disk of n blocks with its checksum table is exactly this long
+  struct stat st;
+  uint32_t header[2];
+  if(fstat(disk->fd, &st) != 0)
+    return(-1);
+  disk->n_blocks = N_BLOCKS_IN_DISK;
+  if(st.st_size > (off_t) sizeof(header)) {
+    off_t n = (st.st_size - sizeof(header)) / (BLOCK_SIZE + sizeof(uint32_t));
+    disk->n_blocks = (n > 0 && n <= N_BLOCKS_IN_DISK) ? n : N_BLOCKS_IN_DISK;
+  }
+  size_t table_size = disk->n_blocks * sizeof(uint32_t);
+  if(pread(disk->fd, header, sizeof(header), VDISK_CRC_OFFSET) == sizeof(header) &&
+     header[0] == VDISK_CRC_MAGIC && header[1] == disk->n_blocks &&
+     pread(disk->fd, disk->crc, table_size, VDISK_CRC_TABLE_OFFSET) == table_size)
+    return(0);
+
+  if(st.st_size == 0 || st.st_size == (off_t) N_BLOCKS_IN_DISK * BLOCK_SIZE) {
+    disk->n_blocks = N_BLOCKS_IN_DISK;
+  }else if(!rebuild) {
+    fprintf(stderr, "vdisk: the checksum table is missing or damaged (zfsck rebuilds it)\n");
+    return(-2);
+  }
+
+  // Checksum whatever the blocks hold now (missing blocks read as zeros)
+  for(int i = 0; i < disk->n_blocks; ++i) {
+    unsigned char block[BLOCK_SIZE];
+    ssize_t n = pread(disk->fd, block, BLOCK_SIZE, (off_t) i * BLOCK_SIZE);
+    if(n < 0)
+      n = 0;
+    memset(block + n, 0, BLOCK_SIZE - n);
+    disk->crc[i] = vdisk_crc32c(block, BLOCK_SIZE);
+  }
+  header[0] = VDISK_CRC_MAGIC;
+  header[1] = disk->n_blocks;
+  if(pwrite(disk->fd, header, sizeof(header), VDISK_CRC_OFFSET) != sizeof(header))
+    return(-1);
+  return(vdisk_crc_store(0, disk->n_blocks));
+}
+
+/**
+ * Number of blocks on the opened disk
+ */
+int vdisk_disk_blocks()
+{
+  VDISK *disk = vdisk_current();
+  return(disk->n_blocks);
+}
+
+/**
+ * Change the number of blocks on the disk
+ *
+ * New blocks read as zeros.  Blocks beyond the new end are dropped, whatever
+ * they hold: the caller has moved anything it needs out of them.  The
+ * checksum table moves to the new end of the file, which is then cut to
+ * size.  If the table is lost on the way (crash), the disk cannot be opened
+ * until zfsck rebuilds it (vdisk_disk_open_rebuild()).
+ *
+ * @param n_blocks New number of blocks (1 ... N_BLOCKS_IN_DISK)
+ * @return 0 on success; <0 on error
+ */
+int vdisk_resize(int n_blocks)
+{
+  VDISK *disk = vdisk_current();
+  // File open?
+  if(disk->fd == 0) {
+    fprintf(stderr, "vdisk_resize(): disk not initialized\n");
+    exit(-1);
+  };
+
+  if(n_blocks < 1 || n_blocks > N_BLOCKS_IN_DISK) {
+    fprintf(stderr, "vdisk_resize(): bad size(%d)\n", n_blocks);
+    return(-2);
+  }
+
+  // New blocks: zeros over whatever was there (the old checksum table)
+  static const unsigned char zeros[BLOCK_SIZE];
+  uint32_t crc = vdisk_crc32c(zeros, BLOCK_SIZE);
+  for(int i = disk->n_blocks; i < n_blocks; ++i) {
+    if(pwrite(disk->fd, zeros, BLOCK_SIZE, (off_t) i * BLOCK_SIZE) != BLOCK_SIZE)
+      return(-4);
+    disk->crc[i] = crc;
+  }
+  // The cache only keeps the blocks both sizes have
+  int kept = n_blocks < disk->n_blocks ? n_blocks : disk->n_blocks;
+  vdisk_cache_drop(disk, kept, N_BLOCKS_IN_DISK - kept);
+  disk->n_blocks = n_blocks;
+
+  uint32_t header[2] = { VDISK_CRC_MAGIC, n_blocks };
+  if(pwrite(disk->fd, header, sizeof(header), VDISK_CRC_OFFSET) != sizeof(header) ||
+     vdisk_crc_store(0, n_blocks) != 0)
+    return(-4);
+  if(ftruncate(disk->fd, VDISK_CRC_TABLE_OFFSET + n_blocks * sizeof(uint32_t)) != 0)
+    return(-4);
+  return(0);
+}
+
+/**
+ * Check a block that was just read against its checksum
+ *
+ * @return 0 if the block is intact; <0 if it is corrupted
+ */
+static int vdisk_crc_verify(BLOCK_REFERENCE block_ref, const void *block)
+{
+  VDISK *disk = vdisk_current();
+  if(vdisk_crc32c(block, BLOCK_SIZE) != disk->crc[block_ref]) {
+    fprintf(stderr, "vdisk: checksum mismatch in block %d\n", block_ref);
+    return(-5);
+  }
+  return(0);
+}
+
+/**
+ * I/O statistics (kept per disk)
+ *
+ * Counters are updated atomically, so that threads sharing the disk (zfsck)
+ * can all count.
+ */
+
+// Fills in the class of every block when the statistics are reported
+static void (*vdisk_classifier)(unsigned char *block_class) = NULL;
+
+#define VDISK_COUNT(counter, n) __atomic_add_fetch(&(counter), (n), __ATOMIC_RELAXED)
+
+// Magic number at the start of a ZSTATS_FILE
+#define VDISK_STATS_MAGIC 0x32545356 // "VST2"
+
+static const char *vdisk_class_names[VDISK_N_CLASSES] = {
+  "other", "master", "inode", "directory", "data"
+};
+static const char *vdisk_op_names[VDISK_N_OPS] = {
+  "read_block", "read_blocks", "write_block"
+};
+
+// Start timing a call
+static void vdisk_stats_start(struct timespec *start)
+{
+  clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+// Count a call that started at start in its latency histogram
+static void vdisk_stats_stop(int op, struct timespec *start)
+{
+  VDISK *disk = vdisk_current();
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  long long us = (end.tv_sec - start->tv_sec) * 1000000LL +
+    (end.tv_nsec - start->tv_nsec) / 1000;
+  int bucket = 0;
+  while(us > 0 && bucket < VDISK_LATENCY_BUCKETS - 1) {
+    us >>= 1;
+    ++bucket;
+  }
+  VDISK_COUNT(disk->stats.calls[op], 1);
+  VDISK_COUNT(disk->stats.latency[op][bucket], 1);
+}
+
+// Count the reads of a run of blocks, and whether readahead had asked for them
+static void vdisk_stats_read(BLOCK_REFERENCE first, int n_blocks)
+{
+  VDISK *disk = vdisk_current();
+  for(int b = first; b < first + n_blocks; ++b) {
+    VDISK_COUNT(disk->stats.block_reads[b], 1);
+    unsigned char bit = 1 << (b & 7);
+    if(__atomic_fetch_and(&disk->prefetched[b >> 3], (unsigned char) ~bit, __ATOMIC_RELAXED) & bit)
+      VDISK_COUNT(disk->stats.cache_hits, 1);
+    else
+      VDISK_COUNT(disk->stats.cache_misses, 1);
+  }
+}
+
+/**
+ * Copy the statistics gathered so far
+ */
+void vdisk_stats_get(VDISK_STATS *stats)
+{
+  VDISK *disk = vdisk_current();
+  memcpy(stats, &disk->stats, sizeof(*stats));
+}
+
+/**
+ * Set the function that tells which class each block belongs to when the
+ * statistics are reported
+ *
+ * @param classify Fills in an array of N_BLOCKS_IN_DISK VDISK_CLASS_* values
+ */
+void vdisk_stats_set_classifier(void (*classify)(unsigned char *block_class))
+{
+  vdisk_classifier = classify;
+}
+
+/**
+ * Add up the per-block counts of a set of statistics by block class
+ *
+ * @param stats The statistics: class_reads and class_writes are filled in
+ * @param block_class Class of each block (NULL: every block is "other")
+ */
+void vdisk_stats_classify(VDISK_STATS *stats, unsigned char *block_class)
+{
+  memset(stats->class_reads, 0, sizeof(stats->class_reads));
+  memset(stats->class_writes, 0, sizeof(stats->class_writes));
+  for(int b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+    int c = block_class != NULL ? block_class[b] : VDISK_CLASS_OTHER;
+    stats->class_reads[c] += stats->block_reads[b];
+    stats->class_writes[c] += stats->block_writes[b];
+  }
+}
+
+/**
+ * Print a set of statistics, classified by vdisk_stats_classify()
+ *
+ * @param out Where to print them
+ * @param stats The statistics
+ */
+void vdisk_stats_print(FILE *out, VDISK_STATS *stats)
+{
+  unsigned long long total_reads = 0;
+  unsigned long long total_writes = 0;
+  for(int c = 0; c < VDISK_N_CLASSES; ++c) {
+    total_reads += stats->class_reads[c];
+    total_writes += stats->class_writes[c];
+  }
+
+  fprintf(out, "vdisk: %llu blocks read, %llu blocks written\n", total_reads, total_writes);
+  fprintf(out, "%-12s %10s %10s\n", "class", "reads", "writes");
+  for(int c = 0; c < VDISK_N_CLASSES; ++c)
+    fprintf(out, "%-12s %10llu %10llu\n", vdisk_class_names[c], stats->class_reads[c],
+	    stats->class_writes[c]);
+  fprintf(out, "cache: %llu hits, %llu misses, %llu blocks prefetched\n",
+	  stats->cache_hits, stats->cache_misses, stats->prefetched);
+
+  for(int op = 0; op < VDISK_N_OPS; ++op) {
+    fprintf(out, "%s: %llu calls", vdisk_op_names[op], stats->calls[op]);
+    for(int i = 0; i < VDISK_LATENCY_BUCKETS; ++i) {
+      if(stats->latency[op][i] == 0)
+	continue;
+      if(i == VDISK_LATENCY_BUCKETS - 1)
+	fprintf(out, ", >=%dus: %llu", 1 << (i - 1), stats->latency[op][i]);
+      else
+	fprintf(out, ", <%dus: %llu", 1 << i, stats->latency[op][i]);
+    }
+    fprintf(out, "\n");
+  }
+}
+
+/**
+ * Read the totals kept in a statistics file (ZSTATS_FILE)
+ *
+ * @return 0 on success; <0 if the file does not exist or is not one
+ */
+int vdisk_stats_read_file(char *path, VDISK_STATS *stats)
+{
+  FILE *f = fopen(path, "r");
+  if(f == NULL)
+    return(-1);
+  uint32_t magic = 0;
+  int ok = fread(&magic, sizeof(magic), 1, f) == 1 && magic == VDISK_STATS_MAGIC &&
+    fread(stats, sizeof(*stats), 1, f) == 1;
+  fclose(f);
+  return(ok ? 0 : -2);
+}
+
+/**
+ * Add a set of statistics to the totals kept in a file
+ *
+ * The file is locked while it is updated, so that commands that finish at
+ * the same time all count.  A file that does not hold totals yet starts
+ * from zero.  The per-class counts come from stats as they are: classify
+ * them first, while the blocks still hold what they held for these counts.
+ *
+ * @return 0 on success; <0 on error
+ */
+int vdisk_stats_add_to_file(char *path, VDISK_STATS *stats)
+{
+  int fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if(fd < 0)
+    return(-1);
+  flock(fd, LOCK_EX);
+
+  uint32_t magic = 0;
+  VDISK_STATS total;
+  if(pread(fd, &magic, sizeof(magic), 0) != sizeof(magic) || magic != VDISK_STATS_MAGIC ||
+     pread(fd, &total, sizeof(total), sizeof(magic)) != sizeof(total))
+    memset(&total, 0, sizeof(total));
+
+  // The structure is nothing but counters
+  unsigned long long *sum = (unsigned long long *) &total;
+  unsigned long long *add = (unsigned long long *) stats;
+  for(size_t i = 0; i < sizeof(total) / sizeof(*sum); ++i)
+    sum[i] += add[i];
+
+  magic = VDISK_STATS_MAGIC;
+  int ret = 0;
+  if(pwrite(fd, &magic, sizeof(magic), 0) != sizeof(magic) ||
+     pwrite(fd, &total, sizeof(total), sizeof(magic)) != sizeof(total))
+    ret = -2;
+  close(fd);
+  return(ret);
+}
+
+/**
+ * Report the statistics as asked by ZSTATS and ZSTATS_FILE, when the disk is
+ * closed
+ */
+static void vdisk_stats_report()
+{
+  char *print = getenv("ZSTATS");
+  char *path = getenv("ZSTATS_FILE");
+  if(print == NULL && path == NULL)
+    return;
+
+  // Classifying the blocks reads some of them: leave those reads out.  The
+  // classes are the ones the blocks have now, at the end of this command, so
+  // the totals in ZSTATS_FILE keep each command's own split
+  VDISK_STATS stats;
+  vdisk_stats_get(&stats);
+  unsigned char block_class[N_BLOCKS_IN_DISK];
+  if(vdisk_classifier != NULL)
+    vdisk_classifier(block_class);
+  vdisk_stats_classify(&stats, vdisk_classifier != NULL ? block_class : NULL);
+
+  if(print != NULL)
+    vdisk_stats_print(stderr, &stats);
+  if(path != NULL && vdisk_stats_add_to_file(path, &stats) != 0)
+    fprintf(stderr, "vdisk: cannot update %s\n", path);
+}
+
+/**
+ * Tracing
+ *
+ * Each thread claims the next slot of the ring with one atomic add and fills
+ * it in: no locks, and the oldest spans are overwritten once the ring is
+ * full.  A span is recorded when it ends, so nested spans come before the
+ * span that holds them; the viewer puts them back together from the times.
+ */
+typedef struct vdisk_trace_event_s
+{
+  const char *name;
+  const char *arg_name;
+  int arg;
+  int tid;
+  long long start_ns;
+  long long duration_ns;
+} VDISK_TRACE_EVENT;
+
+// NULL while tracing is off
+static VDISK_TRACE_EVENT *vdisk_trace_ring = NULL;
+
+// Spans recorded so far (the next slot is this modulo VDISK_TRACE_SPANS)
+static unsigned long long vdisk_trace_count = 0;
+
+// Where the trace goes (ZTRACE)
+static char *vdisk_trace_path = NULL;
+
+// Thread id of the calling thread, 0 until it is known
+static __thread int vdisk_trace_tid = 0;
+
+static long long vdisk_trace_now()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * Start a span (use VDISK_TRACE(), which also ends it)
+ *
+ * @param span Span to fill in
+ * @param name Name of the span: must outlive the program (a string literal)
+ * @param arg_name Name of the argument shown with the span, or NULL
+ * @param arg Value of the argument
+ */
+void vdisk_trace_begin(VDISK_TRACE_SPAN *span, const char *name,
+                       const char *arg_name, int arg)
+{
+  span->start_ns = 0;
+  if(vdisk_trace_ring == NULL)
+    return;
+  span->name = name;
+  span->arg_name = arg_name;
+  span->arg = arg;
+  span->start_ns = vdisk_trace_now();
+}
+
+/**
+ * End a span and record it in the ring
+ */
+void vdisk_trace_end(VDISK_TRACE_SPAN *span)
 {
-  if(vdisk_fd != 0) {
+  if(span->start_ns == 0)
+    return;
+  long long end_ns = vdisk_trace_now();
+  if(vdisk_trace_tid == 0)
+    vdisk_trace_tid = (int) syscall(SYS_gettid);
+
+  unsigned long long slot = __atomic_fetch_add(&vdisk_trace_count, 1, __ATOMIC_RELAXED);
+  VDISK_TRACE_EVENT *event = &vdisk_trace_ring[slot % VDISK_TRACE_SPANS];
+  event->name = span->name;
+  event->arg_name = span->arg_name;
+  event->arg = span->arg;
+  event->tid = vdisk_trace_tid;
+  event->start_ns = span->start_ns;
+  event->duration_ns = end_ns - span->start_ns;
+}
+
+/**
+ * Write the spans in the ring to the ZTRACE file (at exit)
+ */
+static void vdisk_trace_write()
+{
+  FILE *out = fopen(vdisk_trace_path, "w");
+  if(out == NULL) {
+    fprintf(stderr, "vdisk: cannot write %s\n", vdisk_trace_path);
+    return;
+  }
+  unsigned long long count = __atomic_load_n(&vdisk_trace_count, __ATOMIC_ACQUIRE);
+  unsigned long long first = count > VDISK_TRACE_SPANS ? count - VDISK_TRACE_SPANS : 0;
+  int pid = getpid();
+
+  fprintf(out, "{\"displayTimeUnit\":\"ns\",\n\"otherData\":{\"spans\":%llu,\"dropped\":%llu},\n",
+          count, first);
+  fprintf(out, "\"traceEvents\":[");
+  for(unsigned long long i = first; i < count; ++i) {
+    VDISK_TRACE_EVENT *event = &vdisk_trace_ring[i % VDISK_TRACE_SPANS];
+    // Times are in microseconds, to the nanosecond
+    fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+            "\"ts\":%lld.%03lld,\"dur\":%lld.%03lld",
+            i == first ? "" : ",", event->name, pid, event->tid,
+            event->start_ns / 1000, event->start_ns % 1000,
+            event->duration_ns / 1000, event->duration_ns % 1000);
+    if(event->arg_name != NULL)
+      fprintf(out, ",\"args\":{\"%s\":%d}", event->arg_name, event->arg);
+    fprintf(out, "}");
+  }
+  fprintf(out, "\n]}\n");
+  fclose(out);
+}
+
+/**
+ * Turn tracing on if ZTRACE asks for it (once per program)
+ */
+static void vdisk_trace_init()
+{
+  static int done = 0;
+  if(done)
+    return;
+  done = 1;
+
+  vdisk_trace_path = getenv("ZTRACE");
+  if(vdisk_trace_path == NULL || vdisk_trace_path[0] == 0)
+    return;
+  vdisk_trace_ring = calloc(VDISK_TRACE_SPANS, sizeof(VDISK_TRACE_EVENT));
+  if(vdisk_trace_ring == NULL) {
+    fprintf(stderr, "vdisk: no memory for the trace\n");
+    return;
+  }
+  atexit(vdisk_trace_write);
+}
+
+/**
+ * Open the virtual disk (vdisk_disk_open(), vdisk_disk_open_rebuild())
+ *
+ * @param rebuild Nonzero to rebuild a missing or damaged checksum table
+ */
+static int vdisk_open(char *virtual_disk_name, int rebuild)
+{
+  VDISK *disk = vdisk_current();
+  if(disk->fd != 0) {
     fprintf(stderr, "A disk is already opened\n");
     return(-1);
   };
 
+  vdisk_trace_init();
+
   // Open file
   int fd = open(virtual_disk_name, O_RDWR | O_CREAT,
 		S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
@@ -38,10 +760,45 @@ int vdisk_disk_open(char *virtual_disk_name)
     return(-1);
   };
 
-  // Remember the fd in the global variable
-  vdisk_fd = fd;
+  // Remember the fd
+  disk->fd = fd;
+
+  // Get the checksums ready
+  vdisk_crc32c_init();
+  int ret = vdisk_crc_load(rebuild);
+  if(ret != 0) {
+    fprintf(stderr, "Unable to set up the checksum table (%s)\n", virtual_disk_name);
+    close(fd);
+    disk->fd = 0;
+    return(ret);
+  }
   return(0);
-};
+}
+
+/**
+ * Open the virtual disk
+ *
+ * @param virtual_disk_name Name of the file containing the virtual disk
+ * @return 0 on success; -2 if its checksum table is missing or damaged;
+ * other values < 0 on error
+ *
+ */
+int vdisk_disk_open(char *virtual_disk_name)
+{
+  return(vdisk_open(virtual_disk_name, 0));
+}
+
+/**
+ * Open the virtual disk, checksumming its blocks as they are now if its
+ * checksum table is missing or damaged (zfsck)
+ *
+ * @param virtual_disk_name Name of the file containing the virtual disk
+ * @return 0 on success; < 0 on error
+ */
+int vdisk_disk_open_rebuild(char *virtual_disk_name)
+{
+  return(vdisk_open(virtual_disk_name, 1));
+}
 
 /**
  * Close the virtual disk
@@ -50,17 +807,21 @@ int vdisk_disk_open(char *virtual_disk_name)
  */
 int vdisk_disk_close()
 {
+  VDISK *disk = vdisk_current();
   // Must be initialized to clos it
-  if(vdisk_fd == 0) {
+  if(disk->fd == 0) {
     fprintf(stderr, "vdisk_disk_close(): disk not initialized\n");
     exit(-1);
   };
 
+  vdisk_stats_report();
+
   // Close the file
-  close(vdisk_fd);
+  close(disk->fd);
 
   // Mark as closed
-  vdisk_fd = 0;
+  disk->fd = 0;
+  vdisk_cache_drop(disk, 0, N_BLOCKS_IN_DISK);
   return(0);
 }
 
@@ -74,37 +835,112 @@ int vdisk_disk_close()
  */
 int vdisk_read_block(BLOCK_REFERENCE block_ref, void *block)
 {
+  VDISK *disk = vdisk_current();
   if(debug)
     fprintf(stderr, "##Reading block %d\n", block_ref);
 
   // Make sure that the disk is initialized
-  if(vdisk_fd == 0) {
+  if(disk->fd == 0) {
     fprintf(stderr, "vdisk_read_block(): disk not initialized\n");
     exit(-1);
   };
 
   // Make sure that we have a valid block request
-  if(block_ref >= N_BLOCKS_IN_DISK) {
+  if(block_ref >= disk->n_blocks) {
     fprintf(stderr, "vdisk_read_block(): bad block_ref(%d)\n", block_ref);
     return(-2);
   }
 
-  // Lsek to the correct point in the file
-  if(lseek(vdisk_fd, block_ref * BLOCK_SIZE, SEEK_SET) < 0) {
-    fprintf(stderr, "vdisk_read_block(): seek failed\n");
-    return(-3);
-  }
+  if(vdisk_cache_get(disk, block_ref, block) == 0)
+    return(0);
 
-  // Read the block
-  if(read(vdisk_fd, block, BLOCK_SIZE) != BLOCK_SIZE) {
+  // Read the block (positioned read: safe to use from several threads)
+  VDISK_TRACE_ARG("vdisk_read_block", "block", block_ref);
+  struct timespec start;
+  vdisk_stats_start(&start);
+  if(pread(disk->fd, block, BLOCK_SIZE, (off_t) block_ref * BLOCK_SIZE) != BLOCK_SIZE) {
     fprintf(stderr, "vdisk_read_block(): read failed\n");
     return(-4);
   }
+  vdisk_stats_stop(VDISK_OP_READ, &start);
+  vdisk_stats_read(block_ref, 1);
 
-  // Success
+  // Make sure that it is what was written
+  if(vdisk_crc_verify(block_ref, block) != 0)
+    return(-5);
+  vdisk_cache_put(disk, block_ref, block);
   return(0);
 }
 
+/**
+ *  Read a set of disk blocks
+ *
+ *  Runs of consecutive block indices are read with a single request, and
+ *  then every block of the run is checked against its checksum.
+ *
+ * @param block_refs The blocks to read
+ * @param n_blocks Number of entries in block_refs
+ * @param blocks Buffer for n_blocks blocks, filled in the order of block_refs
+ * @return 0 on success; <0 on error (a corrupted block is still returned)
+ *
+ */
+int vdisk_read_blocks(BLOCK_REFERENCE *block_refs, int n_blocks, void *blocks)
+{
+  VDISK *disk = vdisk_current();
+  // Make sure that the disk is initialized
+  if(disk->fd == 0) {
+    fprintf(stderr, "vdisk_read_blocks(): disk not initialized\n");
+    exit(-1);
+  };
+
+  // All from the cache, if it has them all
+  if(disk->cache != NULL) {
+    int i = 0;
+    while(i < n_blocks && block_refs[i] < disk->n_blocks &&
+	  vdisk_cache_get(disk, block_refs[i], (unsigned char *) blocks + (size_t) i * BLOCK_SIZE) == 0)
+      ++i;
+    if(i == n_blocks)
+      return(0);
+  }
+
+  VDISK_TRACE_ARG("vdisk_read_blocks", "n_blocks", n_blocks);
+  struct timespec start;
+  vdisk_stats_start(&start);
+  int ret = 0;
+  int i = 0;
+  while(i < n_blocks) {
+    // Extend the run for as long as the blocks are consecutive on the disk
+    int run = 1;
+    while(i + run < n_blocks && block_refs[i + run] == block_refs[i] + run)
+      ++run;
+
+    if(block_refs[i] + run > disk->n_blocks) {
+      fprintf(stderr, "vdisk_read_blocks(): bad block_ref(%d)\n", block_refs[i]);
+      return(-2);
+    }
+
+    if(debug)
+      fprintf(stderr, "##Reading blocks %d-%d\n", block_refs[i], block_refs[i] + run - 1);
+
+    unsigned char *dst = (unsigned char *) blocks + (size_t) i * BLOCK_SIZE;
+    if(pread(disk->fd, dst, (size_t) run * BLOCK_SIZE,
+	     (off_t) block_refs[i] * BLOCK_SIZE) != (ssize_t) run * BLOCK_SIZE) {
+      fprintf(stderr, "vdisk_read_blocks(): read failed\n");
+      return(-4);
+    }
+    vdisk_stats_read(block_refs[i], run);
+    for(int j = 0; j < run; ++j) {
+      if(vdisk_crc_verify(block_refs[i] + j, dst + (size_t) j * BLOCK_SIZE) != 0)
+	ret = -5;
+      else
+	vdisk_cache_put(disk, block_refs[i] + j, dst + (size_t) j * BLOCK_SIZE);
+    }
+    i += run;
+  }
+  vdisk_stats_stop(VDISK_OP_READ_BLOCKS, &start);
+  return(ret);
+}
+
 /**
  *  Write a disk block to the virtual disk
  *
@@ -114,33 +950,146 @@ int vdisk_read_block(BLOCK_REFERENCE block_ref, void *block)
  */
 int vdisk_write_block(BLOCK_REFERENCE block_ref, void *block)
 {
+  VDISK *disk = vdisk_current();
   if(debug)
     fprintf(stderr, "##Writing block %d\n", block_ref);
 
   // File open?
-  if(vdisk_fd == 0) {
+  if(disk->fd == 0) {
     fprintf(stderr, "vdisk_write_block(): disk not initialized\n");
     exit(-1);
   };
 
   // Is it a valid block request?
-  if(block_ref >= N_BLOCKS_IN_DISK) {
+  if(block_ref >= disk->n_blocks) {
     fprintf(stderr, "vdisk_write_block(): bad block_ref(%d)\n", block_ref);
     return(-2);
   }
 
-  // Move to the beginning of the block
-  if(lseek(vdisk_fd, block_ref * BLOCK_SIZE, SEEK_SET) < 0) {
-    fprintf(stderr, "vdisk_write_block(): seek failed\n");
-    return(-3);
-  }
-
-  // Read the block
-  if(write(vdisk_fd, block, BLOCK_SIZE) != BLOCK_SIZE) {
+  // Write the block (positioned write: no shared file offset)
+  VDISK_TRACE_ARG("vdisk_write_block", "block", block_ref);
+  struct timespec start;
+  vdisk_stats_start(&start);
+  if(pwrite(disk->fd, block, BLOCK_SIZE, (off_t) block_ref * BLOCK_SIZE) != BLOCK_SIZE) {
     fprintf(stderr, "vdisk_write_block(): read failed\n");
     return(-4);
   }
 
+  // Keep the checksum and the cache in step
+  disk->crc[block_ref] = vdisk_crc32c(block, BLOCK_SIZE);
+  vdisk_cache_put(disk, block_ref, block);
+  int ret = vdisk_crc_store(block_ref, 1);
+  vdisk_stats_stop(VDISK_OP_WRITE, &start);
+  VDISK_COUNT(disk->stats.block_writes[block_ref], 1);
+  return(ret);
+}
+
+/**
+ *  Hint that a set of blocks will be read soon
+ *
+ *  Runs of consecutive block indices are coalesced, so that the kernel is
+ *  asked to start reading each run with a single request.  The call does not
+ *  wait for the data: it only gets the reads started in the background.
+ *
+ * @param block_refs Blocks that are about to be read, in the order they will
+ *                   be read
+ * @param n_blocks Number of entries in block_refs
+ * @return 0 on success; <0 on error
+ *
+ */
+int vdisk_prefetch_blocks(BLOCK_REFERENCE *block_refs, int n_blocks)
+{
+  VDISK *disk = vdisk_current();
+  // File open?
+  if(disk->fd == 0) {
+    fprintf(stderr, "vdisk_prefetch_blocks(): disk not initialized\n");
+    exit(-1);
+  };
+
+  int i = 0;
+  while(i < n_blocks) {
+    // Extend the run for as long as the blocks are consecutive on the disk
+    int run = 1;
+    while(i + run < n_blocks && block_refs[i + run] == block_refs[i] + run)
+      ++run;
+
+    if(block_refs[i] + run > disk->n_blocks) {
+      fprintf(stderr, "vdisk_prefetch_blocks(): bad block_ref(%d)\n", block_refs[i]);
+      return(-2);
+    }
+
+    if(debug)
+      fprintf(stderr, "##Prefetching blocks %d-%d\n", block_refs[i], block_refs[i] + run - 1);
+
+    // Advisory only: a failure here does not affect correctness
+    posix_fadvise(disk->fd, (off_t) block_refs[i] * BLOCK_SIZE,
+		  (off_t) run * BLOCK_SIZE, POSIX_FADV_WILLNEED);
+    for(int b = block_refs[i]; b < block_refs[i] + run; ++b)
+      __atomic_fetch_or(&disk->prefetched[b >> 3], (unsigned char) (1 << (b & 7)), __ATOMIC_RELAXED);
+    VDISK_COUNT(disk->stats.prefetched, run);
+    i += run;
+  }
+
+  // Success
+  return(0);
+}
+
+/**
+ *  Tell the host file system that a set of blocks is no longer in use
+ *
+ *  The matching byte ranges of the disk file are turned into holes, which
+ *  frees the space on the host and makes the blocks read back as zeros.  The
+ *  file size does not change.  Runs of consecutive blocks are punched with a
+ *  single request.
+ *
+ * @param block_refs The freed blocks
+ * @param n_blocks Number of entries in block_refs
+ * @return 0 on success; <0 on error (including no support for hole punching)
+ *
+ */
+int vdisk_discard_blocks(BLOCK_REFERENCE *block_refs, int n_blocks)
+{
+  VDISK *disk = vdisk_current();
+  // File open?
+  if(disk->fd == 0) {
+    fprintf(stderr, "vdisk_discard_blocks(): disk not initialized\n");
+    exit(-1);
+  };
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+  int i = 0;
+  while(i < n_blocks) {
+    // Extend the run for as long as the blocks are consecutive on the disk
+    int run = 1;
+    while(i + run < n_blocks && block_refs[i + run] == block_refs[i] + run)
+      ++run;
+
+    if(block_refs[i] + run > disk->n_blocks) {
+      fprintf(stderr, "vdisk_discard_blocks(): bad block_ref(%d)\n", block_refs[i]);
+      return(-2);
+    }
+
+    if(debug)
+      fprintf(stderr, "##Discarding blocks %d-%d\n", block_refs[i], block_refs[i] + run - 1);
+
+    if(fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		 (off_t) block_refs[i] * BLOCK_SIZE, (off_t) run * BLOCK_SIZE) != 0)
+      return(-3);
+
+    // The blocks now read back as zeros
+    static const unsigned char zeros[BLOCK_SIZE];
+    uint32_t crc = vdisk_crc32c(zeros, BLOCK_SIZE);
+    for(int j = 0; j < run; ++j)
+      disk->crc[block_refs[i] + j] = crc;
+    vdisk_cache_drop(disk, block_refs[i], run);
+    if(vdisk_crc_store(block_refs[i], run) != 0)
+      return(-4);
+    i += run;
+  }
+
   // Success
   return(0);
+#else
+  return(-3);
+#endif
 }
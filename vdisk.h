@@ -1,4 +1,5 @@
 #ifndef VDISK_H
+#define VDISK_H
 
 #include <sys/types.h>
 #include <unistd.h>
@@ -12,12 +13,116 @@ typedef unsigned short BLOCK_REFERENCE;
 // Size of block in bytes
 #define BLOCK_SIZE 256
 
-// Total number of blocks on the virtual disk
+// Total number of blocks on the virtual disk (largest size; see
+// vdisk_disk_blocks())
 #define N_BLOCKS_IN_DISK 128
 
+// I/O statistics
+//
+// Kept for every disk, at the cost of a few counter updates and two clock
+// reads per call.  Setting ZSTATS prints them to stderr when the disk is
+// closed; setting ZSTATS_FILE adds them to the totals kept in that file.
+
+// Block classes, assigned by the file system (vdisk_stats_set_classifier())
+#define VDISK_CLASS_OTHER 0
+#define VDISK_CLASS_MASTER 1
+#define VDISK_CLASS_INODE 2
+#define VDISK_CLASS_DIRECTORY 3
+#define VDISK_CLASS_DATA 4
+#define VDISK_N_CLASSES 5
+
+// Timed calls
+#define VDISK_OP_READ 0         // vdisk_read_block()
+#define VDISK_OP_READ_BLOCKS 1  // vdisk_read_blocks()
+#define VDISK_OP_WRITE 2        // vdisk_write_block()
+#define VDISK_N_OPS 3
+
+// Latency histogram buckets: bucket 0 counts calls that took less than 1
+// microsecond, bucket i those under 2^i microseconds.  The last bucket also
+// counts everything slower
+#define VDISK_LATENCY_BUCKETS 20
+
+typedef struct vdisk_stats_s
+{
+  // Blocks read and written, per block
+  unsigned long long block_reads[N_BLOCKS_IN_DISK];
+  unsigned long long block_writes[N_BLOCKS_IN_DISK];
+
+  // The same, per VDISK_CLASS_*: filled in when the disk is closed, with the
+  // classes the blocks had then (vdisk_stats_classify())
+  unsigned long long class_reads[VDISK_N_CLASSES];
+  unsigned long long class_writes[VDISK_N_CLASSES];
+
+  // Calls and their latency histograms, per VDISK_OP_*
+  unsigned long long calls[VDISK_N_OPS];
+  unsigned long long latency[VDISK_N_OPS][VDISK_LATENCY_BUCKETS];
+
+  // Blocks that readahead asked the host to cache, and reads of blocks that
+  // had (hits) or had not (misses) been asked for
+  unsigned long long prefetched;
+  unsigned long long cache_hits;
+  unsigned long long cache_misses;
+} VDISK_STATS;
+
+// Tracing
+//
+// Setting ZTRACE=<file> records a span for every traced call (the block I/O
+// here, and the entry points of the file system) and writes them to file as
+// Chrome trace JSON when the program exits: load it in ui.perfetto.dev or
+// chrome://tracing.  Spans go into a ring of the last VDISK_TRACE_SPANS; when
+// tracing is off, a traced call costs a call and a test.
+
+#define VDISK_TRACE_SPANS 65536
+
+typedef struct vdisk_trace_span_s
+{
+  const char *name;
+  const char *arg_name;   // NULL: no argument
+  int arg;
+  long long start_ns;     // 0: tracing is off
+} VDISK_TRACE_SPAN;
+
+void vdisk_trace_begin(VDISK_TRACE_SPAN *span, const char *name,
+                       const char *arg_name, int arg);
+void vdisk_trace_end(VDISK_TRACE_SPAN *span);
+
+// Trace the rest of the enclosing block (up to whichever return leaves it)
+// as a span called name, with an integer argument
+#define VDISK_TRACE_ARG(name, arg_name, arg)                            \
+  VDISK_TRACE_SPAN vdisk_trace_span_ __attribute__((cleanup(vdisk_trace_end))); \
+  vdisk_trace_begin(&vdisk_trace_span_, name, arg_name, arg)
+#define VDISK_TRACE(name) VDISK_TRACE_ARG(name, NULL, 0)
+
+// Several disks
+//
+// The calls below all work on the current disk of the calling thread: the
+// one it has selected with vdisk_select(), or else the default disk.  A
+// program with one disk never selects any.  A disk may be read by several
+// threads at once (zfsck), but written by only one.
+typedef struct vdisk_s VDISK;
+
+VDISK *vdisk_new();
+void vdisk_free(VDISK *disk);
+VDISK *vdisk_select(VDISK *disk);
+int vdisk_set_cache(int on);
+
 int vdisk_disk_open(char *virtual_disk_name);
+int vdisk_disk_open_rebuild(char *virtual_disk_name);
 int vdisk_disk_close();
+int vdisk_disk_blocks();
+int vdisk_resize(int n_blocks);
 int vdisk_read_block(BLOCK_REFERENCE block_ref, void *block);
 int vdisk_write_block(BLOCK_REFERENCE block_ref, void *block);
+int vdisk_read_blocks(BLOCK_REFERENCE *block_refs, int n_blocks, void *blocks);
+int vdisk_prefetch_blocks(BLOCK_REFERENCE *block_refs, int n_blocks);
+int vdisk_discard_blocks(BLOCK_REFERENCE *block_refs, int n_blocks);
+unsigned int vdisk_checksum(const void *block);
+unsigned int vdisk_block_checksum(BLOCK_REFERENCE block_ref);
+void vdisk_stats_get(VDISK_STATS *stats);
+void vdisk_stats_set_classifier(void (*classify)(unsigned char *block_class));
+void vdisk_stats_classify(VDISK_STATS *stats, unsigned char *block_class);
+void vdisk_stats_print(FILE *out, VDISK_STATS *stats);
+int vdisk_stats_read_file(char *path, VDISK_STATS *stats);
+int vdisk_stats_add_to_file(char *path, VDISK_STATS *stats);
 
 #endif
@@ -17,8 +17,12 @@ int main(int argc, char** argv) {
     //Gets the file for writing
     OUFILE* oufile = malloc(sizeof(*oufile));
     oufile = oufs_fopen(cwd, argv[1], 'a');
+    if(oufile == NULL){
+      vdisk_disk_close();
+      return(1);
+    }
     //Steps through stdin and stores in buffer
-    char c = fgetc(stdin);
+    int c = fgetc(stdin); //int, so that a 0xff byte is not taken for EOF
     int length = 0;
     unsigned char* buf = malloc(N_BLOCKS_IN_DISK * BLOCK_SIZE);
     int i = 0;
@@ -38,7 +42,7 @@ int main(int argc, char** argv) {
     // printf("Length: %i\n", length);
     //Writes Buffer to file
     oufs_fwrite(oufile, buf, length);
-    free(oufile);
+    oufs_fclose(oufile);
     // Clean up
     vdisk_disk_close();
     free(buf);
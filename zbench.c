@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "oufs_lib.h"
+
+/*
+ * Microbenchmarks for the library's hot paths
+ *
+ * Each benchmark runs on a freshly formatted disk in every directory given on
+ * the command line (typically a tmpfs such as /dev/shm, and a real disk), so
+ * that the cost of the code can be told apart from the cost of the I/O.
+ * Only the call being measured is timed; the setup and the clean-up between
+ * iterations are not.
+ */
+
+// Latency of each iteration of the current benchmark, in nanoseconds
+static long long *samples;
+static int n_samples;
+static struct timespec started;
+
+// Disk file of the current run, and the working directory for the library
+static char disk_name[MAX_PATH_LENGTH];
+static char cwd[] = "/";
+
+static void bench_start()
+{
+  clock_gettime(CLOCK_MONOTONIC, &started);
+}
+
+static void bench_stop()
+{
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  samples[n_samples++] = (end.tv_sec - started.tv_sec) * 1000000000LL +
+    (end.tv_nsec - started.tv_nsec);
+}
+
+static int bench_compare(const void *p, const void *q)
+{
+  long long a = *(const long long *) p;
+  long long b = *(const long long *) q;
+  return (a > b) - (a < b);
+}
+
+// Latency at percentile pct, in microseconds (samples must be sorted)
+static double bench_percentile(int pct)
+{
+  int i = (int) ((long long) (n_samples - 1) * pct / 100);
+  return samples[i] / 1000.0;
+}
+
+// Print one line of results and start the next benchmark
+static void bench_report(const char *name)
+{
+  if(n_samples == 0) {
+    printf("%-24s %10s\n", name, "failed");
+    return;
+  }
+  long long total = 0;
+  for(int i = 0; i < n_samples; ++i)
+    total += samples[i];
+  qsort(samples, n_samples, sizeof(*samples), bench_compare);
+  printf("%-24s %10.0f %9.2f %9.2f %9.2f %9.2f\n", name,
+         n_samples / (total / 1e9), bench_percentile(50), bench_percentile(90),
+         bench_percentile(99), samples[n_samples - 1] / 1000.0);
+  n_samples = 0;
+}
+
+// Start from an empty file system
+static int bench_fresh_disk()
+{
+  if(oufs_format_disk(disk_name, 0, N_BLOCKS_IN_DISK) != 0 ||
+     vdisk_disk_open(disk_name) != 0) {
+    fprintf(stderr, "zbench: cannot format %s\n", disk_name);
+    return -1;
+  }
+  return 0;
+}
+
+// Create a file holding size bytes
+static int bench_create(char *path, unsigned char *buf, int size)
+{
+  OUFILE *fp = oufs_fopen(cwd, path, 'w');
+  if(fp == NULL)
+    return -1;
+  oufs_fwrite(fp, buf, size);
+  oufs_fclose(fp);
+  return 0;
+}
+
+// oufs_find_file() on a path depth directories deep
+static void bench_find(int depth, int n)
+{
+  char path[MAX_PATH_LENGTH] = "";
+  if(bench_fresh_disk() != 0)
+    return;
+  for(int d = 0; d < depth; ++d) {
+    strcat(path, "/d");
+    oufs_mkdir(cwd, path);
+  }
+  for(int i = 0; i < n; ++i) {
+    INODE_REFERENCE parent;
+    INODE_REFERENCE child;
+    char local_name[MAX_PATH_LENGTH];
+    bench_start();
+    int ret = oufs_find_file(cwd, path, &parent, &child, local_name);
+    bench_stop();
+    if(ret != 0 || child == UNALLOCATED_INODE) {
+      n_samples = 0;
+      break;
+    }
+  }
+  vdisk_disk_close();
+  char name[32];
+  sprintf(name, "find_file depth %d", depth);
+  bench_report(name);
+}
+
+// oufs_mkdir() of a new directory in the root (removed after each iteration)
+static void bench_mkdir(int n)
+{
+  if(bench_fresh_disk() != 0)
+    return;
+  for(int i = 0; i < n; ++i) {
+    bench_start();
+    int ret = oufs_mkdir(cwd, "/m");
+    bench_stop();
+    if(ret != 0 || oufs_rmdir(cwd, "/m") != 0) {
+      n_samples = 0;
+      break;
+    }
+  }
+  vdisk_disk_close();
+  bench_report("mkdir");
+}
+
+// oufs_fopen() + oufs_fwrite() + oufs_fclose() of a new file of size bytes
+static void bench_write(int size, int n)
+{
+  unsigned char buf[BLOCKS_PER_INODE * BLOCK_SIZE];
+  memset(buf, 'w', sizeof(buf));
+  if(bench_fresh_disk() != 0)
+    return;
+  for(int i = 0; i < n; ++i) {
+    bench_start();
+    OUFILE *fp = oufs_fopen(cwd, "/f", 'w');
+    if(fp != NULL) {
+      oufs_fwrite(fp, buf, size);
+      oufs_fclose(fp);
+    }
+    bench_stop();
+    if(fp == NULL || oufs_remove(cwd, "/f") != 0) {
+      n_samples = 0;
+      break;
+    }
+  }
+  vdisk_disk_close();
+  char name[32];
+  sprintf(name, "fopen+fwrite %d", size);
+  bench_report(name);
+}
+
+// oufs_fopen() + oufs_fread() + oufs_fclose() of a whole file of size bytes
+static void bench_read(int size, int n)
+{
+  unsigned char buf[BLOCKS_PER_INODE * BLOCK_SIZE];
+  memset(buf, 'r', sizeof(buf));
+  if(bench_fresh_disk() != 0)
+    return;
+  if(bench_create("/f", buf, size) == 0) {
+    for(int i = 0; i < n; ++i) {
+      bench_start();
+      OUFILE *fp = oufs_fopen(cwd, "/f", 'r');
+      int got = fp != NULL ? oufs_fread(fp, buf, size) : -1;
+      oufs_fclose(fp);
+      bench_stop();
+      if(got != size) {
+        n_samples = 0;
+        break;
+      }
+    }
+  }
+  vdisk_disk_close();
+  char name[32];
+  sprintf(name, "fread %d", size);
+  bench_report(name);
+}
+
+// oufs_remove() of a file of one block
+static void bench_remove(int n)
+{
+  unsigned char buf[BLOCK_SIZE];
+  memset(buf, 'x', sizeof(buf));
+  if(bench_fresh_disk() != 0)
+    return;
+  for(int i = 0; i < n; ++i) {
+    if(bench_create("/f", buf, sizeof(buf)) != 0)
+      break;
+    bench_start();
+    int ret = oufs_remove(cwd, "/f");
+    bench_stop();
+    if(ret != 0) {
+      n_samples = 0;
+      break;
+    }
+  }
+  vdisk_disk_close();
+  bench_report("remove");
+}
+
+// oufs_link() of a second name for a file (removed after each iteration)
+static void bench_link(int n)
+{
+  unsigned char buf[BLOCK_SIZE];
+  memset(buf, 'l', sizeof(buf));
+  if(bench_fresh_disk() != 0)
+    return;
+  if(bench_create("/f", buf, sizeof(buf)) == 0) {
+    for(int i = 0; i < n; ++i) {
+      bench_start();
+      int ret = oufs_link(cwd, "/f", "/g");
+      bench_stop();
+      if(ret != 0 || oufs_remove(cwd, "/g") != 0) {
+        n_samples = 0;
+        break;
+      }
+    }
+  }
+  vdisk_disk_close();
+  bench_report("link");
+}
+
+int main(int argc, char** argv) {
+  // Check arguments
+  int n = 1000;
+  int arg = 1;
+  if(arg + 1 < argc && strcmp(argv[arg], "-n") == 0) {
+    n = atoi(argv[arg + 1]);
+    arg += 2;
+  }
+  if(arg >= argc || n <= 0) {
+    fprintf(stderr, "Usage: zbench [-n <iterations>] <directory>...\n");
+    return(1);
+  }
+  samples = malloc(n * sizeof(*samples));
+
+  for(; arg < argc; ++arg) {
+    snprintf(disk_name, sizeof(disk_name), "%s/zbench-%d.vdisk", argv[arg], getpid());
+    printf("zbench: %s, %d iterations\n", disk_name, n);
+    printf("%-24s %10s %9s %9s %9s %9s\n", "benchmark", "ops/s", "p50(us)",
+           "p90(us)", "p99(us)", "max(us)");
+
+    int depths[] = { 1, 2, 4, 8 };
+    for(int d = 0; d < 4; ++d)
+      bench_find(depths[d], n);
+    bench_mkdir(n);
+    int sizes[] = { 16, BLOCK_SIZE, 4 * BLOCK_SIZE, BLOCKS_PER_INODE * BLOCK_SIZE };
+    for(int s = 0; s < 4; ++s)
+      bench_write(sizes[s], n);
+    for(int s = 0; s < 4; ++s)
+      bench_read(sizes[s], n);
+    bench_remove(n);
+    bench_link(n);
+
+    unlink(disk_name);
+    printf("\n");
+  }
+  free(samples);
+  return(0);
+
+}
@@ -0,0 +1,31 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  // Check arguments
+  int recursive = (argc == 4 && strcmp(argv[1], "-r") == 0);
+  if(argc == 3 || recursive) {
+    // Open the virtual disk
+    vdisk_disk_open(disk_name);
+
+    // Copy the file or the whole tree
+    int ret = oufs_copy_tree(cwd, argv[argc - 2], argv[argc - 1], recursive);
+
+    // Clean up
+    vdisk_disk_close();
+    return(ret == 0 ? 0 : 1);
+
+  }else{
+    // Wrong number of parameters
+    fprintf(stderr, "Usage: zcp [-r] <source> <destination>\n");
+    return(1);
+  }
+
+}
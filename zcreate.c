@@ -10,15 +10,21 @@ int main(int argc, char** argv) {
   oufs_get_environment(cwd, disk_name);
 
   // Check arguments
-  if(argc == 2) {
+  int compress = (argc == 3 && strcmp(argv[1], "-c") == 0);
+  if(argc == 2 || compress) {
     // Open the virtual disk
     vdisk_disk_open(disk_name);
 
     //Gets the file for writing
     OUFILE* oufile = malloc(sizeof(*oufile));
-    oufile = oufs_fopen(cwd, argv[1], 'w');
+    oufile = oufs_fopen(cwd, argv[argc - 1], 'w');
+    if(oufile == NULL){
+      vdisk_disk_close();
+      return(1);
+    }
+    oufile->compress = compress;
     //Steps through stdin and stores in buffer
-    char c = fgetc(stdin);
+    int c = fgetc(stdin); //int, so that a 0xff byte is not taken for EOF
     int length = 0;
     unsigned char* buf = malloc(N_BLOCKS_IN_DISK * BLOCK_SIZE);
     int i = 0;
@@ -38,14 +44,14 @@ int main(int argc, char** argv) {
     // printf("Length: %i\n", length);
     //Writes Buffer to file
     oufs_fwrite(oufile, buf, length);
-    free(oufile);
+    oufs_fclose(oufile);
     // Clean up
     vdisk_disk_close();
     free(buf);
 
   }else{
     // Wrong number of parameters
-    fprintf(stderr, "Usage: ztouch <dirname>\n");
+    fprintf(stderr, "Usage: zcreate [-c] <filename>\n");
   }
 
 }
@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  // Check arguments
+  int check_only = 0;
+  if(argc == 2 && strcmp(argv[1], "-n") == 0) {
+    check_only = 1;
+  }else if(argc != 1) {
+    // Wrong number of parameters
+    fprintf(stderr, "Usage: zdefrag [-n]\n");
+    return(1);
+  }
+
+  // Open the virtual disk
+  vdisk_disk_open(disk_name);
+
+  OUFS_DEFRAG_STATS stats;
+  int ret = oufs_defrag(check_only, &stats);
+
+  // Clean up
+  vdisk_disk_close();
+  if(ret != 0) {
+    fprintf(stderr, "zdefrag: failed\n");
+    return(1);
+  }
+
+  if(check_only) {
+    printf("zdefrag: %d fragmented, %d runs\n", stats.n_fragmented,
+           stats.runs_before);
+  }else{
+    printf("zdefrag: %d moved, %d directories compacted, %d shared skipped\n",
+           stats.n_moved, stats.n_compacted, stats.n_shared);
+    printf("zdefrag: %d blocks moved, %d released, runs %d -> %d\n",
+           stats.n_blocks_moved, stats.n_blocks_released, stats.runs_before,
+           stats.runs_after);
+  }
+  return(0);
+
+}
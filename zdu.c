@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+/*
+ * Space used by a subtree, for each directory in it
+ *
+ * One walk of the tree: the inode blocks are read once, up front, and each
+ * directory's blocks with one request.  Like du, an inode reached through
+ * several names (hard links) is only counted under the first one.
+ */
+
+typedef struct du_usage_s
+{
+  int blocks;         // Data and directory blocks
+  long long bytes;    // Sizes of the files
+  int inodes;
+} DU_USAGE;
+
+static BLOCK inode_blocks[N_INODE_BLOCKS];
+static unsigned char counted[N_INODES];
+
+// 0: directories only; 1: files too (-a); -1: the total only (-s)
+static int show;
+
+static INODE *du_inode(INODE_REFERENCE i)
+{
+  return &inode_blocks[i / INODES_PER_BLOCK].inodes.inode[i % INODES_PER_BLOCK];
+}
+
+static void du_print(DU_USAGE *usage, char *path)
+{
+  printf("%6d %8lld %6d  %s\n", usage->blocks, usage->bytes, usage->inodes, path);
+}
+
+/**
+ * Add up the usage of the subtree at an inode, printing it on the way back up
+ *
+ * @param i The inode
+ * @param path Its path, for the report
+ * @param usage Where the subtree's usage is added
+ */
+static void du_walk(INODE_REFERENCE i, char *path, DU_USAGE *usage)
+{
+  if(i >= N_INODES || counted[i])
+    return;
+  counted[i] = 1;
+  INODE *inode = du_inode(i);
+
+  DU_USAGE own = { 0, 0, 1 };
+  BLOCK_REFERENCE refs[BLOCKS_PER_INODE];
+  int n_refs = 0;
+  if(inode->type != IT_INLINE_FILE) {
+    for(int b = 0; b < BLOCKS_PER_INODE; ++b) {
+      if(inode->data[b] != UNALLOCATED_BLOCK)
+        refs[n_refs++] = inode->data[b];
+    }
+  }
+  own.blocks = n_refs;
+  if(oufs_is_file(inode))
+    own.bytes = inode->size;
+
+  if(inode->type == IT_DIRECTORY && n_refs > 0) {
+    BLOCK dir[BLOCKS_PER_INODE];
+    if(vdisk_read_blocks(refs, n_refs, dir) != 0)
+      fprintf(stderr, "zdu: cannot read directory %s\n", path);
+    for(int b = 0; b < n_refs; ++b) {
+      for(int e = 0; e < DIRECTORY_ENTRIES_PER_BLOCK; ++e) {
+        DIRECTORY_ENTRY *entry = &dir[b].directory.entry[e];
+        if(entry->inode_reference == UNALLOCATED_INODE ||
+           strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0)
+          continue;
+        char child_path[MAX_PATH_LENGTH];
+        snprintf(child_path, sizeof(child_path), "%s%s%.*s", path,
+                 path[strlen(path) - 1] == '/' ? "" : "/",
+                 (int) FILE_NAME_SIZE, entry->name);
+        du_walk(entry->inode_reference, child_path, &own);
+      }
+    }
+  }
+
+  if(show == 1 || (show == 0 && inode->type == IT_DIRECTORY))
+    du_print(&own, path);
+  usage->blocks += own.blocks;
+  usage->bytes += own.bytes;
+  usage->inodes += own.inodes;
+}
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  // Check arguments
+  int arg = 1;
+  if(arg < argc && strcmp(argv[arg], "-a") == 0) {
+    show = 1;
+    ++arg;
+  }else if(arg < argc && strcmp(argv[arg], "-s") == 0) {
+    show = -1;
+    ++arg;
+  }
+  if(argc - arg > 1) {
+    fprintf(stderr, "Usage: zdu [-a|-s] [<path>]\n");
+    return(1);
+  }
+  char *path = arg < argc ? argv[arg] : cwd;
+
+  // Open the virtual disk
+  if(vdisk_disk_open(disk_name) != 0)
+    return(1);
+
+  INODE_REFERENCE parent;
+  INODE_REFERENCE child;
+  if(oufs_find_file(cwd, path, &parent, &child, NULL) != 0 ||
+     child == UNALLOCATED_INODE) {
+    fprintf(stderr, "zdu: %s does not exist\n", path);
+    vdisk_disk_close();
+    return(1);
+  }
+
+  BLOCK_REFERENCE refs[N_INODE_BLOCKS];
+  for(int b = 0; b < N_INODE_BLOCKS; ++b)
+    refs[b] = 1 + b;
+  if(vdisk_read_blocks(refs, N_INODE_BLOCKS, inode_blocks) != 0) {
+    fprintf(stderr, "zdu: cannot read the inode blocks\n");
+    vdisk_disk_close();
+    return(1);
+  }
+
+  printf("%6s %8s %6s  %s\n", "blocks", "bytes", "inodes", "path");
+  DU_USAGE total = { 0, 0, 0 };
+  du_walk(child, path, &total);
+  // The total, unless the walk already printed it
+  if(show == -1 || (show == 0 && du_inode(child)->type != IT_DIRECTORY))
+    du_print(&total, path);
+
+  // Clean up
+  vdisk_disk_close();
+  return(0);
+
+}
@@ -0,0 +1,40 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  // Check arguments: either <file> <length> or <file> <offset> <length>
+  int offset = 0;
+  int length;
+  if((argc == 3 && sscanf(argv[2], "%d", &length) == 1) ||
+     (argc == 4 && sscanf(argv[2], "%d", &offset) == 1 && sscanf(argv[3], "%d", &length) == 1)) {
+    // Open the virtual disk
+    vdisk_disk_open(disk_name);
+
+    //Opens (creating if needed) the file and reserves its blocks
+    OUFILE* oufile = oufs_fopen(cwd, argv[1], 'a');
+    int ret = -1;
+    if(oufile != NULL){
+      ret = oufs_fallocate(oufile, offset, length);
+      if(ret == -1)
+        fprintf(stderr, "zfallocate: invalid range (%d, %d)\n", offset, length);
+      oufs_fclose(oufile);
+    }
+
+    // Clean up
+    vdisk_disk_close();
+    return(ret == 0 ? 0 : 1);
+
+  }else{
+    // Wrong number of parameters
+    fprintf(stderr, "Usage: zfallocate <file> [<offset>] <length>\n");
+    return(1);
+  }
+
+}
@@ -10,18 +10,57 @@ int main(int argc, char** argv){
   char diskName[MAX_PATH_LENGTH];
   oufs_get_environment(cwd, diskName);
 
-  //Opens the disk for reading
-  vdisk_disk_open(diskName);
+  //-U lists the entries in the order they are on the disk (no sorting); -l
+  //shows the type, links, size and inode of each
+  int unsorted = 0;
+  int long_listing = 0;
+  while(argc >= 2 && (strcmp(argv[1], "-U") == 0 || strcmp(argv[1], "-l") == 0)) {
+    if(argv[1][1] == 'U')
+      unsorted = 1;
+    else
+      long_listing = 1;
+    --argc;
+    ++argv;
+  }
 
-  //If an argument is provided, list the directories in there
-  if(argc == 2)
-    oufs_list(cwd, argv[1]);
-  //If no argument is provided, list the directories in the cwd
-  else if(argc == 1)
-    oufs_list(cwd, "");
   //If more than 1 argument is provided, throw an error
-  else
+  if(argc > 2) {
     fprintf(stderr, "ERROR: zfilez only accepts one argument\n");
+    return 0;
+  }
+
+  //Opens the disk for reading
+  vdisk_disk_open(diskName);
+
+  //If an argument is provided, list the directories in there; if not, list
+  //the directories in the cwd
+  char *path = argc == 2 ? argv[1] : "";
+  if(long_listing) {
+    OUFS_DIRENTPLUS entries[OUFS_MAX_DIR_ENTRIES];
+    int n = oufs_readdirplus(cwd, path, unsorted ? 0 : OUFS_DIR_SORTED, entries);
+    if(n == -1)
+      fprintf(stderr, "zfilez error: directory does not exist\n");
+    else if(n < 0)
+      fprintf(stderr, "zfilez error: cannot read the inodes of the entries\n");
+    for(int i = 0; i < n; ++i) {
+      INODE *inode = &entries[i].inode;
+      printf("%c %3d %6u %3d %s%s\n", inode->type, inode->n_references, inode->size,
+             entries[i].entry.inode, entries[i].entry.name,
+             inode->type == IT_DIRECTORY ? "/" : "");
+    }
+  }else if(!unsorted) {
+    oufs_list(cwd, path);
+  }else{
+    OUFS_DIR *dir = oufs_opendir(cwd, path, 0);
+    if(dir == NULL) {
+      fprintf(stderr, "zfilez error: directory does not exist\n");
+    }else{
+      OUFS_DIRENT *entry;
+      while((entry = oufs_readdir(dir)) != NULL)
+        printf("%s%s\n", entry->name, entry->type == IT_DIRECTORY ? "/" : "");
+      oufs_closedir(dir);
+    }
+  }
 
   //Closes the disk after all work is done
   vdisk_disk_close();
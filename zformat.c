@@ -4,145 +4,33 @@
 #include "oufs_lib.h"
 #include "vdisk.h"
 
-//Don't want to make a new header file because all of these functions are only used here
-//Functions used later on
-int initialize_disk();
-int initalize_master_block();
-int initialize_first_inode();
-int initialize_other_inodes();
-int initialize_first_directory();
-
 int main(int argc, char** argv){
-  //Write 0s to all bytes in virtual disk
-  if(initialize_disk() == -1){
-    fprintf(stderr, "ERROR WRITING 0s TO DISK\n");
-  }
-
-  //Marks master block, all inode blocks, and the first data block as allocated
-  if(initalize_master_block() == -1){
-    fprintf(stderr, "ERROR INITIALIZING MASTER BLOCK\n");
-  }
-
-  //Makes the first inode correspond to the root directory
-  if(initialize_first_inode() == -1){
-    fprintf(stderr, "ERROR INITIALIZING FIRST INODE\n");
-  }
-
-  if(initialize_other_inodes() == -1){
-    fprintf(stderr, "ERROR INITIALIZING OTHER INODES\n");
+  //zformat -d: deduplicate file data blocks
+  int features = 0;
+  int arg = 1;
+  if(arg < argc && strcmp(argv[arg], "-d") == 0){
+    features |= MASTER_FEATURE_DEDUP;
+    ++arg;
   }
-
-  //Makes first data block an empty directory, with '.' and '..' both referring to inode 0
-  if(initialize_first_directory() == -1){
-    fprintf(stderr, "ERROR CREATING FIRST DATA BLOCK\n");
+  //Optional size of the disk, in blocks
+  int n_blocks = N_BLOCKS_IN_DISK;
+  if(arg < argc){
+    n_blocks = atoi(argv[arg++]);
   }
-}
-
-int initialize_disk(){
-    char* cwd = malloc(sizeof(char) * MAX_PATH_LENGTH);
-    char* disk_name = malloc(sizeof(char) * MAX_PATH_LENGTH);
-    oufs_get_environment(cwd, disk_name);
-
-    // Creates a virtual disk with name 'vdisk1'
-    if(vdisk_disk_open(disk_name) != 0)
-      return -1;
-
-    free(cwd);
-    free(disk_name);
-
-    // Steps through all bytes in disk and sets to 0
-    for(int num_block = 0; num_block < N_BLOCKS_IN_DISK; ++num_block){ //Steps through each block
-      BLOCK block;
-      for(int byte = 0; byte < BLOCK_SIZE; ++byte){ //Steps through each byte in the block
-        block.data.data[byte] = 0; //Sets the byte to 0
-      }
-      if(vdisk_write_block(num_block, &block) != 0){ //Writes the block to the disk
-        return -1;
-      }
-    }
-  return 0;
-}
-
-int initalize_master_block(){
-      BLOCK masterBlock;
-      for(int i = 0; i <= N_INODE_BLOCKS + 1; ++i){ // Steps through master block, inode blocks, and first data block
-        //https://stackoverflow.com/questions/6848617/memory-efficient-flag-array-in-c
-        masterBlock.master.block_allocated_flag[i/8] |= (1 << (i % 8)); //Marks corresponding bits as allocated
-      }
-      masterBlock.master.inode_allocated_flag[0] |= (1 << (0)); //Marks first inode as allocated
-      if(vdisk_write_block(0, &masterBlock) != 0){ //Writes the block to the disk
-        return -1;
-      }
-
-  return 0;
-}
-
-int initialize_first_inode(){
-    //Creates an inode
-    INODE firstInode;
-    firstInode.type = IT_DIRECTORY; //with type directory
-    firstInode.n_references = 1; //with one reference
-    firstInode.data[0] = N_INODE_BLOCKS + 1; //points to the first data block, which is after all inode blocks
-    for(int i = 1; i < BLOCKS_PER_INODE; ++i){
-        firstInode.data[i] = UNALLOCATED_BLOCK; //All other block are unallocated in this inode
-    }
-    firstInode.size = 2; //Size of this inode is 2, for '.' and '..'
-
-    BLOCK firstInodeBlock;
-    firstInodeBlock.inodes.inode[0] = firstInode; //Assigns this inode to an inode block
-
-    if(vdisk_write_block(1, &firstInodeBlock) != 0){ //Writes the inode block to block 1, the first block after master
-      return -1;
-    }
-
-    return 0;
-}
-
-//Marks all inodes other than the first one as type: IT_NONE, n_references: 0, all data blocks: UNALLOCATED_BLOCK, size: 0
-int initialize_other_inodes(){
-  //Steps through all inodes other than first one
-  for(int i = 1; i < N_INODES; ++i){
-    INODE inode;
-    oufs_read_inode_by_reference(i, &inode); //Loads inode
-    inode.type = IT_NONE; //Sets type
-    inode.n_references = 0;
-    for(int j = 0; j < BLOCKS_PER_INODE; ++j)//Steps through all data blocks
-      inode.data[j] = UNALLOCATED_BLOCK; //Sets each as UNALLOCATED
-    inode.size = 0;
-    oufs_write_inode_by_reference(i, &inode); //Writes inode to disk
+  if(arg != argc || n_blocks < OUFS_MIN_BLOCKS || n_blocks > N_BLOCKS_IN_DISK){
+    fprintf(stderr, "Usage: zformat [-d] [n_blocks]\n");
+    fprintf(stderr, "       (n_blocks: %d to %d, default %d)\n", OUFS_MIN_BLOCKS, N_BLOCKS_IN_DISK, N_BLOCKS_IN_DISK);
+    return 1;
   }
-}
-
-// This function is basically the same as 'oufs_clean_directory_block', but it's working
-// and I do not want to change it.
-int initialize_first_directory(){
-
-  //Creates the current directory
-  DIRECTORY_ENTRY currentDir;
-  char* curDirName = "."; //name of '.'
-  strcpy(currentDir.name, curDirName); //Assigns the name to the directory entry
-  currentDir.inode_reference = 0; //This directory references the first inode(index 0)
 
-  //Creates the parent directory
-  DIRECTORY_ENTRY parentDir;
-  char* parentDirName = ".."; //name of '..'
-  strcpy(parentDir.name, parentDirName); //Assigns the name to the directory entry
-  parentDir.inode_reference = 0; //This directory still references the first inode(index 0)
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
 
-  //Adds both of these directories to a block
-  BLOCK directoryBlock;
-  directoryBlock.directory.entry[0] = currentDir;
-  directoryBlock.directory.entry[1] = parentDir;
-
-  //Marks the rest of the directories in this block as UNALLOCATED_INODE
-  for(int i = 2; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i){
-    directoryBlock.directory.entry[i].inode_reference = UNALLOCATED_INODE;
-  }
-
-  //Writes this block to the disk
-  if(vdisk_write_block(N_INODE_BLOCKS + 1, &directoryBlock) != 0){
-    return -1;
+  //Zeros the disk, then writes the master block, the inodes and the root directory
+  if(oufs_format_disk(disk_name, features, n_blocks) != 0){
+    fprintf(stderr, "ERROR FORMATTING DISK\n");
+    return 1;
   }
-
   return 0;
 }
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * All of the tools in one program
+ *
+ * The tool is picked from the name the program was run under (a link named
+ * zmkdir runs zmkdir) or, when run as zfs, from the first argument
+ * ("zfs mkdir /a", or "zfs zmkdir /a").  The makefile builds every tool's
+ * source with its main() renamed to <tool>_main; the tools run unchanged,
+ * each doing its own (single) disk open.
+ */
+
+typedef struct zfs_tool_s
+{
+  const char *name;
+  int (*run)(int argc, char **argv);
+} ZFS_TOOL;
+
+int zformat_main(int argc, char **argv);
+int zfilez_main(int argc, char **argv);
+int zinspect_main(int argc, char **argv);
+int zmkdir_main(int argc, char **argv);
+int zrmdir_main(int argc, char **argv);
+int ztouch_main(int argc, char **argv);
+int zappend_main(int argc, char **argv);
+int zcreate_main(int argc, char **argv);
+int zmore_main(int argc, char **argv);
+int zlink_main(int argc, char **argv);
+int zremove_main(int argc, char **argv);
+int zfallocate_main(int argc, char **argv);
+int zrm_main(int argc, char **argv);
+int zcp_main(int argc, char **argv);
+int zmv_main(int argc, char **argv);
+int zclone_main(int argc, char **argv);
+int zsnapshot_main(int argc, char **argv);
+int zfsck_main(int argc, char **argv);
+int zdefrag_main(int argc, char **argv);
+int zresize_main(int argc, char **argv);
+int zstat_main(int argc, char **argv);
+int zdu_main(int argc, char **argv);
+int zworkload_main(int argc, char **argv);
+
+static const ZFS_TOOL zfs_tools[] = {
+  { "zformat", zformat_main },
+  { "zfilez", zfilez_main },
+  { "zinspect", zinspect_main },
+  { "zmkdir", zmkdir_main },
+  { "zrmdir", zrmdir_main },
+  { "ztouch", ztouch_main },
+  { "zappend", zappend_main },
+  { "zcreate", zcreate_main },
+  { "zmore", zmore_main },
+  { "zlink", zlink_main },
+  { "zremove", zremove_main },
+  { "zfallocate", zfallocate_main },
+  { "zrm", zrm_main },
+  { "zcp", zcp_main },
+  { "zmv", zmv_main },
+  { "zclone", zclone_main },
+  { "zsnapshot", zsnapshot_main },
+  { "zfsck", zfsck_main },
+  { "zdefrag", zdefrag_main },
+  { "zresize", zresize_main },
+  { "zstat", zstat_main },
+  { "zdu", zdu_main },
+  { "zworkload", zworkload_main },
+};
+
+#define ZFS_N_TOOLS (sizeof(zfs_tools) / sizeof(zfs_tools[0]))
+
+// The tool called name (or name without its leading z, when short_name is set);
+// NULL if there is none
+static const ZFS_TOOL *zfs_find(const char *name, int short_name)
+{
+  for(unsigned int t = 0; t < ZFS_N_TOOLS; ++t) {
+    if(strcmp(name, zfs_tools[t].name) == 0 ||
+       (short_name && strcmp(name, zfs_tools[t].name + 1) == 0))
+      return &zfs_tools[t];
+  }
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  // Run under the name of a tool?  (Only the full name: a link called rm
+  // must not run zrm)
+  const char *name = strrchr(argv[0], '/');
+  name = name != NULL ? name + 1 : argv[0];
+  const ZFS_TOOL *tool = zfs_find(name, 0);
+
+  // Otherwise the tool is the first argument, and sees itself as argv[0]
+  if(tool == NULL && argc >= 2) {
+    tool = zfs_find(argv[1], 1);
+    ++argv;
+    --argc;
+  }
+  if(tool == NULL) {
+    fprintf(stderr, "Usage: zfs <tool> [<arguments>], or run through a link named after the tool\n");
+    fprintf(stderr, "Tools:");
+    for(unsigned int t = 0; t < ZFS_N_TOOLS; ++t)
+      fprintf(stderr, " %s", zfs_tools[t].name + 1);
+    fprintf(stderr, "\n");
+    return(1);
+  }
+  return(tool->run(argc, argv));
+}
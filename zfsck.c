@@ -0,0 +1,498 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "oufs_lib.h"
+
+/*
+ * File system checker.
+ *
+ * 1. The master block and all of the inode blocks are read in one batch.
+ * 2. The directory tree is walked from the root.  Each subdirectory of the
+ *    root is a separate task, and the tasks are shared out between threads;
+ *    every directory's blocks are read in one batch.  The walk only looks:
+ *    it counts the names of every inode and queues the entries to repair.
+ * 3. Inodes are checked against what the walk found (n_references, size,
+ *    block references), and every block reference of the live inodes and of
+ *    the snapshots is counted.
+ * 4. The inode and block tables, and the block reference counts, are
+ *    rebuilt from those counts and compared with the ones on the disk.
+ *
+ * Repairs are written back at the end, unless -n was given.
+ */
+
+// Upper bound on the number of checker threads
+#define FSCK_MAX_THREADS 8
+
+// A directory entry that the walk found to be wrong
+typedef struct fsck_fix_s
+{
+  INODE_REFERENCE dir;
+  int block_index;
+  // -1: the block is only rewritten, to give contents that were checked a
+  // new checksum
+  int entry_index;
+  // Replacement for the entry's inode reference (UNALLOCATED_INODE: clear it)
+  INODE_REFERENCE inode_reference;
+} FSCK_FIX;
+
+// Everything that the checker knows about the disk
+static struct
+{
+  int repair;
+  BLOCK master;
+  BLOCK inode_blocks[N_INODE_BLOCKS];
+  int inode_blocks_dirty;
+
+  // Filled in by the walk (updated atomically by the threads)
+  // Number of directory entries (other than "." and "..") naming each inode
+  unsigned int links[N_INODES];
+  // Set once a directory has been walked
+  unsigned char walked[N_INODES];
+  // Number of valid entries found in each directory (including "." and "..")
+  unsigned int entries[N_INODES];
+
+  // Entries to repair, collected under fix_lock
+  pthread_mutex_t fix_lock;
+  FSCK_FIX fixes[N_INODES * BLOCKS_PER_INODE * DIRECTORY_ENTRIES_PER_BLOCK];
+  int n_fixes;
+
+  // Work queue for the threads: subdirectories of the root
+  INODE_REFERENCE tasks[N_INODES];
+  int n_tasks;
+  int next_task;
+
+  // Number of references to each block, from live inodes and snapshots
+  unsigned int block_refs[N_BLOCKS_IN_DISK];
+
+  int problems;
+} fsck;
+
+// Report a problem (one line on stdout)
+static void fsck_problem(const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  flockfile(stdout);
+  vprintf(format, args);
+  printf("\n");
+  funlockfile(stdout);
+  va_end(args);
+  __atomic_add_fetch(&fsck.problems, 1, __ATOMIC_RELAXED);
+}
+
+// Inode i, in the inode blocks loaded by the checker
+static INODE *fsck_inode(INODE_REFERENCE i)
+{
+  return &fsck.inode_blocks[i / INODES_PER_BLOCK].inodes.inode[i % INODES_PER_BLOCK];
+}
+
+// Is block_ref somewhere a file or a directory may keep its data?
+static int fsck_is_data_block(BLOCK_REFERENCE block_ref)
+{
+  if(block_ref <= N_INODE_BLOCKS || block_ref >= oufs_disk_blocks(&fsck.master))
+    return 0;
+  if(oufs_master_has_ext(&fsck.master) && block_ref == fsck.master.master_ext.snapshot_table)
+    return 0;
+  return 1;
+}
+
+// Is type one that an inode in a directory may have?
+static int fsck_is_valid_type(char type)
+{
+  return type == IT_DIRECTORY || type == IT_FILE || type == IT_INLINE_FILE ||
+         type == IT_COMPRESSED_FILE;
+}
+
+// Queue a repair of a directory entry
+static void fsck_queue_fix(INODE_REFERENCE dir, int block_index, int entry_index,
+                           INODE_REFERENCE inode_reference)
+{
+  pthread_mutex_lock(&fsck.fix_lock);
+  FSCK_FIX *fix = &fsck.fixes[fsck.n_fixes++];
+  fix->dir = dir;
+  fix->block_index = block_index;
+  fix->entry_index = entry_index;
+  fix->inode_reference = inode_reference;
+  pthread_mutex_unlock(&fsck.fix_lock);
+}
+
+/**
+ * Walk directory dir and everything below it
+ *
+ * @param dir The directory (already claimed in fsck.walked)
+ * @param parent The directory that holds it
+ * @param subdirs If not NULL, subdirectories are added here instead of being
+ * walked (used to split the root into tasks)
+ */
+static void fsck_walk(INODE_REFERENCE dir, INODE_REFERENCE parent,
+                      INODE_REFERENCE *subdirs, int *n_subdirs)
+{
+  INODE inode = *fsck_inode(dir);
+
+  // All of the directory's blocks in one read
+  BLOCK_REFERENCE refs[BLOCKS_PER_INODE];
+  int indices[BLOCKS_PER_INODE];
+  int n_refs = 0;
+  for(int i = 0; i < BLOCKS_PER_INODE; ++i) {
+    if(inode.data[i] != UNALLOCATED_BLOCK && fsck_is_data_block(inode.data[i])) {
+      refs[n_refs] = inode.data[i];
+      indices[n_refs++] = i;
+    }
+  }
+  BLOCK blocks[BLOCKS_PER_INODE];
+  if(vdisk_read_blocks(refs, n_refs, blocks) != 0) {
+    // The entries are still checked one by one below
+    fsck_problem("Directory %d: checksum mismatch", dir);
+    for(int b = 0; b < n_refs; ++b)
+      fsck_queue_fix(dir, indices[b], -1, UNALLOCATED_INODE);
+  }
+
+  unsigned int n_entries = 0;
+  for(int b = 0; b < n_refs; ++b) {
+    for(int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j) {
+      DIRECTORY_ENTRY *e = &blocks[b].directory.entry[j];
+      INODE_REFERENCE child = e->inode_reference;
+      if(child == UNALLOCATED_INODE)
+        continue;
+
+      if(memchr(e->name, 0, FILE_NAME_SIZE) == NULL || e->name[0] == 0) {
+        fsck_problem("Directory %d: entry %d has a bad name", dir, indices[b] * DIRECTORY_ENTRIES_PER_BLOCK + j);
+        fsck_queue_fix(dir, indices[b], j, UNALLOCATED_INODE);
+        continue;
+      }
+
+      // "." and ".." must point at the directory and at its parent
+      if(!strcmp(e->name, ".") || !strcmp(e->name, "..")) {
+        INODE_REFERENCE expected = (e->name[1] == 0) ? dir : parent;
+        if(child != expected) {
+          fsck_problem("Directory %d: \"%s\" refers to inode %d instead of %d", dir, e->name, child, expected);
+          fsck_queue_fix(dir, indices[b], j, expected);
+        }
+        ++n_entries;
+        continue;
+      }
+
+      if(child >= N_INODES || !fsck_is_valid_type(fsck_inode(child)->type)) {
+        fsck_problem("Directory %d: \"%s\" refers to a free or invalid inode (%d)", dir, e->name, child);
+        fsck_queue_fix(dir, indices[b], j, UNALLOCATED_INODE);
+        continue;
+      }
+
+      if(fsck_inode(child)->type == IT_DIRECTORY) {
+        // A directory has exactly one name (and the root has none)
+        if(child == 0 || __atomic_exchange_n(&fsck.walked[child], 1, __ATOMIC_ACQ_REL)) {
+          fsck_problem("Directory %d: \"%s\" is a second name for directory %d", dir, e->name, child);
+          fsck_queue_fix(dir, indices[b], j, UNALLOCATED_INODE);
+          continue;
+        }
+        __atomic_add_fetch(&fsck.links[child], 1, __ATOMIC_RELAXED);
+        ++n_entries;
+        if(subdirs != NULL) {
+          subdirs[(*n_subdirs)++] = child;
+          continue;
+        }
+        // The parent of child's ".." is dir: remember it in the call
+        fsck_walk(child, dir, NULL, NULL);
+        continue;
+      }
+
+      __atomic_add_fetch(&fsck.links[child], 1, __ATOMIC_RELAXED);
+      ++n_entries;
+    }
+  }
+  fsck.entries[dir] = n_entries;
+}
+
+// Thread body: walk subdirectories of the root until none are left
+static void *fsck_worker(void *arg)
+{
+  for(;;) {
+    int task = __atomic_fetch_add(&fsck.next_task, 1, __ATOMIC_RELAXED);
+    if(task >= fsck.n_tasks)
+      return NULL;
+    fsck_walk(fsck.tasks[task], 0, NULL, NULL);
+  }
+}
+
+// Count a reference to a block
+static void fsck_count_block(BLOCK_REFERENCE block_ref)
+{
+  if(block_ref < N_BLOCKS_IN_DISK)
+    ++fsck.block_refs[block_ref];
+}
+
+// Check the block references and the size of a live inode, and count them
+static void fsck_check_inode(INODE_REFERENCE i)
+{
+  INODE *inode = fsck_inode(i);
+  unsigned int expected_links = (inode->type == IT_DIRECTORY || i == 0) ? 1 : fsck.links[i];
+  if(inode->n_references != expected_links) {
+    fsck_problem("Inode %d: %d references recorded, %d found", i, inode->n_references, expected_links);
+    inode->n_references = expected_links;
+    fsck.inode_blocks_dirty = 1;
+  }
+
+  unsigned int max_size = BLOCKS_PER_INODE * BLOCK_SIZE;
+  if(inode->type == IT_INLINE_FILE)
+    max_size = INLINE_DATA_SIZE;
+  if(inode->type != IT_DIRECTORY && inode->size > max_size) {
+    fsck_problem("Inode %d: size %u is too large", i, inode->size);
+    inode->size = max_size;
+    fsck.inode_blocks_dirty = 1;
+  }
+  if(inode->type == IT_DIRECTORY && inode->size != fsck.entries[i]) {
+    fsck_problem("Directory %d: size %u, but %u entries", i, inode->size, fsck.entries[i]);
+    inode->size = fsck.entries[i];
+    fsck.inode_blocks_dirty = 1;
+  }
+  if(inode->type == IT_INLINE_FILE)
+    return; // data[] holds the file, not block references
+
+  // Blocks past the end of a plain file cannot be reached
+  int n_blocks = BLOCKS_PER_INODE;
+  if(inode->type == IT_FILE)
+    n_blocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  for(int j = 0; j < BLOCKS_PER_INODE; ++j) {
+    BLOCK_REFERENCE b = inode->data[j];
+    if(b == UNALLOCATED_BLOCK)
+      continue;
+    if(!fsck_is_data_block(b) || j >= n_blocks) {
+      fsck_problem("Inode %d: block %d (entry %d) is %s", i, b, j,
+                   j >= n_blocks ? "past the end of the file" : "not a data block");
+      inode->data[j] = UNALLOCATED_BLOCK;
+      fsck.inode_blocks_dirty = 1;
+      continue;
+    }
+    fsck_count_block(b);
+  }
+
+  if(inode->type == IT_COMPRESSED_FILE) {
+    unsigned char contents[BLOCKS_PER_INODE * BLOCK_SIZE];
+    if(oufs_read_compressed(&fsck.master, inode, contents) != 0)
+      fsck_problem("Inode %d: compressed data is damaged", i);
+  }
+}
+
+// Count the blocks that the snapshots hold
+static void fsck_count_snapshots()
+{
+  if(!oufs_master_has_ext(&fsck.master) || fsck.master.master_ext.snapshot_table == 0)
+    return;
+  BLOCK table;
+  vdisk_read_block(fsck.master.master_ext.snapshot_table, &table);
+  for(int s = 0; s < SNAPSHOTS_PER_BLOCK; ++s) {
+    SNAPSHOT_ENTRY *e = &table.snapshots.entry[s];
+    if(e->name[0] == 0)
+      continue;
+    fsck_count_block(e->master);
+    BLOCK saved[N_INODE_BLOCKS];
+    vdisk_read_blocks(e->inode_blocks, N_INODE_BLOCKS, saved);
+    for(int b = 0; b < N_INODE_BLOCKS; ++b) {
+      fsck_count_block(e->inode_blocks[b]);
+      for(int i = 0; i < INODES_PER_BLOCK; ++i) {
+        INODE *inode = &saved[b].inodes.inode[i];
+        if(inode->type != IT_FILE && inode->type != IT_DIRECTORY &&
+           inode->type != IT_COMPRESSED_FILE)
+          continue;
+        for(int j = 0; j < BLOCKS_PER_INODE; ++j)
+          if(inode->data[j] != UNALLOCATED_BLOCK && fsck_is_data_block(inode->data[j]))
+            fsck_count_block(inode->data[j]);
+      }
+    }
+  }
+}
+
+// Apply the queued directory entry repairs
+static void fsck_apply_fixes()
+{
+  for(int f = 0; f < fsck.n_fixes; ++f) {
+    FSCK_FIX *fix = &fsck.fixes[f];
+    INODE *dir = fsck_inode(fix->dir);
+    BLOCK block;
+    vdisk_read_block(dir->data[fix->block_index], &block);
+    if(fix->entry_index >= 0) {
+      DIRECTORY_ENTRY *e = &block.directory.entry[fix->entry_index];
+      if(fix->inode_reference == UNALLOCATED_INODE)
+        oufs_clean_directory_entry(e);
+      else
+        e->inode_reference = fix->inode_reference;
+    }
+
+    // A block that a snapshot also uses moves to a block nothing uses
+    BLOCK_REFERENCE b = dir->data[fix->block_index];
+    if(fsck.block_refs[b] > 1) {
+      BLOCK_REFERENCE copy;
+      for(copy = 0; copy < N_BLOCKS_IN_DISK; ++copy)
+        if(fsck_is_data_block(copy) && fsck.block_refs[copy] == 0)
+          break;
+      if(copy == N_BLOCKS_IN_DISK) {
+        fsck_problem("Directory %d: no free block to repair a shared block", fix->dir);
+        continue;
+      }
+      --fsck.block_refs[b];
+      fsck.block_refs[copy] = 1;
+      dir->data[fix->block_index] = copy;
+      fsck.inode_blocks_dirty = 1;
+    }
+    vdisk_write_block(dir->data[fix->block_index], &block);
+  }
+}
+
+// Compare the master block tables with what was found, and rebuild them
+static int fsck_rebuild_master(unsigned char *reachable)
+{
+  BLOCK rebuilt = fsck.master;
+  int has_ext = oufs_master_has_ext(&rebuilt);
+  memset(rebuilt.master.inode_allocated_flag, 0, sizeof(rebuilt.master.inode_allocated_flag));
+  memset(rebuilt.master.block_allocated_flag, 0, sizeof(rebuilt.master.block_allocated_flag));
+
+  for(int i = 0; i < N_INODES; ++i) {
+    if(reachable[i])
+      rebuilt.master.inode_allocated_flag[i >> 3] |= (1 << (i & 7));
+  }
+  for(int b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+    int used = (fsck.block_refs[b] > 0 || !fsck_is_data_block(b));
+    if(used)
+      rebuilt.master.block_allocated_flag[b >> 3] |= (1 << (b & 7));
+    if(!has_ext)
+      continue;
+    if(!used) {
+      rebuilt.master_ext.block_unwritten_flag[b >> 3] &= ~(1 << (b & 7));
+      rebuilt.master_ext.block_dedup_flag[b >> 3] &= ~(1 << (b & 7));
+    }
+    unsigned int extra = fsck.block_refs[b] > 1 ? fsck.block_refs[b] - 1 : 0;
+    if(extra > UCHAR_MAX)
+      extra = UCHAR_MAX;
+    if(rebuilt.master_ext.block_extra_refs[b] != extra) {
+      fsck_problem("Block %d: %d extra references recorded, %u found", b,
+                   rebuilt.master_ext.block_extra_refs[b], extra);
+      rebuilt.master_ext.block_extra_refs[b] = extra;
+    }
+  }
+
+  for(int i = 0; i < N_INODES; ++i) {
+    int was = (fsck.master.master.inode_allocated_flag[i >> 3] >> (i & 7)) & 1;
+    if(was != reachable[i])
+      fsck_problem("Inode %d: marked %s in the inode table", i, was ? "in use, but is free" : "free, but is in use");
+  }
+  for(int b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+    int was = (fsck.master.master.block_allocated_flag[b >> 3] >> (b & 7)) & 1;
+    int is = (rebuilt.master.block_allocated_flag[b >> 3] >> (b & 7)) & 1;
+    if(was != is)
+      fsck_problem("Block %d: marked %s in the block table", b, was ? "in use, but is free" : "free, but is in use");
+  }
+
+  int changed = memcmp(&rebuilt, &fsck.master, sizeof(rebuilt)) != 0;
+  fsck.master = rebuilt;
+  return changed;
+}
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  // Check arguments
+  fsck.repair = 1;
+  if(argc == 2 && strcmp(argv[1], "-n") == 0) {
+    fsck.repair = 0;
+  }else if(argc != 1) {
+    fprintf(stderr, "Usage: zfsck [-n]\n");
+    return(2);
+  }
+
+  // Open the virtual disk.  A repair also rebuilds a missing or damaged
+  // checksum table: the checks below then vouch for what the blocks hold
+  if((fsck.repair ? vdisk_disk_open_rebuild(disk_name) : vdisk_disk_open(disk_name)) != 0)
+    return(2);
+
+  // The master block and all of the inode blocks, in one read
+  BLOCK_REFERENCE refs[1 + N_INODE_BLOCKS];
+  BLOCK blocks[1 + N_INODE_BLOCKS];
+  for(int b = 0; b <= N_INODE_BLOCKS; ++b)
+    refs[b] = b;
+  int master_changed = 0;
+  if(vdisk_read_blocks(refs, 1 + N_INODE_BLOCKS, blocks) != 0) {
+    // Rewritten at the end with new checksums, once they have been checked
+    fsck_problem("Master or inode blocks: checksum mismatch");
+    fsck.inode_blocks_dirty = 1;
+    master_changed = 1;
+  }
+  fsck.master = blocks[0];
+  memcpy(fsck.inode_blocks, blocks + 1, sizeof(fsck.inode_blocks));
+  pthread_mutex_init(&fsck.fix_lock, NULL);
+
+  if(fsck_inode(0)->type != IT_DIRECTORY) {
+    printf("Inode 0 is not the root directory: cannot check this disk\n");
+    vdisk_disk_close();
+    return(2);
+  }
+
+  // The root directory here; its subdirectories on the threads
+  fsck.walked[0] = 1;
+  fsck_walk(0, 0, fsck.tasks, &fsck.n_tasks);
+  long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int n_threads = MIN(MIN(fsck.n_tasks, FSCK_MAX_THREADS), (int) MAX(n_cpus, 1));
+  pthread_t threads[FSCK_MAX_THREADS];
+  for(int t = 0; t < n_threads; ++t)
+    pthread_create(&threads[t], NULL, fsck_worker, NULL);
+  if(n_threads == 0)
+    fsck_worker(NULL); // Nothing to share out
+  for(int t = 0; t < n_threads; ++t)
+    pthread_join(threads[t], NULL);
+
+  // Inodes: the ones the walk reached are in use; the others are freed
+  unsigned char reachable[N_INODES];
+  for(int i = 0; i < N_INODES; ++i) {
+    INODE *inode = fsck_inode(i);
+    reachable[i] = (i == 0 || fsck.links[i] > 0);
+    if(reachable[i])
+      continue;
+    if(inode->type != IT_NONE) {
+      fsck_problem("Inode %d: in use (type %c) but not in any directory", i, inode->type);
+      inode->type = IT_NONE;
+      inode->n_references = 0;
+      for(int j = 0; j < BLOCKS_PER_INODE; ++j)
+        inode->data[j] = UNALLOCATED_BLOCK;
+      inode->size = 0;
+      fsck.inode_blocks_dirty = 1;
+    }
+  }
+  for(int i = 0; i < N_INODES; ++i)
+    if(reachable[i])
+      fsck_check_inode(i);
+  fsck_count_snapshots();
+
+  if(fsck.repair)
+    fsck_apply_fixes();
+  master_changed |= fsck_rebuild_master(reachable);
+
+  if(fsck.repair) {
+    if(fsck.inode_blocks_dirty)
+      for(int b = 0; b < N_INODE_BLOCKS; ++b)
+        vdisk_write_block(b + 1, &fsck.inode_blocks[b]);
+    if(master_changed)
+      vdisk_write_block(MASTER_BLOCK_REFERENCE, &fsck.master);
+  }
+
+  int n_inodes = 0;
+  int n_blocks = 0;
+  for(int i = 0; i < N_INODES; ++i)
+    n_inodes += reachable[i];
+  for(int b = 0; b < oufs_disk_blocks(&fsck.master); ++b)
+    n_blocks += (fsck.master.master.block_allocated_flag[b >> 3] >> (b & 7)) & 1;
+
+  if(fsck.problems == 0)
+    printf("zfsck: clean, %d inodes, %d blocks in use\n", n_inodes, n_blocks);
+  else
+    printf("zfsck: %d problems %s, %d inodes, %d blocks in use\n", fsck.problems,
+           fsck.repair ? "fixed" : "found", n_inodes, n_blocks);
+
+  // Clean up
+  vdisk_disk_close();
+  return(fsck.problems == 0 ? 0 : 1);
+}
@@ -31,6 +31,18 @@ int main(int argc, char** argv) {
 	}
       }
 
+    }else if(strncmp(argv[1], "-stats", 7) == 0) {
+      // I/O statistics gathered in ZSTATS_FILE
+      char *path = getenv("ZSTATS_FILE");
+      VDISK_STATS stats;
+      if(path == NULL) {
+	fprintf(stderr, "ZSTATS_FILE is not set\n");
+      }else if(vdisk_stats_read_file(path, &stats) != 0) {
+	fprintf(stderr, "No statistics in %s\n", path);
+      }else{
+	vdisk_stats_print(stdout, &stats);
+      }
+
     }else{
       fprintf(stderr, "Unknown argument (%s)\n", argv[1]);
     }
@@ -48,8 +60,15 @@ int main(int argc, char** argv) {
 
 	  printf("Inode: %d\n", index);
 	  printf("Type: %c\n", inode.type);
-	  for(int i = 0; i < BLOCKS_PER_INODE; ++i) {
-	    printf("Block %d: %d\n", i, inode.data[i]);
+	  if(inode.type == IT_INLINE_FILE) {
+	    // Contents stored in the inode
+	    printf("Inline data: ");
+	    fwrite(inode.data, 1, MIN(inode.size, INLINE_DATA_SIZE), stdout);
+	    printf("\n");
+	  }else{
+	    for(int i = 0; i < BLOCKS_PER_INODE; ++i) {
+	      printf("Block %d: %d\n", i, inode.data[i]);
+	    }
 	  }
 	  printf("Size: %d\n", inode.size);
 
@@ -70,8 +89,15 @@ int main(int argc, char** argv) {
 	  printf("Inode: %d\n", index);
 	  printf("Type: %c\n", inode.type);
 	  printf("N references: %d\n", inode.n_references);
-	  for(int i = 0; i < BLOCKS_PER_INODE; ++i) {
-	    printf("Block %d: %d\n", i, inode.data[i]);
+	  if(inode.type == IT_INLINE_FILE) {
+	    // Contents stored in the inode
+	    printf("Inline data: ");
+	    fwrite(inode.data, 1, MIN(inode.size, INLINE_DATA_SIZE), stdout);
+	    printf("\n");
+	  }else{
+	    for(int i = 0; i < BLOCKS_PER_INODE; ++i) {
+	      printf("Block %d: %d\n", i, inode.data[i]);
+	    }
 	  }
 	  printf("Size: %d\n", inode.size);
 
@@ -22,10 +22,11 @@ int main(int argc, char** argv) {
     vdisk_disk_open(disk_name);
 
     // Make the specified directory
-    oufs_mkdir(cwd, argv[1]);
+    int ret = oufs_mkdir(cwd, argv[1]);
 
     // Clean up
     vdisk_disk_close();
+    return(ret == 0 ? 0 : 1);
 
   }else{
     // Wrong number of parameters
@@ -19,7 +19,7 @@ int main(int argc, char** argv) {
     oufile = oufs_fopen(cwd, argv[1], 'a');
 
     oufs_fread(oufile, NULL, 0);
-    free(oufile);
+    oufs_fclose(oufile);
 
     // Clean up
     vdisk_disk_close();
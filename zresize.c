@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "oufs_lib.h"
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  // Check arguments
+  if(argc == 1) {
+    // Report the size of the disk
+    vdisk_disk_open(disk_name);
+    BLOCK master;
+    vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
+    int n_blocks = oufs_disk_blocks(&master);
+    int n_free = 0;
+    for(int b = 0; b < n_blocks; ++b)
+      if(!(master.master.block_allocated_flag[b >> 3] & (1 << (b & 7))))
+        ++n_free;
+    printf("%d blocks (%d free)\n", n_blocks, n_free);
+    vdisk_disk_close();
+    return(0);
+
+  }else if(argc == 2) {
+    // Open the virtual disk
+    vdisk_disk_open(disk_name);
+
+    int ret = oufs_resize(atoi(argv[1]));
+
+    // Clean up
+    vdisk_disk_close();
+    return(ret == 0 ? 0 : 1);
+
+  }else{
+    // Wrong number of parameters
+    fprintf(stderr, "Usage: zresize [<n_blocks>]\n");
+    fprintf(stderr, "       (n_blocks: %d to %d; only a disk smaller than %d blocks can grow)\n",
+            OUFS_MIN_BLOCKS, N_BLOCKS_IN_DISK, N_BLOCKS_IN_DISK);
+    return(1);
+  }
+
+}
@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  // Check arguments
+  int ret;
+  if(argc == 2 && strcmp(argv[1], "list") == 0) {
+    vdisk_disk_open(disk_name);
+    ret = oufs_snapshot_list();
+    vdisk_disk_close();
+
+  }else if(argc == 3 && (strcmp(argv[1], "create") == 0 ||
+                         strcmp(argv[1], "rollback") == 0 ||
+                         strcmp(argv[1], "delete") == 0)) {
+    // Open the virtual disk
+    vdisk_disk_open(disk_name);
+
+    if(strcmp(argv[1], "create") == 0)
+      ret = oufs_snapshot_create(argv[2]);
+    else if(strcmp(argv[1], "rollback") == 0)
+      ret = oufs_snapshot_rollback(argv[2]);
+    else
+      ret = oufs_snapshot_delete(argv[2]);
+
+    // Clean up
+    vdisk_disk_close();
+
+  }else{
+    // Wrong number of parameters
+    fprintf(stderr, "Usage: zsnapshot create|rollback|delete <name>\n");
+    fprintf(stderr, "       zsnapshot list\n");
+    return(1);
+  }
+  return(ret == 0 ? 0 : 1);
+
+}
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+/*
+ * Space and fragmentation report
+ *
+ * Everything comes from the master block and the inode blocks: the free and
+ * used counts from the allocation tables, the rest from a scan of the inode
+ * table (oufs_scan_inodes()).  No directory or data block is read.
+ */
+
+// File size histogram: bucket 0 holds empty files, bucket i files of up to
+// 2^(i + 4) bytes; the last bucket holds the largest files the disk can have
+#define SIZE_BUCKETS 9
+
+static int size_bucket(unsigned int size)
+{
+  int bucket = 0;
+  while(size > 0 && bucket < SIZE_BUCKETS - 1) {
+    ++bucket;
+    if(size <= (16u << bucket))
+      break;
+  }
+  return bucket;
+}
+
+// What the scan of the inode table adds up
+typedef struct zstat_s
+{
+  int n_files;
+  int n_inline;
+  int n_linked;
+  int n_fragmented;
+  int total_runs;
+  int most_runs;
+  INODE_REFERENCE most_runs_inode;
+  int size_histogram[SIZE_BUCKETS];
+  int n_dirs;
+  int dir_blocks;
+  int dir_entries;
+  int full_dir_blocks;
+} ZSTAT;
+
+static int zstat_visit(INODE_REFERENCE i, INODE *inode, void *arg)
+{
+  ZSTAT *st = arg;
+  if(inode->type == IT_DIRECTORY) {
+    ++st->n_dirs;
+    for(int b = 0; b < BLOCKS_PER_INODE; ++b)
+      st->dir_blocks += inode->data[b] != UNALLOCATED_BLOCK;
+    st->dir_entries += inode->size;
+    st->full_dir_blocks += (inode->size + DIRECTORY_ENTRIES_PER_BLOCK - 1) /
+      DIRECTORY_ENTRIES_PER_BLOCK;
+  }else if(oufs_is_file(inode)) {
+    ++st->n_files;
+    ++st->size_histogram[size_bucket(inode->size)];
+    if(inode->n_references > 1)
+      ++st->n_linked;
+    if(inode->type == IT_INLINE_FILE) {
+      ++st->n_inline;
+      return 0;
+    }
+    int runs = oufs_inode_runs(inode);
+    st->total_runs += runs;
+    if(runs > 1)
+      ++st->n_fragmented;
+    if(runs > st->most_runs) {
+      st->most_runs = runs;
+      st->most_runs_inode = i;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  if(argc != 1) {
+    fprintf(stderr, "Usage: zstat\n");
+    return(1);
+  }
+
+  // Open the virtual disk
+  if(vdisk_disk_open(disk_name) != 0)
+    return(1);
+
+  BLOCK master_block;
+  ZSTAT st;
+  memset(&st, 0, sizeof(st));
+  int ret = vdisk_read_block(MASTER_BLOCK_REFERENCE, &master_block);
+  if(ret == 0)
+    ret = oufs_scan_inodes(zstat_visit, &st);
+  vdisk_disk_close();
+  if(ret != 0) {
+    fprintf(stderr, "zstat: cannot read the master and inode blocks\n");
+    return(1);
+  }
+  BLOCK *master = &master_block;
+
+  // Space, from the allocation tables.  Blocks beyond the end of a disk
+  // smaller than N_BLOCKS_IN_DISK are marked allocated: leave them out
+  int n_blocks = oufs_disk_blocks(master);
+  int blocks_used = oufs_count_allocated(master->master.block_allocated_flag,
+                                         N_BLOCKS_IN_DISK) -
+    (N_BLOCKS_IN_DISK - n_blocks);
+  int inodes_used = oufs_count_allocated(master->master.inode_allocated_flag,
+                                         N_INODES);
+  printf("blocks: %d used, %d free of %d (%d%% used)\n", blocks_used,
+         n_blocks - blocks_used, n_blocks, 100 * blocks_used / n_blocks);
+  printf("inodes: %d used, %d free of %d (%d%% used)\n", inodes_used,
+         (int) N_INODES - inodes_used, (int) N_INODES,
+         100 * inodes_used / (int) N_INODES);
+
+  printf("files: %d (%d inline, %d with several names), %d fragmented", st.n_files,
+         st.n_inline, st.n_linked, st.n_fragmented);
+  if(st.n_files > st.n_inline)
+    printf(", %.2f runs per file, most %d (inode %d)",
+           (double) st.total_runs / (st.n_files - st.n_inline), st.most_runs,
+           st.most_runs_inode);
+  printf("\n");
+  printf("file sizes:\n");
+  for(int b = 0; b < SIZE_BUCKETS; ++b) {
+    if(b == 0) {
+      printf("  %13s", "0");
+    }else{
+      unsigned int low = b == 1 ? 1 : (16u << (b - 1)) + 1;
+      unsigned int high = b == SIZE_BUCKETS - 1 ? BLOCKS_PER_INODE * BLOCK_SIZE : 16u << b;
+      printf("  %6u - %-4u", low, high);
+    }
+    printf(" %5d\n", st.size_histogram[b]);
+  }
+
+  // Occupancy: the entries in use against the room in the directory blocks,
+  // and the blocks the entries would need if they were packed
+  printf("directories: %d, %d blocks", st.n_dirs, st.dir_blocks);
+  if(st.dir_blocks > 0)
+    printf(", %d of %d entries used (%d%%), %d blocks when packed", st.dir_entries,
+           (int) (st.dir_blocks * DIRECTORY_ENTRIES_PER_BLOCK),
+           (int) (100 * st.dir_entries / (st.dir_blocks * DIRECTORY_ENTRIES_PER_BLOCK)),
+           st.full_dir_blocks);
+  printf("\n");
+  return(0);
+
+}
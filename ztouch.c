@@ -17,7 +17,11 @@ int main(int argc, char** argv) {
     // Make the specified directory
     OUFILE* oufile = malloc(sizeof(*oufile));
     oufile = oufs_fopen(cwd, argv[1], 't');
-    free(oufile);
+    if(oufile == NULL){
+      vdisk_disk_close();
+      return(1);
+    }
+    oufs_fclose(oufile);
 
     // Clean up
     vdisk_disk_close();
@@ -0,0 +1,463 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "oufs_lib.h"
+
+/*
+ * Workload generator and replay harness
+ *
+ * zworkload gen writes a trace: a seeded, reproducible mix of operations on
+ * files spread over a number of directories.  zworkload replay runs a trace
+ * against the disk through the library and reports throughput, latency per
+ * kind of operation, and the fragmentation and space usage it leaves behind.
+ *
+ * Trace format (one operation per line; lines starting with # are comments):
+ *   mkdir <path>
+ *   create <path> <bytes>
+ *   append <path> <bytes>
+ *   read <path>
+ *   remove <path>
+ *   link <existing path> <new path>
+ */
+
+// Kinds of operations
+#define OP_MKDIR 0
+#define OP_CREATE 1
+#define OP_APPEND 2
+#define OP_READ 3
+#define OP_REMOVE 4
+#define OP_LINK 5
+#define N_OPS 6
+
+static const char *op_names[N_OPS] = {
+  "mkdir", "create", "append", "read", "remove", "link"
+};
+
+// Largest file the disk can hold
+#define MAX_FILE_SIZE (BLOCKS_PER_INODE * BLOCK_SIZE)
+
+// Names in one directory: directories never grow past the one block they
+// are made with, less "." and ".."
+#define MAX_NAMES_PER_DIR (DIRECTORY_ENTRIES_PER_BLOCK - 2)
+
+/**********************************************************************/
+// Generator
+
+// xorshift64*: the same sequence for a seed on every platform
+static unsigned long long rng_state;
+
+static unsigned long long rng_next()
+{
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+// Uniform in [0, n)
+static int rng_below(int n)
+{
+  return (int) (rng_next() % n);
+}
+
+// File size between min and max bytes, roughly log-uniform: each doubling of
+// the size is as likely as the others, so small files are common and large
+// ones are not rare
+static int rng_size(int min, int max)
+{
+  int octaves = 0;
+  while((min << (octaves + 1)) <= max)
+    ++octaves;
+  int k = rng_below(octaves + 1);
+  int lo = min << k;
+  int hi = MIN(max, (min << (k + 1)) - 1);
+  return lo + rng_below(hi - lo + 1);
+}
+
+// What the generator knows about the file system it is describing
+typedef struct gen_name_s
+{
+  char path[MAX_PATH_LENGTH];
+  int dir;
+  int file;
+} GEN_NAME;
+
+typedef struct gen_file_s
+{
+  int size;
+  int n_names;
+} GEN_FILE;
+
+static GEN_NAME names[N_INODES];
+static int n_names;
+static GEN_FILE files[N_INODES];
+static int dir_names[N_INODES];
+
+// Blocks that the files would take
+static int gen_blocks_used()
+{
+  int blocks = 0;
+  for(int f = 0; f < N_INODES; ++f) {
+    if(files[f].n_names > 0 && files[f].size > INLINE_DATA_SIZE)
+      blocks += (files[f].size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  }
+  return blocks;
+}
+
+// A new name in a directory that has room for one; -1 if there is none
+static int gen_new_name(int n_dirs, int *serial)
+{
+  if(n_names == N_INODES)
+    return -1;
+  int dir = rng_below(n_dirs);
+  for(int tries = 0; tries < n_dirs && dir_names[dir] == MAX_NAMES_PER_DIR; ++tries)
+    dir = (dir + 1) % n_dirs;
+  if(dir_names[dir] == MAX_NAMES_PER_DIR)
+    return -1;
+  GEN_NAME *name = &names[n_names];
+  sprintf(name->path, "/d%d/f%d", dir, (*serial)++);
+  name->dir = dir;
+  ++dir_names[dir];
+  return n_names++;
+}
+
+// Forget a name (and the file, when it was its last)
+static void gen_drop_name(int n)
+{
+  --dir_names[names[n].dir];
+  --files[names[n].file].n_names;
+  names[n] = names[--n_names];
+}
+
+/**
+ * Write a trace to stdout
+ *
+ * @param seed Seed of the random sequence
+ * @param n_ops Number of file operations (the mkdirs come on top)
+ * @param mix Relative weights of create, append, read, remove and link
+ * @param n_dirs Number of directories the files are spread over
+ * @param min_size Smallest file or append size, in bytes
+ * @param max_size Largest file or append size, in bytes
+ * @param budget Most blocks the files may take together
+ */
+static void gen_trace(unsigned long long seed, int n_ops, int *mix, int n_dirs,
+                      int min_size, int max_size, int budget)
+{
+  rng_state = seed ? seed : 1;
+  int total_weight = 0;
+  for(int op = OP_CREATE; op < N_OPS; ++op)
+    total_weight += mix[op];
+
+  printf("# zworkload gen -s %llu -n %d -m %d:%d:%d:%d:%d -d %d -z %d:%d -b %d\n",
+         seed, n_ops, mix[OP_CREATE], mix[OP_APPEND], mix[OP_READ], mix[OP_REMOVE],
+         mix[OP_LINK], n_dirs, min_size, max_size, budget);
+  for(int d = 0; d < n_dirs; ++d)
+    printf("mkdir /d%d\n", d);
+
+  // Inodes left for files once the root and the directories have theirs
+  int max_files = N_INODES - 1 - n_dirs;
+  int serial = 0;
+  for(int i = 0; i < n_ops; ++i) {
+    // Pick an operation, then fall back to one that is possible
+    int pick = rng_below(total_weight);
+    int op = OP_CREATE;
+    while(pick >= mix[op])
+      pick -= mix[op++];
+    if(n_names == 0)
+      op = OP_CREATE;
+    int size = rng_size(min_size, max_size);
+    if((op == OP_CREATE || op == OP_APPEND) &&
+       gen_blocks_used() + (size + BLOCK_SIZE - 1) / BLOCK_SIZE > budget)
+      op = n_names > 0 ? OP_REMOVE : OP_READ;
+    if(op == OP_READ && n_names == 0)
+      continue;
+
+    int n = n_names > 0 ? rng_below(n_names) : 0;
+    if(op == OP_CREATE) {
+      int f;
+      int n_files = 0;
+      for(f = 0; f < N_INODES; ++f)
+        n_files += files[f].n_names > 0;
+      for(f = 0; f < N_INODES && files[f].n_names > 0; ++f)
+        ;
+      int m = n_files < max_files ? gen_new_name(n_dirs, &serial) : -1;
+      if(m < 0)
+        continue;
+      names[m].file = f;
+      files[f].size = size;
+      files[f].n_names = 1;
+      printf("create %s %d\n", names[m].path, size);
+    }else if(op == OP_APPEND) {
+      GEN_FILE *file = &files[names[n].file];
+      size = MIN(size, MAX_FILE_SIZE - file->size);
+      if(size == 0)
+        continue;
+      file->size += size;
+      printf("append %s %d\n", names[n].path, size);
+    }else if(op == OP_READ) {
+      printf("read %s\n", names[n].path);
+    }else if(op == OP_REMOVE) {
+      printf("remove %s\n", names[n].path);
+      gen_drop_name(n);
+    }else{
+      int m = gen_new_name(n_dirs, &serial);
+      if(m < 0)
+        continue;
+      names[m].file = names[n].file;
+      ++files[names[n].file].n_names;
+      printf("link %s %s\n", names[n].path, names[m].path);
+    }
+  }
+}
+
+/**********************************************************************/
+// Replay
+
+// Latency of every operation, in nanoseconds, per kind
+static long long *latency[N_OPS];
+static int n_latency[N_OPS];
+static int n_failed[N_OPS];
+
+static long long elapsed_ns(struct timespec *start, struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) * 1000000000LL + (end->tv_nsec - start->tv_nsec);
+}
+
+static int compare_ns(const void *p, const void *q)
+{
+  long long a = *(const long long *) p;
+  long long b = *(const long long *) q;
+  return (a > b) - (a < b);
+}
+
+// Latency at a fraction of the sorted samples, in microseconds
+static double percentile_us(long long *samples, int n, double fraction)
+{
+  return samples[(int) ((n - 1) * fraction)] / 1000.0;
+}
+
+// Run one operation of the trace
+static int replay_op(char *cwd, int op, char *path, char *path2, int size,
+                     unsigned char *buf)
+{
+  OUFILE *fp;
+  switch(op) {
+  case OP_MKDIR:
+    return oufs_mkdir(cwd, path);
+  case OP_CREATE:
+  case OP_APPEND:
+    fp = oufs_fopen(cwd, path, op == OP_CREATE ? 'w' : 'a');
+    if(fp == NULL)
+      return -1;
+    int written = oufs_fwrite(fp, buf, size);
+    oufs_fclose(fp);
+    return written == size ? 0 : -1;
+  case OP_READ:
+    fp = oufs_fopen(cwd, path, 'r');
+    if(fp == NULL)
+      return -1;
+    oufs_fread(fp, buf, MAX_FILE_SIZE);
+    oufs_fclose(fp);
+    return 0;
+  case OP_REMOVE:
+    return oufs_remove(cwd, path);
+  default:
+    return oufs_link(cwd, path, path2);
+  }
+}
+
+/**
+ * Replay a trace against the disk and report what it cost
+ *
+ * @param trace The trace file
+ * @return 0 on success; <0 if the trace cannot be read
+ */
+static int replay_trace(FILE *trace)
+{
+  char cwd[] = "/";
+  unsigned char buf[MAX_FILE_SIZE];
+  for(int i = 0; i < MAX_FILE_SIZE; ++i)
+    buf[i] = 'a' + i % 26;
+  int capacity = 1024;
+  for(int op = 0; op < N_OPS; ++op)
+    latency[op] = malloc(capacity * sizeof(long long));
+
+  char line[3 * MAX_PATH_LENGTH];
+  long long total_ns = 0;
+  while(fgets(line, sizeof(line), trace) != NULL) {
+    char kind[16];
+    char path[MAX_PATH_LENGTH];
+    char path2[MAX_PATH_LENGTH] = "";
+    char arg[MAX_PATH_LENGTH] = "";
+    if(line[0] == '#' || sscanf(line, "%15s %199s %199s", kind, path, arg) < 2)
+      continue;
+    int op;
+    for(op = 0; op < N_OPS && strcmp(kind, op_names[op]) != 0; ++op)
+      ;
+    if(op == N_OPS) {
+      fprintf(stderr, "zworkload: unknown operation %s\n", kind);
+      return -1;
+    }
+    int size = 0;
+    if(op == OP_LINK)
+      strcpy(path2, arg);
+    else
+      size = MIN(MAX(atoi(arg), 0), MAX_FILE_SIZE);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int ret = replay_op(cwd, op, path, path2, size, buf);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if(ret != 0)
+      ++n_failed[op];
+    if(n_latency[op] == capacity) {
+      capacity *= 2;
+      for(int o = 0; o < N_OPS; ++o)
+        latency[o] = realloc(latency[o], capacity * sizeof(long long));
+    }
+    latency[op][n_latency[op]++] = elapsed_ns(&start, &end);
+    total_ns += elapsed_ns(&start, &end);
+  }
+
+  // Throughput and latency
+  int n_ops = 0;
+  int n_fails = 0;
+  for(int op = 0; op < N_OPS; ++op) {
+    n_ops += n_latency[op];
+    n_fails += n_failed[op];
+  }
+  printf("zworkload: %d operations (%d failed) in %.3f s, %.0f ops/s\n", n_ops,
+         n_fails, total_ns / 1e9, total_ns > 0 ? n_ops / (total_ns / 1e9) : 0.0);
+  printf("%-8s %8s %8s %9s %9s %9s %9s\n", "op", "count", "failed", "p50(us)",
+         "p99(us)", "p99.9(us)", "max(us)");
+  for(int op = 0; op < N_OPS; ++op) {
+    int n = n_latency[op];
+    if(n == 0)
+      continue;
+    qsort(latency[op], n, sizeof(long long), compare_ns);
+    printf("%-8s %8d %8d %9.2f %9.2f %9.2f %9.2f\n", op_names[op], n, n_failed[op],
+           percentile_us(latency[op], n, 0.5), percentile_us(latency[op], n, 0.99),
+           percentile_us(latency[op], n, 0.999), latency[op][n - 1] / 1000.0);
+    free(latency[op]);
+  }
+
+  // What the workload left behind
+  BLOCK master;
+  BLOCK inode_blocks[N_INODE_BLOCKS];
+  BLOCK_REFERENCE inode_refs[N_INODE_BLOCKS];
+  for(int b = 0; b < N_INODE_BLOCKS; ++b)
+    inode_refs[b] = b + 1;
+  vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
+  vdisk_read_blocks(inode_refs, N_INODE_BLOCKS, inode_blocks);
+  int n_blocks = oufs_disk_blocks(&master);
+  int used_blocks = 0;
+  int used_inodes = 0;
+  for(int b = 0; b < n_blocks; ++b)
+    used_blocks += (master.master.block_allocated_flag[b >> 3] >> (b & 7)) & 1;
+  for(int i = 0; i < N_INODES; ++i)
+    used_inodes += (master.master.inode_allocated_flag[i >> 3] >> (i & 7)) & 1;
+  int n_files = 0;
+  int n_fragmented = 0;
+  int runs = 0;
+  for(int i = 0; i < N_INODES; ++i) {
+    INODE *inode = &inode_blocks[i / INODES_PER_BLOCK].inodes.inode[i % INODES_PER_BLOCK];
+    if(!(master.master.inode_allocated_flag[i >> 3] & (1 << (i & 7))) || !oufs_is_file(inode))
+      continue;
+    int r = oufs_inode_runs(inode);
+    ++n_files;
+    runs += r;
+    n_fragmented += r > 1;
+  }
+  printf("space: %d of %d blocks, %d of %d inodes in use\n", used_blocks, n_blocks,
+         used_inodes, (int) N_INODES);
+  printf("fragmentation: %d files, %d fragmented, %.2f runs per file\n", n_files,
+         n_fragmented, n_files > 0 ? (double) runs / n_files : 0.0);
+  return 0;
+}
+
+/**********************************************************************/
+
+static void usage()
+{
+  fprintf(stderr, "Usage: zworkload gen [-s <seed>] [-n <ops>] [-m <create:append:read:remove:link>]\n");
+  fprintf(stderr, "                     [-d <directories>] [-z <min>:<max>] [-b <blocks>]\n");
+  fprintf(stderr, "       zworkload replay <trace>\n");
+}
+
+int main(int argc, char** argv) {
+  if(argc >= 2 && strcmp(argv[1], "gen") == 0) {
+    unsigned long long seed = 1;
+    int n_ops = 1000;
+    int mix[N_OPS] = { 0, 30, 20, 30, 15, 5 };
+    int n_dirs = 4;
+    int min_size = 16;
+    int max_size = MAX_FILE_SIZE;
+    int budget = N_BLOCKS_IN_DISK - SNAPSHOT_TABLE_BLOCK - 1 - N_INODES / 4;
+    for(int i = 2; i < argc; i += 2) {
+      if(i + 1 >= argc) {
+        usage();
+        return(1);
+      }
+      char *value = argv[i + 1];
+      int ok = 1;
+      if(strcmp(argv[i], "-s") == 0)
+        seed = strtoull(value, NULL, 10);
+      else if(strcmp(argv[i], "-n") == 0)
+        n_ops = atoi(value);
+      else if(strcmp(argv[i], "-m") == 0)
+        ok = sscanf(value, "%d:%d:%d:%d:%d", &mix[OP_CREATE], &mix[OP_APPEND],
+                    &mix[OP_READ], &mix[OP_REMOVE], &mix[OP_LINK]) == 5;
+      else if(strcmp(argv[i], "-d") == 0)
+        n_dirs = atoi(value);
+      else if(strcmp(argv[i], "-z") == 0)
+        ok = sscanf(value, "%d:%d", &min_size, &max_size) == 2;
+      else if(strcmp(argv[i], "-b") == 0)
+        budget = atoi(value);
+      else
+        ok = 0;
+      if(!ok) {
+        usage();
+        return(1);
+      }
+    }
+    int total_weight = 0;
+    int negative = 0;
+    for(int op = OP_CREATE; op < N_OPS; ++op) {
+      total_weight += mix[op];
+      negative |= mix[op] < 0;
+    }
+    if(n_ops < 0 || negative || total_weight <= 0 || n_dirs < 1 ||
+       n_dirs > DIRECTORY_ENTRIES_PER_BLOCK - 2 || min_size < 1 ||
+       max_size < min_size || max_size > MAX_FILE_SIZE) {
+      usage();
+      return(1);
+    }
+    gen_trace(seed, n_ops, mix, n_dirs, min_size, max_size, budget);
+    return(0);
+
+  }else if(argc == 3 && strcmp(argv[1], "replay") == 0) {
+    FILE *trace = strcmp(argv[2], "-") == 0 ? stdin : fopen(argv[2], "r");
+    if(trace == NULL) {
+      fprintf(stderr, "zworkload: cannot open %s\n", argv[2]);
+      return(1);
+    }
+
+    // Fetch the key environment vars
+    char cwd[MAX_PATH_LENGTH];
+    char disk_name[MAX_PATH_LENGTH];
+    oufs_get_environment(cwd, disk_name);
+    if(vdisk_disk_open(disk_name) != 0)
+      return(1);
+    int ret = replay_trace(trace);
+    vdisk_disk_close();
+    return(ret == 0 ? 0 : 1);
+
+  }else{
+    usage();
+    return(1);
+  }
+
+}